@@ -4,121 +4,711 @@
 #include "roce_common.h"
 #include "roce_common.c"
 
-//Basic Resources for RDMA connection
-static struct rdma_event_channel *cm_event_channel = NULL;
-static struct rdma_cm_id *cm_client_id = NULL;
-static struct ibv_pd *pd = NULL;
-static struct ibv_comp_channel *io_completion_channel = NULL;
-static struct ibv_cq *client_cq = NULL;
-static struct ibv_qp_init_attr qp_init_attr;
-static struct ibv_qp *client_qp;
-
-//Memory resources for RDMA connection
-static struct ibv_mr *client_metadata_mr = NULL, *client_send_buf_mr = NULL, *client_recv_buf_mr = NULL, *server_metadata_mr = NULL;
-static struct roce_buffer_attr client_metadata_attr, server_metadata_attr;
-static struct ibv_send_wr client_send_wr, *bad_client_send_wr = NULL;
-static struct ibv_recv_wr server_recv_wr, *bad_server_recv_wr = NULL;
-static struct ibv_sge client_send_sge, server_recv_sge;
-
-//Send and receive buffer for RDMA connection
-static char *send_buf = NULL, *recv_buf = NULL; 
+//Limits for benchmark threads and connections
+#define MAX_THREADS (64)
+#define MAX_QPS_PER_THREAD (64)
+
+//Header fragment split off the message in scatter-gather mode unless -F is given
+#define DEFAULT_SGE_HEADER (64)
+
+//WRs chained into one ibv_post_send, batch mode sweeps up to DEFAULT_BATCH unless -b is given
+#define MAX_BATCH (64)
+#define DEFAULT_BATCH (32)
+
+//Time the CM may take to resolve address and route
+#define RESOLVE_TIMEOUT_MS (2000)
+
+//Memory of a thread is registered for local access only, the one buffer the server writes into gets an MR of its own
+#define CLIENT_MEM_ACCESS (IBV_ACCESS_LOCAL_WRITE)
+#define CLIENT_REMOTE_ACCESS (IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE)
+
+//Resources of one RDMA connection
+struct client_conn {
+	struct rdma_cm_id *cm_client_id;
+	struct ibv_qp *client_qp;
+
+	//Memory resources for RDMA connection, handed out by the allocator of the thread
+	struct roce_mem client_metadata, client_send_mem, client_recv_mem, server_metadata;
+	struct roce_buffer_attr *client_metadata_attr, *server_metadata_attr;
+	struct ibv_send_wr client_send_wr, *bad_client_send_wr;
+	struct ibv_recv_wr server_recv_wr, *bad_server_recv_wr;
+	struct ibv_sge client_send_sge, server_recv_sge;
+
+	//Send and receive buffer for RDMA connection
+	char *send_buf, *recv_buf;
+
+	//Inline size of the QP and inline flag of the prepared Work Request
+	uint32_t max_inline;
+	int inline_flag;
+
+	//Receive ring for echoed messages in ping-pong mode
+	struct roce_recv_ring recv_ring;
+	uint32_t server_ring_slots;
+
+	//Fragments of a message in scatter-gather mode, each in a registered region of its own
+	struct ibv_mr *frag_mr[MAX_SGE];
+	struct ibv_sge frag_sge[MAX_SGE];
+
+	//Atomic slot value before and after the FETCH-ADD run
+	uint64_t counter_start, counter_end;
+
+	//Progress in bandwidth and ping-pong mode
+	int posted, completed, echoed;
+	uint8_t seq;
+
+	//Chain of WRs posted with one doorbell, copied from the prepared WR once per run
+	struct ibv_send_wr batch_wr[MAX_BATCH];
+	struct ibv_sge batch_sge[MAX_BATCH];
+
+	//Checksum request and reply, and digest of the bulk segments checksummed so far
+	struct roce_mem checksum_mem;
+	uint32_t digest;
+
+	//Connection rate mode: start of the CM phase the connection is in and of its setup
+	uint64_t phase_start, setup_start;
+	int checksummed;
+};
+
+//Benchmarked operations, WRITE is posted inline if it fits and WRITE-DMA never is,
+//WRITE-COPY gathers the fragments of a message with memcpy and WRITE-SGE with one SGE per fragment,
+//FETCH-ADD and CMP-SWAP operate on the first 8 bytes of the server buffer,
+//BIDIR-OUT are WRITEs to the server while it writes BIDIR-IN back at the same time
+enum client_op {
+	OP_WRITE,
+	OP_READ,
+	OP_WRITE_DMA,
+	OP_SEND,
+	OP_WRITE_POLL,
+	OP_WRITE_IMM,
+	OP_WRITE_COPY,
+	OP_WRITE_SGE,
+	OP_FETCH_ADD,
+	OP_CMP_SWAP,
+	OP_BIDIR_OUT,
+	OP_BIDIR_IN,
+	OP_COUNT,
+};
+
+static const char *op_names[OP_COUNT] = { "WRITE", "READ", "WRITE-DMA", "SEND", "WRITE-PP", "WRITE-IMM", "WRITE-COPY", "WRITE-SGE", "FETCH-ADD", "CMP-SWAP",
+		"BIDIR-OUT", "BIDIR-IN" };
+static const enum ibv_wr_opcode op_codes[OP_COUNT] = { IBV_WR_RDMA_WRITE, IBV_WR_RDMA_READ, IBV_WR_RDMA_WRITE, IBV_WR_SEND, IBV_WR_RDMA_WRITE, IBV_WR_RDMA_WRITE_WITH_IMM,
+		IBV_WR_RDMA_WRITE, IBV_WR_RDMA_WRITE, IBV_WR_ATOMIC_FETCH_AND_ADD, IBV_WR_ATOMIC_CMP_AND_SWP, IBV_WR_RDMA_WRITE, IBV_WR_RDMA_WRITE_WITH_IMM };
+
+//Results of one operation measured by one thread
+struct client_op_result {
+	struct roce_histogram hist;
+	uint64_t start_ns;
+	uint64_t end_ns;
+	uint64_t messages;
+	uint64_t cpu_ns;
+	uint64_t succeeded;
+
+	//Latency split at the completion timestamp into NIC and host software time
+	struct roce_histogram nic_hist;
+	struct roce_histogram host_hist;
+};
+
+//Connection setup phases timed separately from the benchmark
+enum client_setup_phase {
+	SETUP_RESOLVE,
+	SETUP_REGISTER,
+	SETUP_CONNECT,
+	SETUP_METADATA,
+	SETUP_PHASES,
+};
+
+static const char *setup_phase_names[SETUP_PHASES] = { "resolve+QP", "register", "connect", "metadata" };
+
+//Phases of a connection in connection rate mode, total is the setup from creating the CM ID until it is established.
+//PD and CQ are created once per thread, so their phase has one sample per thread and is left out of the total
+enum client_conn_phase {
+	CONN_ADDR,
+	CONN_ROUTE,
+	CONN_PD_CQ,
+	CONN_QP,
+	CONN_CONNECT,
+	CONN_TEARDOWN,
+	CONN_TOTAL,
+	CONN_PHASES,
+};
+
+static const char *conn_phase_names[CONN_PHASES] = { "addr", "route", "PD/CQ", "QP", "connect", "teardown", "total" };
+
+//Benchmark thread owning a CQ and one or more connections
+struct client_thread {
+	int id;
+	int cpu;
+	pthread_t thread;
+	int ret;
+
+	//Basic Resources shared by all connections of the thread
+	struct rdma_event_channel *cm_event_channel;
+	struct ibv_pd *pd;
+	struct roce_mem_pool mem;
+	struct ibv_comp_channel *io_completion_channel;
+	struct ibv_cq *client_cq;
+	uint32_t max_inline;
+
+	struct client_conn *conns;
+	int num_conns, num_connected;
+
+	struct client_op_result results[OP_COUNT];
+	struct roce_cpu_usage usage_start, usage_end;
+	int batch;
+	uint64_t setup_ns[SETUP_PHASES];
+	struct client_op_result conn_results[CONN_PHASES];
+	int hw_timestamps;
+
+	//Capacity of the QPs and the CQ obtained from the device
+	struct ibv_qp_cap qp_cap;
+	int cq_size;
+
+	//Largest message and memory region of the device, bulk transfers are split into segments
+	uint64_t max_msg_size, max_mr_size;
+	uint64_t segment_size;
+};
+
+//Benchmark modes selectable with -m
+enum client_bench_mode {
+	MODE_SINGLE,
+	MODE_LATENCY,
+	MODE_BANDWIDTH,
+	MODE_SWEEP,
+	MODE_PINGPONG,
+	MODE_WRITE_POLL,
+	MODE_WRITE_IMM,
+	MODE_SGE,
+	MODE_ATOMIC,
+	MODE_BIDIR,
+	MODE_BULK,
+	MODE_BATCH,
+	MODE_CONN,
+};
+
+static const char *mode_names[] = { "single", "lat", "bw", "sweep", "pp", "wpp", "wimm", "sge", "atomic", "bidir", "bulk", "batch", "conn" };
+
+//Formats of the measurement records written next to the text output
+enum client_output {
+	OUTPUT_TEXT,
+	OUTPUT_JSON,
+	OUTPUT_CSV,
+};
+
+//Field of a measurement record, numbers below zero are missing
+struct client_field {
+	const char *key;
+	const char *str;
+	double num;
+};
+
+#define MAX_RECORD_FIELDS (48)
+
+struct client_record {
+	struct client_field fields[MAX_RECORD_FIELDS];
+	int num_fields;
+};
+
+//Environment of the run stored with every measurement record
+struct client_env {
+	char device[64];
+	int port;
+	int mtu;
+	int gid_index;
+	char kernel[160];
+	char cpu[128];
+	struct ibv_qp_cap qp_cap;
+	int cq_size;
+};
+
+//Give up waiting for the server to write back after this time
+#define WRITE_POLL_TIMEOUT_NS (5ULL * 1000000000ULL)
+
+//Benchmark configuration
+static struct sockaddr_in server_sockaddr;
+static enum client_bench_mode bench_mode = MODE_SINGLE;
+static int msg_size = 0;
+static int iterations = 1000, warmup = 100;
+static int queue_depth = 128, signal_interval = 16;
+static int reverse_depth = 0;
+static int post_batch = 0;
+static uint64_t transfer_size = 0;
+static uint64_t pattern_seed = 1;
+static int verify_checksum = 0;
+static uint32_t inline_size = 0;
+static int ring_slots = ROCE_RECV_RING_SLOTS;
+static int num_threads = 1, qps_per_thread = 1;
+static int thread_cpus[MAX_THREADS], num_thread_cpus = 0;
+static uint32_t frag_sizes[MAX_SGE];
+static int num_frags = 0;
+static int atomic_contention = 0;
+static int cq_timestamps = 0;
+static enum roce_clock timestamp_clock = ROCE_CLOCK_RAW;
+
+//Measurement records, written one per line by all threads
+static enum client_output output_format = OUTPUT_TEXT;
+static FILE *output_file = NULL;
+static const char *output_path = NULL;
+static pthread_mutex_t output_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct client_env run_env;
+
+//Receives every measurement record in addition to the output, set by roce_harness.c
+static void (*record_sink)(const struct client_record *record) = NULL;
+
+//Benchmark threads and their synchronisation
+static struct client_thread *threads = NULL;
+static pthread_barrier_t client_barrier;
+static int bench_failed = 0;
 
 //Basic functionality test to compare buffer memory blocks
-static int check_send_buf_recv_buf() {
-	return memcmp((void*) send_buf, (void*) recv_buf, strlen(send_buf));
+static int check_send_buf_recv_buf(struct client_conn *conn) {
+	return memcmp((void*) conn->send_buf, (void*) conn->recv_buf, conn->client_send_mem.length);
 }
 
-//Prepare client side connection resources for RDMA connectio
-static int client_prepare_connection(struct sockaddr_in *s_addr) {
-	struct rdma_cm_event *cm_event = NULL;
+//Atomic functional test: the slot grew by exactly the FETCH-ADDs posted to it
+static int check_atomic_counter(struct client_conn *conn) {
+	uint64_t expected = 2 * (uint64_t) (warmup + iterations);
+
+	//Contended slot is shared by all QPs of all threads
+	if (atomic_contention) {
+		expected *= (uint64_t) num_threads * qps_per_thread;
+	}
+
+	return conn->counter_end - conn->counter_start != expected;
+}
+
+//Ask the server for the digest of its buffer and compare it with the digest of the data written into it
+static int client_verify_checksum(struct client_thread *th, struct client_conn *conn) {
+	struct roce_checksum_msg *request = conn->checksum_mem.addr, *reply = request + 1;
+	struct ibv_recv_wr recv_wr, *bad_recv_wr = NULL;
+	struct ibv_send_wr send_wr, *bad_send_wr = NULL;
+	struct ibv_sge recv_sge, send_sge;
+	struct ibv_wc wc[2];
+	uint32_t expected;
 	int ret = -1;
 
-	//Open event channel and report asynchronous event to CM
-	cm_event_channel = rdma_create_event_channel();
-	if (!cm_event_channel) {
-		printf("Could not create CM Event Channel \n");
-		return -errno;
+	//Bulk transfers were checksummed segment by segment while they completed
+	if (bench_mode == MODE_BULK) {
+		request->length = transfer_size;
+		request->segment_size = th->segment_size;
+		expected = conn->digest;
+	} else {
+		request->length = msg_size;
+		request->segment_size = msg_size;
+		expected = roce_checksum_digest(conn->send_buf, msg_size, msg_size);
 	}
+	request->digest = 0;
 
-	//Create connection identifier and associate it with RDMA connection
-	ret = rdma_create_id(cm_event_channel, &cm_client_id, NULL, RDMA_PS_TCP);
+	recv_sge.addr = (uint64_t) reply;
+	recv_sge.length = sizeof(*reply);
+	recv_sge.lkey = conn->checksum_mem.lkey;
+
+	bzero(&recv_wr, sizeof(recv_wr));
+	recv_wr.sg_list = &recv_sge;
+	recv_wr.num_sge = 1;
+
+	ret = ibv_post_recv(conn->client_qp, &recv_wr, &bad_recv_wr);
 	if (ret) {
-		printf("Could not create CM ID /n"); 
-		return -errno;
+		printf("Could not post receive for checksum \n");
+		return -ret;
 	}
 
-	//Resolve destination address to RDMA address
-	ret = rdma_resolve_addr(cm_client_id, NULL, (struct sockaddr*) s_addr, 2000);
-	if (ret) {
-		printf("Could not resolve address \n");
-		return -errno;
+	send_sge.addr = (uint64_t) request;
+	send_sge.length = sizeof(*request);
+	send_sge.lkey = conn->checksum_mem.lkey;
+
+	bzero(&send_wr, sizeof(send_wr));
+	send_wr.sg_list = &send_sge;
+	send_wr.num_sge = 1;
+	send_wr.opcode = IBV_WR_SEND;
+	send_wr.send_flags = IBV_SEND_SIGNALED;
+	if (send_sge.length <= conn->max_inline) {
+		send_wr.send_flags |= IBV_SEND_INLINE;
 	}
 
-	//Report Address Resolved event to CM
-	ret  = process_rdma_cm_event(cm_event_channel, RDMA_CM_EVENT_ADDR_RESOLVED, &cm_event);
+	ret = roce_post_send(conn->client_qp, &send_wr, &bad_send_wr);
 	if (ret) {
-		printf("Could not receive valid CM Event \n");
-		return ret;
+		printf("Could not request checksum \n");
+		return -ret;
 	}
 
-	//Acknowledge CM event
-	ret = rdma_ack_cm_event(cm_event);
-	if (ret) {
-		printf("Could not acknowledge CM Event \n");
-		return -errno;
+	//Expect WC Events for request and reply
+	ret = process_wc_events(th->client_cq, wc, 2);
+	if (ret != 2) {
+		printf("Could not get WC Events \n");
+		return ret ? ret : -EIO;
 	}
 
-	//Resolve RDMA route to destination address
-	ret = rdma_resolve_route(cm_client_id, 2000);
+	if (reply->digest != expected || reply->length != request->length) {
+		printf("Checksum of server %08x over %lu bytes does not match %08x \n", reply->digest, reply->length, expected);
+		return -EIO;
+	}
+	printf("Checksum of server matches: %08x over %lu bytes in segments of %lu bytes \n", expected, request->length, request->segment_size);
+
+	return 0;
+}
+
+//Non-inline WRITE is only measured next to inline WRITE in latency mode, SEND only in ping-pong mode,
+//bidirectional mode measures WRITE alone as baseline and verified bulk transfers are not read back
+static int client_op_active(enum client_op op) {
+	if (op == OP_SEND) {
+		return bench_mode == MODE_PINGPONG;
+	} else if (op == OP_WRITE_POLL) {
+		return bench_mode == MODE_WRITE_POLL;
+	} else if (op == OP_WRITE_IMM) {
+		return bench_mode == MODE_WRITE_IMM;
+	} else if (op == OP_WRITE_COPY || op == OP_WRITE_SGE) {
+		return bench_mode == MODE_SGE;
+	} else if (op == OP_FETCH_ADD || op == OP_CMP_SWAP) {
+		return bench_mode == MODE_ATOMIC;
+	} else if (op == OP_BIDIR_OUT || op == OP_BIDIR_IN) {
+		return bench_mode == MODE_BIDIR;
+	} else if (op == OP_READ && bench_mode == MODE_BULK && verify_checksum) {
+		return 0;
+	} else if (bench_mode == MODE_BIDIR) {
+		return op == OP_WRITE;
+	} else if (bench_mode == MODE_WRITE_POLL || bench_mode == MODE_WRITE_IMM || bench_mode == MODE_SGE || bench_mode == MODE_ATOMIC) {
+		return 0;
+	}
+	return op != OP_WRITE_DMA || (bench_mode == MODE_LATENCY && (uint32_t) msg_size <= inline_size);
+}
+
+//Wait for all benchmark threads, returns non-zero if any of them failed
+static int client_sync(int ret) {
+	int failed;
+
 	if (ret) {
-		printf("Could not resolve route \n");
-	       return -errno;
+		bench_failed = 1;
 	}
+	pthread_barrier_wait(&client_barrier);
+	failed = bench_failed;
 
-	//Report Route Resolved event to CM
-	ret = process_rdma_cm_event(cm_event_channel, RDMA_CM_EVENT_ROUTE_RESOLVED, &cm_event);
+	//Nobody may report a failure before everyone has read the flag
+	pthread_barrier_wait(&client_barrier);
+	return failed;
+}
+
+//Record device, port, MTU and GID of the first connection together with kernel, CPU and queue sizes
+static void client_collect_env(struct client_thread *th, struct client_conn *conn) {
+	struct ibv_context *verbs = conn->cm_client_id->verbs;
+	struct ibv_port_attr port_attr;
+	struct ibv_qp_attr qp_attr;
+	struct ibv_qp_init_attr qp_init_attr;
+	struct utsname uts;
+	char line[256], *value;
+	FILE *cpuinfo;
+
+	snprintf(run_env.device, sizeof(run_env.device), "%s", ibv_get_device_name(verbs->device));
+	run_env.port = conn->cm_client_id->port_num;
+
+	run_env.mtu = -1;
+	if (!ibv_query_port(verbs, run_env.port, &port_attr)) {
+		run_env.mtu = 128 << port_attr.active_mtu;
+	}
+
+	//RDMA CM selects the GID, it is found in the address vector of the QP
+	run_env.gid_index = -1;
+	if (!ibv_query_qp(conn->client_qp, &qp_attr, IBV_QP_AV, &qp_init_attr)) {
+		run_env.gid_index = qp_attr.ah_attr.grh.sgid_index;
+	}
+
+	snprintf(run_env.kernel, sizeof(run_env.kernel), "unknown");
+	if (!uname(&uts)) {
+		snprintf(run_env.kernel, sizeof(run_env.kernel), "%s %s", uts.sysname, uts.release);
+	}
+
+	snprintf(run_env.cpu, sizeof(run_env.cpu), "unknown");
+	cpuinfo = fopen("/proc/cpuinfo", "r");
+	if (cpuinfo) {
+		while (fgets(line, sizeof(line), cpuinfo)) {
+			value = strchr(line, ':');
+			if (!strncmp(line, "model name", 10) && value) {
+				value[strcspn(value, "\n")] = '\0';
+				snprintf(run_env.cpu, sizeof(run_env.cpu), "%s", value + 2);
+				break;
+			}
+		}
+		fclose(cpuinfo);
+	}
+
+	run_env.qp_cap = th->qp_cap;
+	run_env.cq_size = th->cq_size;
+}
+
+//Append field to a measurement record
+static void client_record_add(struct client_record *record, const char *key, const char *str, double num) {
+	if (record->num_fields == MAX_RECORD_FIELDS) {
+		return;
+	}
+	record->fields[record->num_fields].key = key;
+	record->fields[record->num_fields].str = str;
+	record->fields[record->num_fields].num = num;
+	record->num_fields++;
+}
+
+//Write string as JSON string or quoted CSV field
+static void client_output_string(const char *str) {
+	const char *c;
+
+	fputc('"', output_file);
+	for (c = str; *c; c++) {
+		if (*c == '"') {
+			fputs(output_format == OUTPUT_JSON ? "\\\"" : "\"\"", output_file);
+		} else if (*c == '\\' && output_format == OUTPUT_JSON) {
+			fputs("\\\\", output_file);
+		} else if ((unsigned char) *c >= 0x20) {
+			fputc(*c, output_file);
+		}
+	}
+	fputc('"', output_file);
+}
+
+//Write measurement record as one JSON line or CSV row, the CSV header precedes the first row of a file
+static void client_output_record(const struct client_record *record) {
+	static int header_written = 0;
+	const struct client_field *field;
+	int f;
+
+	pthread_mutex_lock(&output_lock);
+
+	if (output_format == OUTPUT_CSV && !header_written) {
+		if (ftell(output_file) <= 0) {
+			for (f = 0; f < record->num_fields; f++) {
+				fprintf(output_file, "%s%s", f ? "," : "", record->fields[f].key);
+			}
+			fputc('\n', output_file);
+		}
+		header_written = 1;
+	}
+
+	if (output_format == OUTPUT_JSON) {
+		fputc('{', output_file);
+	}
+	for (f = 0; f < record->num_fields; f++) {
+		field = &record->fields[f];
+		if (f) {
+			fputs(output_format == OUTPUT_JSON ? ", " : ",", output_file);
+		}
+		if (output_format == OUTPUT_JSON) {
+			fprintf(output_file, "\"%s\": ", field->key);
+		}
+
+		if (field->str) {
+			client_output_string(field->str);
+		} else if (field->num < 0) {
+			fputs(output_format == OUTPUT_JSON ? "null" : "", output_file);
+		} else {
+			fprintf(output_file, "%.15g", field->num);
+		}
+	}
+	fputs(output_format == OUTPUT_JSON ? "}\n" : "\n", output_file);
+	fflush(output_file);
+
+	pthread_mutex_unlock(&output_lock);
+}
+
+//Emit measurement record of one operation at one message size, latency and rate are left out if not measured
+static void client_emit_record(const char *op, uint64_t bytes, const struct client_op_result *result, int latency, int rate) {
+	const struct roce_histogram *hist = &result->hist;
+	struct client_record record;
+	double elapsed_us = (result->end_ns - result->start_ns) / 1000.0;
+
+	if (output_format == OUTPUT_TEXT && !record_sink) {
+		return;
+	}
+	if (elapsed_us <= 0) {
+		rate = 0;
+	}
+	latency = latency && hist->count;
+
+	record.num_fields = 0;
+	client_record_add(&record, "time", NULL, (double) time(NULL));
+	client_record_add(&record, "mode", mode_names[bench_mode], 0);
+	client_record_add(&record, "op", op, 0);
+	client_record_add(&record, "bytes", NULL, bytes);
+	client_record_add(&record, "iterations", NULL, iterations);
+	client_record_add(&record, "warmup", NULL, warmup);
+	client_record_add(&record, "queue_depth", NULL, queue_depth);
+	client_record_add(&record, "signal_interval", NULL, signal_interval);
+	client_record_add(&record, "threads", NULL, num_threads);
+	client_record_add(&record, "qps_per_thread", NULL, qps_per_thread);
+	client_record_add(&record, "batch", NULL, threads[0].batch);
+	client_record_add(&record, "samples", NULL, latency ? (double) hist->count : -1);
+	client_record_add(&record, "min_us", NULL, latency ? hist->min / 1000.0 : -1);
+	client_record_add(&record, "mean_us", NULL, latency ? roce_hist_mean(hist) / 1000.0 : -1);
+	client_record_add(&record, "p50_us", NULL, latency ? roce_hist_percentile(hist, 50.0) / 1000.0 : -1);
+	client_record_add(&record, "p99_us", NULL, latency ? roce_hist_percentile(hist, 99.0) / 1000.0 : -1);
+	client_record_add(&record, "p99_9_us", NULL, latency ? roce_hist_percentile(hist, 99.9) / 1000.0 : -1);
+	client_record_add(&record, "p99_99_us", NULL, latency ? roce_hist_percentile(hist, 99.99) / 1000.0 : -1);
+	client_record_add(&record, "max_us", NULL, latency ? hist->max / 1000.0 : -1);
+	client_record_add(&record, "nic_p50_us", NULL, result->nic_hist.count ? roce_hist_percentile(&result->nic_hist, 50.0) / 1000.0 : -1);
+	client_record_add(&record, "host_p50_us", NULL, result->host_hist.count ? roce_hist_percentile(&result->host_hist, 50.0) / 1000.0 : -1);
+	client_record_add(&record, "mb_per_s", NULL, rate ? ((double) bytes * result->messages) / elapsed_us : -1);
+	client_record_add(&record, "mmsg_per_s", NULL, rate ? result->messages / elapsed_us : -1);
+	client_record_add(&record, "cq_mode", roce_cq_mode_str(roce_get_cq_mode(NULL)), 0);
+	client_record_add(&record, "post_api", roce_post_api_str(roce_get_post_api()), 0);
+	client_record_add(&record, "clock", roce_clock_str(), 0);
+	client_record_add(&record, "device", run_env.device, 0);
+	client_record_add(&record, "port", NULL, run_env.port);
+	client_record_add(&record, "mtu", NULL, run_env.mtu);
+	client_record_add(&record, "gid_index", NULL, run_env.gid_index);
+	client_record_add(&record, "kernel", run_env.kernel, 0);
+	client_record_add(&record, "cpu", run_env.cpu, 0);
+	client_record_add(&record, "max_send_wr", NULL, run_env.qp_cap.max_send_wr);
+	client_record_add(&record, "max_recv_wr", NULL, run_env.qp_cap.max_recv_wr);
+	client_record_add(&record, "max_send_sge", NULL, run_env.qp_cap.max_send_sge);
+	client_record_add(&record, "max_inline", NULL, run_env.qp_cap.max_inline_data);
+	client_record_add(&record, "cq_size", NULL, run_env.cq_size);
+
+	if (output_format != OUTPUT_TEXT) {
+		client_output_record(&record);
+	}
+	if (record_sink) {
+		record_sink(&record);
+	}
+}
+
+//Emit measurement record of a single timed operation
+static void client_emit_single(const char *op, uint64_t bytes, uint64_t elapsed_ns) {
+	struct client_op_result result;
+
+	if (output_format == OUTPUT_TEXT && !record_sink) {
+		return;
+	}
+
+	bzero(&result, sizeof(result));
+	roce_hist_init(&result.hist);
+	roce_hist_record(&result.hist, elapsed_ns);
+	result.end_ns = elapsed_ns;
+	result.messages = 1;
+	client_emit_record(op, bytes, &result, 1, 1);
+}
+
+//Allocate send and receive buffer of connection from the registered memory of the thread
+static int client_alloc_buffers(struct client_thread *th, struct client_conn *conn) {
+	uint64_t offset = 0;
+	int f, ret = -1;
+
+	uint64_t length = (bench_mode == MODE_BULK) ? transfer_size : (uint64_t) msg_size;
+
+	//Each buffer is registered as a whole, so it has to fit into one memory region of the device
+	if (length > th->max_mr_size) {
+		printf("Buffer of %lu bytes exceeds the largest memory region of the device (%lu bytes) \n", length, th->max_mr_size);
+		return -EINVAL;
+	}
+
+	ret = roce_mem_alloc(&th->mem, length, &conn->client_send_mem);
 	if (ret) {
-		printf("Could not receive valid event \n");
+		printf("Could not allocate memory \n");
 		return ret;
 	}
+	conn->send_buf = conn->client_send_mem.addr;
+	roce_fill_pattern(conn->send_buf, length, pattern_seed, 0);
 
-	//Acknowledge CM event
-	ret = rdma_ack_cm_event(cm_event);
+	//Verified bulk transfers are not read back, so they need no second buffer of their size
+	if (bench_mode == MODE_BULK && verify_checksum) {
+		length = sizeof(struct roce_checksum_msg);
+	}
+	ret = roce_mem_alloc(&th->mem, length, &conn->client_recv_mem);
 	if (ret) {
-		printf("Could not acknowledge CM Event \n");
-		return -errno;
+		printf("Could not allocate memory \n");
+		return ret;
+	}
+	conn->recv_buf = conn->client_recv_mem.addr;
+	memset(conn->recv_buf, 0, length);
+
+	//Server writes into the receive buffer in WRITE ping-pong and bidirectional mode, its rkey reaches no other buffer of the thread
+	if (bench_mode == MODE_WRITE_POLL || bench_mode == MODE_WRITE_IMM || bench_mode == MODE_BIDIR) {
+		ret = roce_mem_expose(&th->mem, &conn->client_recv_mem, CLIENT_REMOTE_ACCESS);
+		if (ret) {
+			printf("Could not register receive buffer for remote access \n");
+			return ret;
+		}
 	}
 
-	printf("Trying to connect to server at : %s port: %d \n", inet_ntoa(s_addr->sin_addr), ntohs(s_addr->sin_port));
+	if (verify_checksum) {
+		ret = roce_mem_alloc(&th->mem, 2 * sizeof(struct roce_checksum_msg), &conn->checksum_mem);
+		if (ret) {
+			printf("Could not allocate memory \n");
+			return ret;
+		}
+	}
+
+	//Fragments are registered one by one like header and payload buffers of an application
+	for (f = 0; f < num_frags; f++) {
+		conn->frag_mr[f] = roce_alloc_buffer(th->pd, frag_sizes[f], IBV_ACCESS_LOCAL_WRITE);
+		if (!conn->frag_mr[f]) {
+			printf("Could not allocate fragment \n");
+			return -ENOMEM;
+		}
+		//Every fragment holds its part of the pattern, so gathered messages look like the send buffer
+		roce_fill_pattern(conn->frag_mr[f]->addr, frag_sizes[f], pattern_seed, offset);
+		offset += frag_sizes[f];
+
+		conn->frag_sge[f].addr = (uint64_t) conn->frag_mr[f]->addr;
+		conn->frag_sge[f].length = frag_sizes[f];
+		conn->frag_sge[f].lkey = conn->frag_mr[f]->lkey;
+	}
+
+	return 0;
+}
+
+//Create PD, Completion Channel and CQ shared by all connections of the thread
+static int client_setup_thread_resources(struct client_thread *th, struct ibv_context *verbs) {
+	struct ibv_device_attr dev_attr;
+	int ret = -1, cq_capacity;
 
 	//Create Protection Domain
-	pd = ibv_alloc_pd(cm_client_id->verbs);
-	if (!pd) {
+	th->pd = ibv_alloc_pd(verbs);
+	if (!th->pd) {
 		printf("Could not allocate PD \n");
 		return -errno;
 	}
+	roce_mem_pool_init(&th->mem, th->pd, CLIENT_MEM_ACCESS);
+
+	//Atomics are optional for RoCE devices
+	if (bench_mode == MODE_ATOMIC) {
+		ret = ibv_query_device(verbs, &dev_attr);
+		if (ret || dev_attr.atomic_cap == IBV_ATOMIC_NONE) {
+			printf("Device does not support atomics \n");
+			return -EOPNOTSUPP;
+		}
+	}
 
 	//Create Completion Channel for I/O Completion Notifications
-	io_completion_channel = ibv_create_comp_channel(cm_client_id->verbs);
-	if (!io_completion_channel) {
+	th->io_completion_channel = ibv_create_comp_channel(verbs);
+	if (!th->io_completion_channel) {
 		printf("Could not create Comp Channel \n");
 		return -errno;
 	}
 
-	//Create Completion Queue for I/O Completion Metadata
-	client_cq = ibv_create_cq(cm_client_id->verbs, CQ_CAPACITY, NULL, io_completion_channel, 0);
-	if (!client_cq) {
+	//Create Completion Queue for I/O Completion Metadata, large enough for all QPs of the thread
+	cq_capacity = 2 * MAX_WR * th->num_conns;
+	if (cq_capacity < CQ_CAPACITY) {
+		cq_capacity = CQ_CAPACITY;
+	}
+	th->client_cq = roce_create_cq(verbs, cq_capacity, NULL, th->io_completion_channel, cq_timestamps);
+	if (!th->client_cq) {
 		printf("Could not create CQ \n");
 		return -errno;
 	}
+	th->hw_timestamps = roce_cq_hw_timestamps();
+	th->cq_size = th->client_cq->cqe;
 
 	//Request CQ Notifications
-	ret = ibv_req_notify_cq(client_cq, 0);
+	ret = ibv_req_notify_cq(th->client_cq, 0);
 	if (ret) {
 		printf("Could not request CQ notifications /n");
 		return -errno;
 	}
 
+	return 0;
+}
+
+//Create QP of a connection with resolved route on the resources of the thread
+static int client_create_qp(struct client_thread *th, struct client_conn *conn) {
+	struct ibv_qp_init_attr qp_init_attr;
+	int ret = -1;
+
 	//Set up send and receive Queue Pair queues and their capacity
     bzero(&qp_init_attr, sizeof qp_init_attr);
     qp_init_attr.cap.max_recv_sge = MAX_SGE;
@@ -126,46 +716,124 @@ static int client_prepare_connection(struct sockaddr_in *s_addr) {
     qp_init_attr.cap.max_send_sge = MAX_SGE;
     qp_init_attr.cap.max_send_wr = MAX_WR;
     qp_init_attr.qp_type = IBV_QPT_RC;
-	qp_init_attr.recv_cq = client_cq; 
-    qp_init_attr.send_cq = client_cq;
+	qp_init_attr.recv_cq = th->client_cq;
+    qp_init_attr.send_cq = th->client_cq;
 
-	//Create Queue Pair
-    ret = rdma_create_qp(cm_client_id, pd, &qp_init_attr);
+	//Create Queue Pair with the largest inline size available up to the requested one
+    ret = roce_create_qp(conn->cm_client_id, th->pd, &qp_init_attr, inline_size);
 	if (ret) {
 		printf("Could not create QP \n");
-	       return -errno;
+	       return ret;
+	}
+
+	conn->client_qp = conn->cm_client_id->qp;
+	conn->max_inline = qp_init_attr.cap.max_inline_data;
+	th->qp_cap = qp_init_attr.cap;
+	if (!conn->max_inline && inline_size) {
+		printf("Device does not support inline data \n");
 	}
 
-	client_qp = cm_client_id->qp;
+	//Thread reports the inline size all of its QPs support
+	if (th->num_connected == 0 || conn->max_inline < th->max_inline) {
+		th->max_inline = conn->max_inline;
+	}
 
 	return 0;
 }
 
+//Prepare client side connection resources for RDMA connectio
+static int client_prepare_connection(struct client_thread *th, struct client_conn *conn, struct sockaddr_in *s_addr) {
+	struct rdma_cm_event *cm_event = NULL;
+	int ret = -1;
+
+	//Create connection identifier and associate it with RDMA connection
+	ret = rdma_create_id(th->cm_event_channel, &conn->cm_client_id, NULL, RDMA_PS_TCP);
+	if (ret) {
+		printf("Could not create CM ID /n");
+		return -errno;
+	}
+
+	//Resolve destination address to RDMA address
+	ret = rdma_resolve_addr(conn->cm_client_id, NULL, (struct sockaddr*) s_addr, RESOLVE_TIMEOUT_MS);
+	if (ret) {
+		printf("Could not resolve address \n");
+		return -errno;
+	}
+
+	//Report Address Resolved event to CM
+	ret  = process_rdma_cm_event(th->cm_event_channel, RDMA_CM_EVENT_ADDR_RESOLVED, &cm_event);
+	if (ret) {
+		printf("Could not receive valid CM Event \n");
+		return ret;
+	}
+
+	//Acknowledge CM event
+	ret = rdma_ack_cm_event(cm_event);
+	if (ret) {
+		printf("Could not acknowledge CM Event \n");
+		return -errno;
+	}
+
+	//Resolve RDMA route to destination address
+	ret = rdma_resolve_route(conn->cm_client_id, RESOLVE_TIMEOUT_MS);
+	if (ret) {
+		printf("Could not resolve route \n");
+	       return -errno;
+	}
+
+	//Report Route Resolved event to CM
+	ret = process_rdma_cm_event(th->cm_event_channel, RDMA_CM_EVENT_ROUTE_RESOLVED, &cm_event);
+	if (ret) {
+		printf("Could not receive valid event \n");
+		return ret;
+	}
+
+	//Acknowledge CM event
+	ret = rdma_ack_cm_event(cm_event);
+	if (ret) {
+		printf("Could not acknowledge CM Event \n");
+		return -errno;
+	}
+
+	printf("Trying to connect to server at : %s port: %d \n", inet_ntoa(s_addr->sin_addr), ntohs(s_addr->sin_port));
+
+	//PD, Completion Channel and CQ are shared by all connections of the thread
+	if (!th->pd) {
+		ret = client_setup_thread_resources(th, conn->cm_client_id->verbs);
+		if (ret) {
+			return ret;
+		}
+	}
+
+	return client_create_qp(th, conn);
+}
+
 //Pre-post RB
-static int client_pre_post_recv_buffer()
+static int client_pre_post_recv_buffer(struct client_thread *th, struct client_conn *conn)
 {
 	int ret = -1;
 
-	//Register buffer for metadata
-	server_metadata_mr = roce_register_buffer(pd, &server_metadata_attr, sizeof(server_metadata_attr), (IBV_ACCESS_LOCAL_WRITE));
-	if(!server_metadata_mr){
+	//Allocate buffer for metadata
+	ret = roce_mem_alloc(&th->mem, sizeof(*conn->server_metadata_attr), &conn->server_metadata);
+	if (ret) {
 		printf("Could not set up server metadata \n");
-		return -ENOMEM;
+		return ret;
 	}
+	conn->server_metadata_attr = conn->server_metadata.addr;
 
 	//Fill up SGE
-	server_recv_sge.addr = (uint64_t) server_metadata_mr->addr;
-	server_recv_sge.length = (uint32_t) server_metadata_mr->length;
-	server_recv_sge.lkey = (uint32_t) server_metadata_mr->lkey;
+	conn->server_recv_sge.addr = (uint64_t) conn->server_metadata.addr;
+	conn->server_recv_sge.length = conn->server_metadata.length;
+	conn->server_recv_sge.lkey = conn->server_metadata.lkey;
 
 	//Link SGE to Receive Work Request
-	bzero(&server_recv_wr, sizeof(server_recv_wr));
+	bzero(&conn->server_recv_wr, sizeof(conn->server_recv_wr));
 
-	server_recv_wr.sg_list = &server_recv_sge;
-	server_recv_wr.num_sge = 1;
+	conn->server_recv_wr.sg_list = &conn->server_recv_sge;
+	conn->server_recv_wr.num_sge = 1;
 
 	//Pre-post receive buffer
-	ret = ibv_post_recv(client_qp, &server_recv_wr, &bad_server_recv_wr);
+	ret = ibv_post_recv(conn->client_qp, &conn->server_recv_wr, &conn->bad_server_recv_wr);
 	if (ret) {
 		printf("Could not pre-post receive buffer \n");
 		return ret;
@@ -174,11 +842,10 @@ static int client_pre_post_recv_buffer()
 	return 0;
 }
 
-//Connect to server
-static int client_connect_to_server() 
-{
+//Send connect request of a connection with QP to the server
+static int client_start_connect(struct client_conn *conn) {
 	struct rdma_conn_param conn_param;
-	struct rdma_cm_event *cm_event = NULL;
+	struct roce_connect_data connect_data;
 	int ret = -1;
 
 	//Set up connection parameters
@@ -186,16 +853,39 @@ static int client_connect_to_server()
 	conn_param.initiator_depth = 3;
 	conn_param.responder_resources = 3;
 	conn_param.retry_count = 3;
+	conn_param.rnr_retry_count = 7;
+
+	//Contending QPs must share a PD on the server to reach the same slot
+	bzero(&connect_data, sizeof(connect_data));
+	if (atomic_contention) {
+		connect_data.flags = ROCE_CONNECT_SHARED_PD;
+	}
+	conn_param.private_data = &connect_data;
+	conn_param.private_data_len = sizeof(connect_data);
 
 	//Connect to server
-	ret = rdma_connect(cm_client_id, &conn_param);
+	ret = rdma_connect(conn->cm_client_id, &conn_param);
 	if (ret) {
 		printf("Could not connect to remote host \n");
 		return -errno;
 	}
 
+	return 0;
+}
+
+//Connect to server
+static int client_connect_to_server(struct client_thread *th, struct client_conn *conn)
+{
+	struct rdma_cm_event *cm_event = NULL;
+	int ret = -1;
+
+	ret = client_start_connect(conn);
+	if (ret) {
+		return ret;
+	}
+
 	//Process CM event
-	ret = process_rdma_cm_event(cm_event_channel, RDMA_CM_EVENT_ESTABLISHED, &cm_event);
+	ret = process_rdma_cm_event(th->cm_event_channel, RDMA_CM_EVENT_ESTABLISHED, &cm_event);
 	if (ret) {
 		printf("Could not get CM Event \n");
 	       return ret;
@@ -214,100 +904,142 @@ static int client_connect_to_server()
 }
 
 //Exchange buffer metadata with server
-static int exchange_metadata() {
+static int exchange_metadata(struct client_thread *th, struct client_conn *conn) {
 	struct ibv_wc wc[2];
 	int ret = -1;
 
-	//Register Memory Region for send buffer
-	client_send_buf_mr = roce_register_buffer(pd, send_buf, strlen(send_buf), (IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_WRITE));
-	if(!client_send_buf_mr) {
+	//Allocate metadata buffer
+	ret = roce_mem_alloc(&th->mem, sizeof(*conn->client_metadata_attr), &conn->client_metadata);
+	if (ret) {
 		printf("Could not register buffer \n");
 		return ret;
 	}
+	conn->client_metadata_attr = conn->client_metadata.addr;
+
+	//Prepate metadata for send buffer, in WRITE ping-pong and bidirectional mode the server writes into the receive buffer,
+	//the only buffer with a remotely valid rkey, other modes never access client memory from the server
+	if (bench_mode == MODE_WRITE_POLL || bench_mode == MODE_WRITE_IMM || bench_mode == MODE_BIDIR) {
+		conn->client_metadata_attr->address = (uint64_t) conn->client_recv_mem.addr;
+		conn->client_metadata_attr->length = conn->client_recv_mem.length;
+		conn->client_metadata_attr->stag.remote_stag = conn->client_recv_mem.rkey;
+	} else {
+		conn->client_metadata_attr->address = (uint64_t) conn->client_send_mem.addr;
+		conn->client_metadata_attr->length = conn->client_send_mem.length;
+		conn->client_metadata_attr->stag.remote_stag = conn->client_send_mem.rkey;
+	}
 
-	//Prepate metadata for buffer
-	client_metadata_attr.address = (uint64_t) client_send_buf_mr->addr; 
-	client_metadata_attr.length = client_send_buf_mr->length; 
-	client_metadata_attr.stag.local_stag = client_send_buf_mr->lkey;
-
-	//Register metadata Memory Region
-	client_metadata_mr = roce_register_buffer(pd, &client_metadata_attr, sizeof(client_metadata_attr), IBV_ACCESS_LOCAL_WRITE);
-	if(!client_metadata_mr) {
-		printf("Could not register buffer \n");
-		return ret;
+	//Tell the server how to take part in the benchmark
+	switch (bench_mode) {
+		case MODE_PINGPONG:
+			conn->client_metadata_attr->mode = ROCE_SESSION_ECHO;
+			break;
+		case MODE_WRITE_POLL:
+			conn->client_metadata_attr->mode = ROCE_SESSION_WRITE_POLL;
+			break;
+		case MODE_WRITE_IMM:
+			conn->client_metadata_attr->mode = ROCE_SESSION_WRITE_IMM;
+			break;
+		case MODE_ATOMIC:
+			conn->client_metadata_attr->mode = atomic_contention ? ROCE_SESSION_ATOMIC_SHARED : ROCE_SESSION_ATOMIC;
+			break;
+		case MODE_BIDIR:
+			conn->client_metadata_attr->mode = ROCE_SESSION_BIDIR;
+			break;
+		default:
+			conn->client_metadata_attr->mode = ROCE_SESSION_PASSIVE;
+			break;
 	}
+	conn->client_metadata_attr->depth = ring_slots;
+	conn->client_metadata_attr->count = iterations;
+	conn->client_metadata_attr->queue_depth = reverse_depth;
 
 	//Fill up SGE
-	client_send_sge.addr = (uint64_t) client_metadata_mr->addr;
-	client_send_sge.length = (uint32_t) client_metadata_mr->length;
-	client_send_sge.lkey = client_metadata_mr->lkey;
+	conn->client_send_sge.addr = (uint64_t) conn->client_metadata.addr;
+	conn->client_send_sge.length = conn->client_metadata.length;
+	conn->client_send_sge.lkey = conn->client_metadata.lkey;
 
 	//Link SGE to Send Work Request
-	bzero(&client_send_wr, sizeof(client_send_wr));
-
-	client_send_wr.sg_list = &client_send_sge;
-	client_send_wr.num_sge = 1;
-	client_send_wr.opcode = IBV_WR_SEND;
-	client_send_wr.send_flags = IBV_SEND_SIGNALED;
+	bzero(&conn->client_send_wr, sizeof(conn->client_send_wr));
+
+	conn->client_send_wr.sg_list = &conn->client_send_sge;
+	conn->client_send_wr.num_sge = 1;
+	conn->client_send_wr.opcode = IBV_WR_SEND;
+	conn->client_send_wr.send_flags = IBV_SEND_SIGNALED;
+	if (conn->client_send_sge.length <= conn->max_inline) {
+		conn->client_send_wr.send_flags |= IBV_SEND_INLINE;
+	}
 
 	//Post Send Work Request
-	ret = ibv_post_send(client_qp, &client_send_wr, &bad_client_send_wr);
+	ret = roce_post_send(conn->client_qp, &conn->client_send_wr, &conn->bad_client_send_wr);
 	if (ret) {
 		printf("Could not send client metadata \n");
 		return -errno;
 	}
 
 	//Expect WC Events for send and receive
-	ret = process_wc_events(io_completion_channel, wc, 2);
+	ret = process_wc_events(th->client_cq, wc, 2);
 	if(ret != 2) {
 		printf("Could not get WC Events \n");
 		return ret;
 	}
 
+	if (conn->server_metadata_attr->mode != conn->client_metadata_attr->mode) {
+		printf("Server does not support the benchmark mode \n");
+		return -EPROTO;
+	}
+
+	//Pre-post receive ring for echoed messages or WRITE_WITH_IMM, its slots complete with the connection index in the upper wr_id bits
+	if (bench_mode == MODE_PINGPONG || bench_mode == MODE_WRITE_IMM || bench_mode == MODE_BIDIR) {
+		conn->server_ring_slots = conn->server_metadata_attr->depth;
+
+		ret = roce_recv_ring_init(&conn->recv_ring, &th->mem, conn->client_qp, NULL, ring_slots, bench_mode == MODE_PINGPONG ? msg_size : 0, (uint64_t) (conn - th->conns) << 32);
+		if (ret) {
+			printf("Could not set up receive ring \n");
+			return ret;
+		}
+	}
+
 	return 0;
 }
 
 //Perform RDAM Write and RDMA Read
-static int perform_write_read() {
+static int perform_write_read(struct client_thread *th, struct client_conn *conn) {
 	struct ibv_wc wc;
 	int ret = -1;
 
-	//Define variables for benchmarks
-	int msg_size = strlen(send_buf);
-	struct timeval write_start, write_end, read_start, read_end;
+	//Define variables for benchmarks, only the time from posting to completion is measured
+	uint64_t length = conn->client_send_mem.length;
+	uint64_t write_start, write_end, read_start, read_end;
 	double write_elapsed_time, read_elapsed_time, write_throughput, read_throughput;
 
-	//Start WRITE benchmark
-	gettimeofday(&write_start, NULL);
-
 	//Perform RDMA Write
-	client_recv_buf_mr = roce_register_buffer(pd,recv_buf, strlen(send_buf), (IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE | IBV_ACCESS_REMOTE_READ));
-	if (!client_recv_buf_mr) {
-		printf("Could not create RB \n");
-		return -ENOMEM;
+	conn->client_send_sge.addr = (uint64_t) conn->client_send_mem.addr;
+	conn->client_send_sge.length = conn->client_send_mem.length;
+	conn->client_send_sge.lkey = conn->client_send_mem.lkey;
+
+	bzero(&conn->client_send_wr, sizeof(conn->client_send_wr));
+	conn->client_send_wr.sg_list = &conn->client_send_sge;
+	conn->client_send_wr.num_sge = 1;
+	conn->client_send_wr.opcode = IBV_WR_RDMA_WRITE;
+	conn->client_send_wr.send_flags = IBV_SEND_SIGNALED;
+	if (conn->client_send_sge.length <= conn->max_inline) {
+		conn->client_send_wr.send_flags |= IBV_SEND_INLINE;
 	}
 
-	client_send_sge.addr = (uint64_t) client_send_buf_mr->addr;
-	client_send_sge.length = (uint32_t) client_send_buf_mr->length;
-	client_send_sge.lkey = client_send_buf_mr->lkey;
-
-	bzero(&client_send_wr, sizeof(client_send_wr));
-	client_send_wr.sg_list = &client_send_sge;
-	client_send_wr.num_sge = 1;
-	client_send_wr.opcode = IBV_WR_RDMA_WRITE;
-	client_send_wr.send_flags = IBV_SEND_SIGNALED;
+	conn->client_send_wr.wr.rdma.rkey = conn->server_metadata_attr->stag.remote_stag;
+	conn->client_send_wr.wr.rdma.remote_addr = conn->server_metadata_attr->address;
 
-	client_send_wr.wr.rdma.rkey = server_metadata_attr.stag.remote_stag;
-	client_send_wr.wr.rdma.remote_addr = server_metadata_attr.address;
+	//Start WRITE benchmark
+	write_start = roce_timestamp();
 
-	ret = ibv_post_send(client_qp, &client_send_wr, &bad_client_send_wr);
+	ret = roce_post_send(conn->client_qp, &conn->client_send_wr, &conn->bad_client_send_wr);
 	if (ret) {
 		printf("Could not write to buffer \n");
 		return -errno;
 	}
 
-	//Expect WC event for WRITE 
-	ret = process_wc_events(io_completion_channel, &wc, 1);
+	//Expect WC event for WRITE
+	ret = process_wc_events(th->client_cq, &wc, 1);
 	if(ret != 1) {
 		printf("Could not get WC Events \n");
 		return ret;
@@ -315,39 +1047,40 @@ static int perform_write_read() {
 	//WRITE is complete
 
 	//Finish WRITE benchmark
-	gettimeofday(&write_end, NULL);
+	write_end = roce_timestamp();
 
 	//Calculate WRITE throughput
-	write_elapsed_time = (write_end.tv_sec - write_start.tv_sec) * 1000000.0 + (write_end.tv_usec - write_start.tv_usec);
-	write_throughput = (msg_size / 1e6) / (write_elapsed_time / 1e6);
-
-	printf("WRITE throughput: %f MB/s \n", write_throughput);
+	write_elapsed_time = roce_ticks_to_ns(write_end - write_start) / 1000.0;
+	write_throughput = (length / 1e6) / (write_elapsed_time / 1e6);
 
-	//Start READ benchmark
-	gettimeofday(&read_start, NULL);
+	printf("WRITE throughput: %f MB/s (%.3f usec) \n", write_throughput, write_elapsed_time);
+	client_emit_single("WRITE", length, roce_ticks_to_ns(write_end - write_start));
 
 	//Perform RDMA Read
-	client_send_sge.addr = (uint64_t) client_recv_buf_mr->addr;
-	client_send_sge.length = (uint32_t) client_recv_buf_mr->length;
-	client_send_sge.lkey = client_recv_buf_mr->lkey;
+	conn->client_send_sge.addr = (uint64_t) conn->client_recv_mem.addr;
+	conn->client_send_sge.length = conn->client_recv_mem.length;
+	conn->client_send_sge.lkey = conn->client_recv_mem.lkey;
+
+	bzero(&conn->client_send_wr, sizeof(conn->client_send_wr));
+	conn->client_send_wr.sg_list = &conn->client_send_sge;
+	conn->client_send_wr.num_sge = 1;
+	conn->client_send_wr.opcode = IBV_WR_RDMA_READ;
+	conn->client_send_wr.send_flags = IBV_SEND_SIGNALED;
 
-	bzero(&client_send_wr, sizeof(client_send_wr));
-	client_send_wr.sg_list = &client_send_sge;
-	client_send_wr.num_sge = 1;
-	client_send_wr.opcode = IBV_WR_RDMA_READ;
-	client_send_wr.send_flags = IBV_SEND_SIGNALED;
+	conn->client_send_wr.wr.rdma.rkey = conn->server_metadata_attr->stag.remote_stag;
+	conn->client_send_wr.wr.rdma.remote_addr = conn->server_metadata_attr->address;
 
-	client_send_wr.wr.rdma.rkey = server_metadata_attr.stag.remote_stag;
-	client_send_wr.wr.rdma.remote_addr = server_metadata_attr.address;
+	//Start READ benchmark
+	read_start = roce_timestamp();
 
-	ret = ibv_post_send(client_qp, &client_send_wr, &bad_client_send_wr);
+	ret = roce_post_send(conn->client_qp, &conn->client_send_wr, &conn->bad_client_send_wr);
 	if (ret) {
 		printf("Could not read from buffer \n");
 		return -errno;
 	}
 
-	//Expect WC event for READ 
-	ret = process_wc_events(io_completion_channel, &wc, 1);
+	//Expect WC event for READ
+	ret = process_wc_events(th->client_cq, &wc, 1);
 	if(ret != 1) {
 		printf("Could not get WC Events \n");
 		return ret;
@@ -355,126 +1088,2212 @@ static int perform_write_read() {
 	//READ is complete
 
 	//Finish READ benchmark
-	gettimeofday(&read_end, NULL);
+	read_end = roce_timestamp();
 
 	//Calculate READ throughput
-	read_elapsed_time = (read_end.tv_sec - read_start.tv_sec) * 1000000.0 + (read_end.tv_usec - read_start.tv_usec);
-	read_throughput = (msg_size / 1e6) / (read_elapsed_time / 1e6);
+	read_elapsed_time = roce_ticks_to_ns(read_end - read_start) / 1000.0;
+	read_throughput = (length / 1e6) / (read_elapsed_time / 1e6);
 
-	printf("READ throughput: %f MB/s \n", read_throughput);
+	printf("READ throughput: %f MB/s (%.3f usec) \n", read_throughput, read_elapsed_time);
+	client_emit_single("READ", length, roce_ticks_to_ns(read_end - read_start));
 
 	return 0;
 }
 
-//Disconnect from server and clean up resources
-static int client_disconnect_and_clean() {
-	struct rdma_cm_event *cm_event = NULL;
-	int ret = -1;
+//Prepare RDMA Work Request of connection for one operation on the server buffer
+static void client_prepare_rdma_wr(struct client_conn *conn, enum client_op op, uint32_t length) {
+	struct roce_mem *local_mem = (op == OP_READ || op == OP_FETCH_ADD || op == OP_CMP_SWAP) ? &conn->client_recv_mem : &conn->client_send_mem;
+	int i;
 
-	//Client side actively disconnects from server
-	ret = rdma_disconnect(cm_client_id);
-	if (ret) {
-		printf("Could not disconnect \n");
-	}
+	conn->client_send_sge.addr = (uint64_t) local_mem->addr;
+	conn->client_send_sge.length = length;
+	conn->client_send_sge.lkey = local_mem->lkey;
 
-	//Report Disconnect event to CM
-	ret = process_rdma_cm_event(cm_event_channel, RDMA_CM_EVENT_DISCONNECTED, &cm_event);
-	if (ret) {
-		printf("Could not receive valid CM event \n");
-	}
+	bzero(&conn->client_send_wr, sizeof(conn->client_send_wr));
+	conn->client_send_wr.sg_list = &conn->client_send_sge;
+	conn->client_send_wr.num_sge = 1;
+	conn->client_send_wr.opcode = op_codes[op];
 
-	//Acknowledge Disconnect event
-	ret = rdma_ack_cm_event(cm_event);
-	if (ret) {
-		printf("Could not acknowledge CM Event \n");
-	}
+	//Small writes are copied into the WQE so the NIC does not have to fetch the payload
+	conn->inline_flag = ((op == OP_WRITE || op == OP_BIDIR_OUT) && length <= conn->max_inline) ? IBV_SEND_INLINE : 0;
+	conn->client_send_wr.send_flags = IBV_SEND_SIGNALED | conn->inline_flag;
 
-	//Destroy Queue Pair
-	rdma_destroy_qp(cm_client_id);
+	conn->client_send_wr.wr.rdma.rkey = conn->server_metadata_attr->stag.remote_stag;
+	conn->client_send_wr.wr.rdma.remote_addr = conn->server_metadata_attr->address;
 
-	//Destroy Client CM ID
-	ret = rdma_destroy_id(cm_client_id);
-	if (ret) {
-		printf("Could not destroy Client ID \n");
+	//NIC gathers the message from the fragments itself
+	if (op == OP_WRITE_SGE) {
+		conn->client_send_wr.sg_list = conn->frag_sge;
+		conn->client_send_wr.num_sge = num_frags;
 	}
 
-	//Destroy Completion Queue
-	ret = ibv_destroy_cq(client_cq);
-	if (ret) {
-		printf("Could not destroy CQ \n");
+	//Atomics return the previous value of the slot into the receive buffer,
+	//CMP-SWAP expects the value the FETCH-ADD run left behind
+	if (op == OP_FETCH_ADD || op == OP_CMP_SWAP) {
+		conn->client_send_sge.length = sizeof(uint64_t);
+		conn->client_send_wr.wr.atomic.remote_addr = conn->server_metadata_attr->address;
+		conn->client_send_wr.wr.atomic.rkey = conn->server_metadata_attr->stag.remote_stag;
+		conn->client_send_wr.wr.atomic.compare_add = (op == OP_FETCH_ADD) ? 1 : conn->counter_end;
+		conn->client_send_wr.wr.atomic.swap = conn->counter_end + 1;
 	}
 
-	//Destroy I/O Completion Channel
-	ret = ibv_destroy_comp_channel(io_completion_channel);
-	if (ret) {
-		printf("Could not destroy Comp Channel \n");
+	//Chained WRs start out as copies of this one, only wr_id, flags and links change per post
+	for (i = 0; i < MAX_BATCH; i++) {
+		conn->batch_wr[i] = conn->client_send_wr;
+		conn->batch_sge[i] = conn->client_send_sge;
+		if (op != OP_WRITE_SGE) {
+			conn->batch_wr[i].sg_list = &conn->batch_sge[i];
+		}
 	}
+}
 
-	//Destroy buffers
-	roce_deregister_buffer(server_metadata_mr);
-	roce_deregister_buffer(client_metadata_mr);	
-	roce_deregister_buffer(client_send_buf_mr);	
-	roce_deregister_buffer(client_recv_buf_mr);	
-
-	//Free buffers
-	free(send_buf);
-	free(recv_buf);
+//Continue CMP-SWAP from the value it found, the swap succeeded if that was the expected one
+static void client_next_cmp_swap(struct client_conn *conn, struct client_op_result *result) {
+	uint64_t found = *(volatile uint64_t *) conn->recv_buf;
 
-	//Destroy Protection Domain
-	ret = ibv_dealloc_pd(pd);
-	if (ret) {
-		printf("Could not destroy Client PD \n");
+	if (result && found == conn->client_send_wr.wr.atomic.compare_add) {
+		result->succeeded++;
 	}
+	conn->client_send_wr.wr.atomic.compare_add = found;
+	conn->client_send_wr.wr.atomic.swap = found + 1;
+}
 
-	//Destroy and close Event Channel
-	rdma_destroy_event_channel(cm_event_channel);
+//Copy the fragments of a message into the contiguous send buffer
+static void client_coalesce_fragments(struct client_conn *conn) {
+	uint32_t offset = 0;
+	int f;
 
-	return 0;
+	for (f = 0; f < num_frags; f++) {
+		memcpy(conn->send_buf + offset, conn->frag_mr[f]->addr, frag_sizes[f]);
+		offset += frag_sizes[f];
+	}
 }
 
-//Print usage of roce_client.c
-void show_usage() {
-	printf("How to use: \n");
-	printf("roce_client: -a <server_ip> (required) [-p <server_port> (optional)] -s <message size> (required)\n");
+//Post the prepared RDMA Work Request and wait for its completion
+static int post_rdma_and_wait(struct client_thread *th, struct client_conn *conn, enum client_op op) {
+	struct ibv_wc wc;
+	int ret = -1;
+
+	ret = roce_post_send(conn->client_qp, &conn->client_send_wr, &conn->bad_client_send_wr);
+	if (ret) {
+		printf("Could not post %s \n", op_names[op]);
+		return -errno;
+	}
+
+	ret = process_wc_events(th->client_cq, &wc, 1);
+	if (ret != 1) {
+		printf("Could not get WC Events \n");
+		return ret;
+	}
+
+	return 0;
+}
+
+//Split latency into the time until the completion was timestamped and the time the host took to pick it up
+static void client_record_split(struct client_op_result *result, uint64_t cq_start, uint64_t total_ns) {
+	uint64_t nic_ns = roce_cq_ticks_to_ns(roce_cq_last_timestamp() - cq_start);
+
+	//Device and host clock are not synchronised, so the split can only be approximated
+	if (nic_ns > total_ns) {
+		nic_ns = total_ns;
+	}
+	roce_hist_record(&result->nic_hist, nic_ns);
+	roce_hist_record(&result->host_hist, total_ns - nic_ns);
+}
+
+//Run warmup and measured iterations of one operation on every connection and record the latency of every operation
+static int run_latency_loop(struct client_thread *th, enum client_op op, uint32_t length) {
+	struct client_op_result *result = &th->results[op];
+	uint64_t start, end, cq_start = 0, query_start;
+	int i, c, split = 0, ret = -1;
+
+	//Work Requests are identical for all iterations
+	for (c = 0; c < th->num_conns; c++) {
+		client_prepare_rdma_wr(&th->conns[c], op, length);
+	}
+
+	roce_hist_init(&result->hist);
+	roce_hist_init(&result->nic_hist);
+	roce_hist_init(&result->host_hist);
+	result->succeeded = 0;
+
+	for (i = 0; i < warmup + iterations; i++) {
+		for (c = 0; c < th->num_conns; c++) {
+			start = roce_timestamp();
+			if (op == OP_WRITE_COPY) {
+				client_coalesce_fragments(&th->conns[c]);
+			}
+			//Reading the device clock right before posting is not part of the latency
+			if (cq_timestamps) {
+				query_start = roce_timestamp();
+				split = !roce_cq_clock_now(&cq_start);
+				start += roce_timestamp() - query_start;
+			}
+			ret = post_rdma_and_wait(th, &th->conns[c], op);
+			if (ret) {
+				return ret;
+			}
+			end = roce_timestamp();
+
+			if (op == OP_CMP_SWAP) {
+				client_next_cmp_swap(&th->conns[c], i >= warmup ? result : NULL);
+			}
+
+			//Warmup iterations are not recorded
+			if (i >= warmup) {
+				roce_hist_record(&result->hist, roce_ticks_to_ns(end - start));
+				//Iterations whose device clock could not be read are left out of the split
+				if (split) {
+					client_record_split(result, cq_start, roce_ticks_to_ns(end - start));
+				}
+			}
+		}
+	}
+
+	result->messages = (uint64_t) iterations * th->num_conns;
+
+	return 0;
+}
+
+//Print latency statistics of one operation in microseconds
+static void print_latency_report(const char *label, const struct roce_histogram *hist) {
+	printf("%-10s %10.3f %10.3f %10.3f %10.3f %10.3f %10.3f %10.3f \n", label,
+			hist->min / 1000.0,
+			roce_hist_mean(hist) / 1000.0,
+			roce_hist_percentile(hist, 50.0) / 1000.0,
+			roce_hist_percentile(hist, 99.0) / 1000.0,
+			roce_hist_percentile(hist, 99.9) / 1000.0,
+			roce_hist_percentile(hist, 99.99) / 1000.0,
+			hist->max / 1000.0);
+}
+
+//Perform RDMA Write and RDMA Read latency benchmark over multiple iterations
+static int perform_latency_test(struct client_thread *th) {
+	int op, ret = 0;
+
+	//All threads measure the same operation at the same time
+	for (op = 0; op < OP_COUNT; op++) {
+		if (!client_op_active(op)) {
+			continue;
+		}
+		if (client_sync(ret)) {
+			return ret ? ret : -ECANCELED;
+		}
+
+		ret = run_latency_loop(th, op, msg_size);
+		if (ret) {
+			printf("Could not perform %s latency test \n", op_names[op]);
+		}
+	}
+
+	return ret;
+}
+
+//Post WRs on connection c until queue_depth of them are in flight or count have been posted,
+//up to batch WRs are linked through next and handed to the NIC with one post of the selected API
+static int client_fill_send_queue(struct client_conn *conn, int c, enum client_op op, int count, int batch) {
+	struct ibv_send_wr *wr;
+	int n, i, ret = -1;
+
+	while (conn->posted < count && conn->posted - conn->completed < queue_depth) {
+		n = count - conn->posted;
+		if (n > queue_depth - (conn->posted - conn->completed)) {
+			n = queue_depth - (conn->posted - conn->completed);
+		}
+		if (n > batch) {
+			n = batch;
+		}
+
+		for (i = 0; i < n; i++) {
+			wr = &conn->batch_wr[i];
+
+			//Completion of a signaled WR also retires all unsignaled WRs posted before it
+			wr->wr_id = ((uint64_t) c << 32) | (conn->posted + i);
+			if ((conn->posted + i + 1) % signal_interval == 0 || conn->posted + i + 1 == count) {
+				wr->send_flags = IBV_SEND_SIGNALED | conn->inline_flag;
+			} else {
+				wr->send_flags = conn->inline_flag;
+			}
+			wr->next = (i + 1 < n) ? &conn->batch_wr[i + 1] : NULL;
+
+			if (op == OP_WRITE_COPY) {
+				client_coalesce_fragments(conn);
+			}
+		}
+
+		ret = roce_post_send(conn->client_qp, conn->batch_wr, &conn->bad_client_send_wr);
+		if (ret) {
+			printf("Could not post %s \n", op_names[op]);
+			return -ret;
+		}
+		conn->posted += n;
+	}
+
+	return 0;
+}
+
+//Keep up to queue_depth operations in flight on every connection and signal only every signal_interval-th WR
+static int run_bw_loop(struct client_thread *th, enum client_op op, uint32_t length, int count, int measured) {
+	struct ibv_wc wc[MAX_WR];
+	struct client_conn *conn;
+	uint64_t start;
+	int done = 0, c, i, ret = -1;
+
+	for (c = 0; c < th->num_conns; c++) {
+		client_prepare_rdma_wr(&th->conns[c], op, length);
+		th->conns[c].posted = th->conns[c].completed = 0;
+	}
+
+	start = roce_get_time_ns();
+
+	while (done < th->num_conns) {
+		//Fill up send queue of every connection to configured depth
+		for (c = 0; c < th->num_conns; c++) {
+			ret = client_fill_send_queue(&th->conns[c], c, op, count, th->batch);
+			if (ret) {
+				return ret;
+			}
+		}
+
+		ret = collect_wc_events(th->client_cq, wc, MAX_WR);
+		if (ret < 0) {
+			printf("Could not get WC Events \n");
+			return ret;
+		}
+
+		for (i = 0; i < ret; i++) {
+			conn = &th->conns[wc[i].wr_id >> 32];
+			conn->completed = (uint32_t) wc[i].wr_id + 1;
+			if (conn->completed == count) {
+				done++;
+			}
+		}
+	}
+
+	if (measured) {
+		th->results[op].start_ns = start;
+		th->results[op].end_ns = roce_get_time_ns();
+		th->results[op].messages = (uint64_t) count * th->num_conns;
+	}
+
+	return 0;
+}
+
+//Print sustained bandwidth and message rate of one operation
+static void print_bw_report(const char *label, uint32_t length, const struct client_op_result *result) {
+	double elapsed_us = (result->end_ns - result->start_ns) / 1000.0;
+
+	printf("%-10s %12.2f %12.3f \n", label, ((double) length * result->messages) / elapsed_us, result->messages / elapsed_us);
+}
+
+//Perform pipelined RDMA Write and RDMA Read bandwidth benchmark
+static int perform_bw_test(struct client_thread *th) {
+	int op, ret = 0;
+
+	for (op = 0; op < OP_COUNT; op++) {
+		if (!client_op_active(op)) {
+			continue;
+		}
+		if (client_sync(ret)) {
+			return ret ? ret : -ECANCELED;
+		}
+
+		//Warmup runs are not measured
+		if (warmup) {
+			ret = run_bw_loop(th, op, msg_size, warmup, 0);
+		}
+		if (!ret) {
+			ret = run_bw_loop(th, op, msg_size, iterations, 1);
+		}
+		if (ret) {
+			printf("Could not perform %s bandwidth test \n", op_names[op]);
+		}
+	}
+
+	return ret;
+}
+
+//Reset aggregate of results
+static void client_init_total(struct client_op_result *total) {
+	roce_hist_init(&total->hist);
+	roce_hist_init(&total->nic_hist);
+	roce_hist_init(&total->host_hist);
+	total->start_ns = UINT64_MAX;
+	total->end_ns = 0;
+	total->messages = 0;
+	total->cpu_ns = 0;
+	total->succeeded = 0;
+}
+
+//Add result of one thread to aggregate
+static void client_merge_result(struct client_op_result *total, const struct client_op_result *result) {
+	roce_hist_merge(&total->hist, &result->hist);
+	roce_hist_merge(&total->nic_hist, &result->nic_hist);
+	roce_hist_merge(&total->host_hist, &result->host_hist);
+	if (result->start_ns < total->start_ns) {
+		total->start_ns = result->start_ns;
+	}
+	if (result->end_ns > total->end_ns) {
+		total->end_ns = result->end_ns;
+	}
+	total->messages += result->messages;
+	total->cpu_ns += result->cpu_ns;
+	total->succeeded += result->succeeded;
+}
+
+//Aggregate results of one operation over all threads
+static void client_aggregate_results(enum client_op op, struct client_op_result *total) {
+	int t;
+
+	client_init_total(total);
+	for (t = 0; t < num_threads; t++) {
+		client_merge_result(total, &threads[t].results[op]);
+	}
+}
+
+//Run latency and bandwidth benchmark of one operation at one message size
+static int run_sweep_step(struct client_thread *th, enum client_op op, uint32_t length) {
+	int ret = -1;
+
+	ret = run_latency_loop(th, op, length);
+	if (ret) {
+		return ret;
+	}
+
+	if (warmup) {
+		ret = run_bw_loop(th, op, length, warmup, 0);
+		if (ret) {
+			return ret;
+		}
+	}
+
+	return run_bw_loop(th, op, length, iterations, 1);
+}
+
+//Sweep message sizes in powers of two up to the buffer size over the established connections
+static int perform_size_sweep(struct client_thread *th) {
+	struct client_op_result total[OP_COUNT];
+	uint32_t size;
+	int op, ret = 0;
+
+	if (th->id == 0) {
+		printf("Size sweep (%d iterations, %d warmup, queue depth %d, signal every %d), latency in usec \n", iterations, warmup, queue_depth, signal_interval);
+		printf("%10s %10s %10s %10s %10s %12s %12s \n", "bytes", "WRITE p50", "WRITE p99", "READ p50", "READ p99", "WRITE MB/s", "READ MB/s");
+	}
+
+	for (size = 1; ; size *= 2) {
+		//Always finish with the full buffer size
+		if (size > (uint32_t) msg_size) {
+			size = msg_size;
+		}
+
+		for (op = 0; op < OP_COUNT; op++) {
+			if (!client_op_active(op)) {
+				continue;
+			}
+			if (client_sync(ret)) {
+				return ret ? ret : -ECANCELED;
+			}
+
+			ret = run_sweep_step(th, op, size);
+			if (ret) {
+				printf("Could not perform %s at %u bytes \n", op_names[op], size);
+			}
+		}
+
+		//First thread prints aggregate of all threads
+		if (client_sync(ret)) {
+			return ret ? ret : -ECANCELED;
+		}
+		if (th->id == 0) {
+			for (op = 0; op < OP_COUNT; op++) {
+				if (!client_op_active(op)) {
+					continue;
+				}
+				client_aggregate_results(op, &total[op]);
+			}
+
+			printf("%10u %10.3f %10.3f %10.3f %10.3f %12.2f %12.2f \n", size,
+					roce_hist_percentile(&total[OP_WRITE].hist, 50.0) / 1000.0,
+					roce_hist_percentile(&total[OP_WRITE].hist, 99.0) / 1000.0,
+					roce_hist_percentile(&total[OP_READ].hist, 50.0) / 1000.0,
+					roce_hist_percentile(&total[OP_READ].hist, 99.0) / 1000.0,
+					((double) size * total[OP_WRITE].messages) / ((total[OP_WRITE].end_ns - total[OP_WRITE].start_ns) / 1000.0),
+					((double) size * total[OP_READ].messages) / ((total[OP_READ].end_ns - total[OP_READ].start_ns) / 1000.0));
+
+			for (op = 0; op < OP_COUNT; op++) {
+				if (client_op_active(op)) {
+					client_emit_record(op_names[op], size, &total[op], 1, 1);
+				}
+			}
+		}
+
+		if (size == (uint32_t) msg_size) {
+			break;
+		}
+	}
+
+	if (client_sync(ret)) {
+		return ret ? ret : -ECANCELED;
+	}
+
+	return 0;
+}
+
+//Measure message rate for chains of 1, 2, 4, ... WRs per ibv_post_send up to the configured batch
+static int perform_batch_sweep(struct client_thread *th) {
+	struct client_op_result total[OP_COUNT];
+	double elapsed_us;
+	int batch, op, ret = 0;
+
+	if (th->id == 0) {
+		printf("Doorbell batching (%d messages per QP, %d bytes, queue depth %d, signal every %d, %d threads x %d QPs), WRs per ibv_post_send \n",
+				iterations, msg_size, queue_depth, signal_interval, num_threads, qps_per_thread);
+		printf("%10s %12s %12s %12s %12s \n", "batch", "WRITE MB/s", "WRITE Mmsg/s", "READ MB/s", "READ Mmsg/s");
+	}
+
+	for (batch = 1; ; batch *= 2) {
+		//Always finish with the configured batch
+		if (batch > post_batch) {
+			batch = post_batch;
+		}
+		th->batch = batch;
+
+		for (op = 0; op < OP_COUNT; op++) {
+			if (!client_op_active(op)) {
+				continue;
+			}
+			if (client_sync(ret)) {
+				return ret ? ret : -ECANCELED;
+			}
+
+			if (warmup) {
+				ret = run_bw_loop(th, op, msg_size, warmup, 0);
+			}
+			if (!ret) {
+				ret = run_bw_loop(th, op, msg_size, iterations, 1);
+			}
+			if (ret) {
+				printf("Could not perform %s with batches of %d \n", op_names[op], batch);
+			}
+		}
+
+		//First thread prints aggregate of all threads
+		if (client_sync(ret)) {
+			return ret ? ret : -ECANCELED;
+		}
+		if (th->id == 0) {
+			printf("%10d", batch);
+			for (op = 0; op < OP_COUNT; op++) {
+				if (!client_op_active(op)) {
+					continue;
+				}
+				client_aggregate_results(op, &total[op]);
+				elapsed_us = (total[op].end_ns - total[op].start_ns) / 1000.0;
+				printf(" %12.2f %12.3f", ((double) msg_size * total[op].messages) / elapsed_us, total[op].messages / elapsed_us);
+			}
+			printf(" \n");
+
+			for (op = 0; op < OP_COUNT; op++) {
+				if (client_op_active(op)) {
+					client_emit_record(op_names[op], msg_size, &total[op], 0, 1);
+				}
+			}
+		}
+
+		if (batch == post_batch) {
+			break;
+		}
+	}
+
+	if (client_sync(ret)) {
+		return ret ? ret : -ECANCELED;
+	}
+
+	return 0;
+}
+
+//Compare WRITEs of fragmented messages gathered by memcpy and by the NIC on latency, bandwidth and CPU cost
+static int perform_sge_test(struct client_thread *th) {
+	struct roce_cpu_usage start, end;
+	int op, c, ret = 0;
+
+	for (op = 0; op < OP_COUNT; op++) {
+		if (!client_op_active(op)) {
+			continue;
+		}
+		if (client_sync(ret)) {
+			return ret ? ret : -ECANCELED;
+		}
+
+		ret = run_latency_loop(th, op, msg_size);
+		if (!ret && warmup) {
+			ret = run_bw_loop(th, op, msg_size, warmup, 0);
+		}
+
+		//CPU time is only taken over the measured bandwidth run
+		if (!ret) {
+			roce_get_cpu_usage(&start);
+			ret = run_bw_loop(th, op, msg_size, iterations, 1);
+			roce_get_cpu_usage(&end);
+			th->results[op].cpu_ns = (end.user_ns - start.user_ns) + (end.sys_ns - start.sys_ns);
+		}
+		if (ret) {
+			printf("Could not perform %s test \n", op_names[op]);
+		}
+	}
+
+	//Read back the gathered message for the functional test
+	for (c = 0; c < th->num_conns && !ret; c++) {
+		client_prepare_rdma_wr(&th->conns[c], OP_READ, msg_size);
+		ret = post_rdma_and_wait(th, &th->conns[c], OP_READ);
+	}
+
+	return ret;
+}
+
+//Read atomic slot of connection with a FETCH-ADD of zero
+static int client_fetch_counter(struct client_thread *th, struct client_conn *conn, uint64_t *value) {
+	int ret = -1;
+
+	client_prepare_rdma_wr(conn, OP_FETCH_ADD, sizeof(uint64_t));
+	conn->client_send_wr.wr.atomic.compare_add = 0;
+
+	ret = post_rdma_and_wait(th, conn, OP_FETCH_ADD);
+	if (ret) {
+		return ret;
+	}
+
+	*value = *(volatile uint64_t *) conn->recv_buf;
+	return 0;
+}
+
+//Measure single-outstanding latency and pipelined rate of FETCH-ADD and CMP-SWAP on one slot per QP or one slot for all QPs
+static int perform_atomic_test(struct client_thread *th) {
+	int op, c, ret = 0;
+
+	//Slot value before any thread adds to it
+	for (c = 0; c < th->num_conns && !ret; c++) {
+		ret = client_fetch_counter(th, &th->conns[c], &th->conns[c].counter_start);
+	}
+
+	for (op = 0; op < OP_COUNT; op++) {
+		if (!client_op_active(op)) {
+			continue;
+		}
+		if (client_sync(ret)) {
+			return ret ? ret : -ECANCELED;
+		}
+
+		ret = run_latency_loop(th, op, sizeof(uint64_t));
+		if (!ret && warmup) {
+			ret = run_bw_loop(th, op, sizeof(uint64_t), warmup, 0);
+		}
+		if (!ret) {
+			ret = run_bw_loop(th, op, sizeof(uint64_t), iterations, 1);
+		}
+		if (ret) {
+			printf("Could not perform %s test \n", op_names[op]);
+		}
+
+		//Contended slot may only be read again once every thread is done adding
+		if (op == OP_FETCH_ADD) {
+			if (client_sync(ret)) {
+				return ret ? ret : -ECANCELED;
+			}
+			for (c = 0; c < th->num_conns && !ret; c++) {
+				ret = client_fetch_counter(th, &th->conns[c], &th->conns[c].counter_end);
+			}
+		}
+	}
+
+	return ret;
+}
+
+//Spin on the last byte of the receive buffer until the server wrote back the expected sequence number
+static int client_poll_last_byte(struct client_conn *conn, uint8_t seq) {
+	volatile uint8_t *last = (volatile uint8_t *) conn->recv_buf + msg_size - 1;
+	uint64_t start = 0;
+	uint32_t spins = 0;
+
+	while (*last != seq) {
+		//Clock is only read now and then to keep the loop tight
+		if (++spins % 65536 == 0) {
+			if (!start) {
+				start = roce_get_time_ns();
+			} else if (roce_get_time_ns() - start > WRITE_POLL_TIMEOUT_NS) {
+				printf("Server did not write back \n");
+				return -ETIMEDOUT;
+			}
+		}
+	}
+
+	return 0;
+}
+
+//Wait for the WRITE_WITH_IMM of the server, completions of own WRITEs are skipped
+static int client_wait_write_imm(struct client_thread *th) {
+	struct ibv_wc wc[2];
+	int i, num_wc, found = 0, ret = -1;
+
+	while (!found) {
+		num_wc = collect_wc_events(th->client_cq, wc, 2);
+		if (num_wc < 0) {
+			printf("Could not get WC Events \n");
+			return num_wc;
+		}
+
+		for (i = 0; i < num_wc; i++) {
+			if (wc[i].opcode == IBV_WC_RECV_RDMA_WITH_IMM) {
+				found = 1;
+				ret = roce_recv_ring_release(&th->conns[wc[i].wr_id >> 32].recv_ring, (uint32_t) wc[i].wr_id);
+				if (ret) {
+					return ret;
+				}
+			}
+		}
+	}
+
+	return 0;
+}
+
+//Write into the server buffer and wait until the server wrote back, one connection at a time
+static int run_write_pingpong(struct client_thread *th, enum client_op op) {
+	struct client_op_result *result = &th->results[op];
+	struct client_conn *conn;
+	struct ibv_wc wc;
+	uint64_t start, end;
+	int i, c, signaled, ret = -1;
+
+	for (c = 0; c < th->num_conns; c++) {
+		client_prepare_rdma_wr(&th->conns[c], op, msg_size);
+		th->conns[c].inline_flag = ((uint32_t) msg_size <= th->conns[c].max_inline) ? IBV_SEND_INLINE : 0;
+		th->conns[c].client_send_wr.wr_id = (uint64_t) c << 32;
+	}
+
+	roce_hist_init(&result->hist);
+
+	for (i = 0; i < warmup + iterations; i++) {
+		for (c = 0; c < th->num_conns; c++) {
+			conn = &th->conns[c];
+
+			//Last byte carries the sequence number, which runs from 1 to 255
+			conn->seq = conn->seq % 255 + 1;
+			conn->send_buf[msg_size - 1] = conn->seq;
+			conn->client_send_wr.imm_data = htonl(conn->seq);
+
+			//Only every signal_interval-th WRITE and the last one are signaled
+			signaled = (i + 1) % signal_interval == 0 || i + 1 == warmup + iterations;
+			conn->client_send_wr.send_flags = conn->inline_flag | (signaled ? IBV_SEND_SIGNALED : 0);
+
+			start = roce_timestamp();
+			ret = roce_post_send(conn->client_qp, &conn->client_send_wr, &conn->bad_client_send_wr);
+			if (ret) {
+				printf("Could not post %s \n", op_names[op]);
+				return -ret;
+			}
+
+			if (op == OP_WRITE_POLL) {
+				ret = client_poll_last_byte(conn, conn->seq);
+			} else {
+				ret = client_wait_write_imm(th);
+			}
+			if (ret) {
+				return ret;
+			}
+			end = roce_timestamp();
+
+			if (i >= warmup) {
+				roce_hist_record(&result->hist, roce_ticks_to_ns(end - start));
+			}
+
+			//Retire signaled WRITE outside of the measurement, WRITE_WITH_IMM completions are skipped while waiting
+			if (signaled && op == OP_WRITE_POLL) {
+				ret = process_wc_events(th->client_cq, &wc, 1);
+				if (ret != 1) {
+					printf("Could not get WC Events \n");
+					return ret < 0 ? ret : -EIO;
+				}
+			}
+		}
+	}
+
+	result->messages = (uint64_t) iterations * th->num_conns;
+
+	return 0;
+}
+
+//Measure round trip latency of WRITE ping-pong
+static int perform_write_pingpong_test(struct client_thread *th) {
+	enum client_op op = (bench_mode == MODE_WRITE_POLL) ? OP_WRITE_POLL : OP_WRITE_IMM;
+	int ret = 0;
+
+	if (client_sync(ret)) {
+		return -ECANCELED;
+	}
+
+	ret = run_write_pingpong(th, op);
+	if (ret) {
+		printf("Could not perform %s test \n", op_names[op]);
+	}
+
+	return ret;
+}
+
+//Prepare SEND Work Request of connection for one message of the send buffer
+static void client_prepare_send_wr(struct client_conn *conn, uint32_t length) {
+	client_prepare_rdma_wr(conn, OP_SEND, length);
+
+	//Sends fitting into the WQE are inlined as well
+	conn->inline_flag = (length <= conn->max_inline) ? IBV_SEND_INLINE : 0;
+	conn->client_send_wr.send_flags = IBV_SEND_SIGNALED | conn->inline_flag;
+}
+
+//Account for completions of SENDs and echoed messages
+static int client_process_pingpong_wc(struct client_thread *th, struct ibv_wc *wc, int num_wc) {
+	struct client_conn *conn;
+	int i, ret = -1;
+
+	for (i = 0; i < num_wc; i++) {
+		conn = &th->conns[wc[i].wr_id >> 32];
+		if (wc[i].opcode == IBV_WC_RECV) {
+			conn->echoed++;
+			ret = roce_recv_ring_release(&conn->recv_ring, (uint32_t) wc[i].wr_id);
+			if (ret) {
+				return ret;
+			}
+		} else {
+			//Completion of a signaled SEND also retires all unsignaled SENDs posted before it
+			conn->completed = (uint32_t) wc[i].wr_id + 1;
+		}
+	}
+
+	return 0;
+}
+
+//Send one message at a time on every connection and record the round trip until its echo arrived
+static int run_pingpong_latency(struct client_thread *th, uint32_t length) {
+	struct client_op_result *result = &th->results[OP_SEND];
+	struct client_conn *conn;
+	struct ibv_wc wc[2];
+	uint64_t start, end, cq_start = 0, query_start;
+	uint32_t slot;
+	int i, c, split = 0, ret = -1;
+
+	for (c = 0; c < th->num_conns; c++) {
+		client_prepare_send_wr(&th->conns[c], length);
+		th->conns[c].client_send_wr.wr_id = (uint64_t) c << 32;
+	}
+
+	roce_hist_init(&result->hist);
+	roce_hist_init(&result->nic_hist);
+	roce_hist_init(&result->host_hist);
+
+	for (i = 0; i < warmup + iterations; i++) {
+		for (c = 0; c < th->num_conns; c++) {
+			conn = &th->conns[c];
+
+			start = roce_timestamp();
+			//Reading the device clock right before posting is not part of the latency
+			if (cq_timestamps) {
+				query_start = roce_timestamp();
+				split = !roce_cq_clock_now(&cq_start);
+				start += roce_timestamp() - query_start;
+			}
+			ret = roce_post_send(conn->client_qp, &conn->client_send_wr, &conn->bad_client_send_wr);
+			if (ret) {
+				printf("Could not post SEND \n");
+				return -ret;
+			}
+
+			//Completion of the SEND and the echo may arrive in either order
+			ret = process_wc_events(th->client_cq, wc, 2);
+			if (ret != 2) {
+				printf("Could not get WC Events \n");
+				return ret < 0 ? ret : -EIO;
+			}
+			end = roce_timestamp();
+
+			if (i >= warmup) {
+				roce_hist_record(&result->hist, roce_ticks_to_ns(end - start));
+				//Iterations whose device clock could not be read are left out of the split
+				if (split) {
+					client_record_split(result, cq_start, roce_ticks_to_ns(end - start));
+				}
+			}
+
+			//Keep last echo for the functional test
+			slot = (uint32_t) (wc[0].opcode == IBV_WC_RECV ? wc[0].wr_id : wc[1].wr_id);
+			if (i == warmup + iterations - 1) {
+				memcpy(conn->recv_buf, roce_recv_ring_slot(&conn->recv_ring, slot), length);
+			}
+
+			ret = roce_recv_ring_release(&conn->recv_ring, slot);
+			if (ret) {
+				return ret;
+			}
+		}
+	}
+
+	result->messages = (uint64_t) iterations * th->num_conns;
+
+	return 0;
+}
+
+//Keep up to window messages per connection in flight and count round trips per second
+static int run_pingpong_rate(struct client_thread *th, uint32_t length, int count, int measured) {
+	struct ibv_wc wc[MAX_WR];
+	struct client_conn *conn;
+	uint64_t start;
+	int window, done = 0, c, ret = -1;
+
+	for (c = 0; c < th->num_conns; c++) {
+		client_prepare_send_wr(&th->conns[c], length);
+		th->conns[c].posted = th->conns[c].completed = th->conns[c].echoed = 0;
+	}
+
+	start = roce_get_time_ns();
+
+	while (done < th->num_conns) {
+		for (c = 0; c < th->num_conns; c++) {
+			conn = &th->conns[c];
+
+			//Never send more messages than both receive rings are guaranteed to have posted
+			window = queue_depth;
+			if ((int) roce_recv_ring_capacity(conn->server_ring_slots) < window) {
+				window = roce_recv_ring_capacity(conn->server_ring_slots);
+			}
+			if ((int) roce_recv_ring_capacity(conn->recv_ring.slots) < window) {
+				window = roce_recv_ring_capacity(conn->recv_ring.slots);
+			}
+
+			while (conn->posted < count && conn->posted - conn->echoed < window && conn->posted - conn->completed < queue_depth) {
+				conn->client_send_wr.wr_id = ((uint64_t) c << 32) | conn->posted;
+				if ((conn->posted + 1) % signal_interval == 0 || conn->posted + 1 == count) {
+					conn->client_send_wr.send_flags = IBV_SEND_SIGNALED | conn->inline_flag;
+				} else {
+					conn->client_send_wr.send_flags = conn->inline_flag;
+				}
+
+				ret = roce_post_send(conn->client_qp, &conn->client_send_wr, &conn->bad_client_send_wr);
+				if (ret) {
+					printf("Could not post SEND \n");
+					return -ret;
+				}
+				conn->posted++;
+			}
+		}
+
+		ret = collect_wc_events(th->client_cq, wc, MAX_WR);
+		if (ret < 0) {
+			printf("Could not get WC Events \n");
+			return ret;
+		}
+
+		ret = client_process_pingpong_wc(th, wc, ret);
+		if (ret) {
+			return ret;
+		}
+
+		//Connection is done once all echoes arrived and no SEND completion is outstanding
+		for (done = 0, c = 0; c < th->num_conns; c++) {
+			if (th->conns[c].echoed == count && th->conns[c].completed == count) {
+				done++;
+			}
+		}
+	}
+
+	if (measured) {
+		th->results[OP_SEND].start_ns = start;
+		th->results[OP_SEND].end_ns = roce_get_time_ns();
+		th->results[OP_SEND].messages = (uint64_t) count * th->num_conns;
+	}
+
+	return 0;
+}
+
+//Measure SEND/RECV round trip latency and message rate for message sizes in powers of two up to the buffer size
+static int perform_pingpong_test(struct client_thread *th) {
+	struct client_op_result total;
+	uint32_t size;
+	int ret = 0;
+
+	if (th->id == 0) {
+		printf("SEND/RECV ping-pong (%d iterations, %d warmup, queue depth %d, %d receive slots), round trip in usec \n", iterations, warmup, queue_depth, ring_slots);
+		printf("%10s %10s %10s %10s %10s %12s %12s", "bytes", "min", "mean", "p50", "p99", "Mmsg/s", "MB/s");
+		if (cq_timestamps) {
+			printf(" %10s %10s", "NIC p50", "host p50");
+		}
+		printf(" \n");
+	}
+
+	for (size = 1; ; size *= 2) {
+		if (size > (uint32_t) msg_size) {
+			size = msg_size;
+		}
+
+		if (client_sync(ret)) {
+			return ret ? ret : -ECANCELED;
+		}
+
+		ret = run_pingpong_latency(th, size);
+		if (!ret && warmup) {
+			ret = run_pingpong_rate(th, size, warmup, 0);
+		}
+		if (!ret) {
+			ret = run_pingpong_rate(th, size, iterations, 1);
+		}
+		if (ret) {
+			printf("Could not perform ping-pong at %u bytes \n", size);
+		}
+
+		//First thread prints aggregate of all threads
+		if (client_sync(ret)) {
+			return ret ? ret : -ECANCELED;
+		}
+		if (th->id == 0) {
+			client_aggregate_results(OP_SEND, &total);
+			printf("%10u %10.3f %10.3f %10.3f %10.3f %12.3f %12.2f", size,
+					total.hist.min / 1000.0,
+					roce_hist_mean(&total.hist) / 1000.0,
+					roce_hist_percentile(&total.hist, 50.0) / 1000.0,
+					roce_hist_percentile(&total.hist, 99.0) / 1000.0,
+					total.messages / ((total.end_ns - total.start_ns) / 1000.0),
+					((double) size * total.messages) / ((total.end_ns - total.start_ns) / 1000.0));
+			if (cq_timestamps) {
+				printf(" %10.3f %10.3f", roce_hist_percentile(&total.nic_hist, 50.0) / 1000.0,
+						roce_hist_percentile(&total.host_hist, 50.0) / 1000.0);
+			}
+			printf(" \n");
+			client_emit_record(op_names[OP_SEND], size, &total, 1, 1);
+		}
+
+		if (size == (uint32_t) msg_size) {
+			break;
+		}
+	}
+
+	return 0;
+}
+
+//Post segments of the transfer on connection c until queue_depth of them are in flight
+static int client_post_segments(struct client_thread *th, struct client_conn *conn, int c, enum client_op op, int segments) {
+	struct roce_mem *local_mem = (op == OP_READ) ? &conn->client_recv_mem : &conn->client_send_mem;
+	uint64_t offset;
+	int ret = -1;
+
+	while (conn->posted < segments && conn->posted - conn->completed < queue_depth) {
+		//Last segment carries the rest of the transfer
+		offset = (uint64_t) conn->posted * th->segment_size;
+		conn->client_send_sge.addr = (uint64_t) local_mem->addr + offset;
+		conn->client_send_sge.length = (transfer_size - offset < th->segment_size) ? transfer_size - offset : th->segment_size;
+		conn->client_send_wr.wr.rdma.remote_addr = conn->server_metadata_attr->address + offset;
+
+		conn->client_send_wr.wr_id = ((uint64_t) c << 32) | conn->posted;
+		if ((conn->posted + 1) % signal_interval == 0 || conn->posted + 1 == segments) {
+			conn->client_send_wr.send_flags = IBV_SEND_SIGNALED | conn->inline_flag;
+		} else {
+			conn->client_send_wr.send_flags = conn->inline_flag;
+		}
+
+		ret = roce_post_send(conn->client_qp, &conn->client_send_wr, &conn->bad_client_send_wr);
+		if (ret) {
+			printf("Could not post %s segment \n", op_names[op]);
+			return -ret;
+		}
+		conn->posted++;
+	}
+
+	return 0;
+}
+
+//Add CRC32C of every completed segment to the digest of the connection
+static void client_checksum_segments(struct client_thread *th, struct client_conn *conn) {
+	uint64_t offset, size;
+
+	while (conn->checksummed < conn->completed) {
+		offset = (uint64_t) conn->checksummed * th->segment_size;
+		size = (transfer_size - offset < th->segment_size) ? transfer_size - offset : th->segment_size;
+		conn->digest = roce_digest_add(conn->digest, roce_crc32c(0, conn->send_buf + offset, size));
+		conn->checksummed++;
+	}
+}
+
+//Move the whole transfer on every connection of the thread, split into segments the device accepts
+static int run_bulk_loop(struct client_thread *th, enum client_op op) {
+	struct ibv_wc wc[MAX_WR];
+	struct client_conn *conn;
+	uint64_t start;
+	int segments = (transfer_size + th->segment_size - 1) / th->segment_size;
+	int done = 0, c, i, ret = -1;
+
+	for (c = 0; c < th->num_conns; c++) {
+		client_prepare_rdma_wr(&th->conns[c], op, th->segment_size);
+		th->conns[c].posted = th->conns[c].completed = 0;
+		th->conns[c].checksummed = 0;
+		th->conns[c].digest = 0;
+	}
+
+	start = roce_get_time_ns();
+
+	while (done < th->num_conns) {
+		for (c = 0; c < th->num_conns; c++) {
+			ret = client_post_segments(th, &th->conns[c], c, op, segments);
+			if (ret) {
+				return ret;
+			}
+
+			//Segments written so far are checksummed while the rest is still in flight
+			if (verify_checksum && op == OP_WRITE) {
+				client_checksum_segments(th, &th->conns[c]);
+			}
+		}
+
+		ret = collect_wc_events(th->client_cq, wc, MAX_WR);
+		if (ret < 0) {
+			printf("Could not get WC Events \n");
+			return ret;
+		}
+
+		for (i = 0; i < ret; i++) {
+			conn = &th->conns[wc[i].wr_id >> 32];
+			conn->completed = (uint32_t) wc[i].wr_id + 1;
+			if (conn->completed == segments) {
+				done++;
+			}
+		}
+	}
+
+	//Every connection moved one transfer
+	th->results[op].start_ns = start;
+	th->results[op].end_ns = roce_get_time_ns();
+	th->results[op].messages = th->num_conns;
+
+	for (c = 0; c < th->num_conns && verify_checksum && op == OP_WRITE; c++) {
+		client_checksum_segments(th, &th->conns[c]);
+	}
+
+	return 0;
+}
+
+//WRITE the transfer to the server and READ it back, the functional test compares both copies
+static int perform_bulk_test(struct client_thread *th) {
+	int op, ret = 0;
+
+	th->segment_size = ((uint64_t) msg_size < th->max_msg_size) ? (uint64_t) msg_size : th->max_msg_size;
+	if ((transfer_size + th->segment_size - 1) / th->segment_size > INT_MAX) {
+		printf("Transfer needs too many segments of %lu bytes \n", th->segment_size);
+		return -EINVAL;
+	}
+
+	for (op = 0; op < OP_COUNT; op++) {
+		if (!client_op_active(op)) {
+			continue;
+		}
+		if (client_sync(ret)) {
+			return ret ? ret : -ECANCELED;
+		}
+
+		ret = run_bulk_loop(th, op);
+		if (ret) {
+			printf("Could not perform %s bulk transfer \n", op_names[op]);
+		}
+	}
+
+	return ret;
+}
+
+//Write to the server on every connection while the server writes the same number of messages back,
+//its direction ends with the WRITE_WITH_IMM that follows all of its WRITEs
+static int run_bidir_loop(struct client_thread *th) {
+	struct ibv_wc wc[MAX_WR];
+	struct ibv_send_wr start_wr, *bad_start_wr = NULL;
+	struct client_conn *conn;
+	uint64_t start, now, out_end = 0, in_end = 0;
+	int done = 0, c, i, ret = -1;
+
+	for (c = 0; c < th->num_conns; c++) {
+		client_prepare_rdma_wr(&th->conns[c], OP_BIDIR_OUT, msg_size);
+		th->conns[c].posted = th->conns[c].completed = 0;
+	}
+
+	//Empty SEND starts the stream of the server, it is retired by the first signaled WRITE
+	bzero(&start_wr, sizeof(start_wr));
+	start_wr.opcode = IBV_WR_SEND;
+
+	start = roce_get_time_ns();
+	for (c = 0; c < th->num_conns; c++) {
+		ret = roce_post_send(th->conns[c].client_qp, &start_wr, &bad_start_wr);
+		if (ret) {
+			printf("Could not start server stream \n");
+			return -ret;
+		}
+	}
+
+	//Every connection is done once in both directions
+	while (done < 2 * th->num_conns) {
+		for (c = 0; c < th->num_conns; c++) {
+			ret = client_fill_send_queue(&th->conns[c], c, OP_BIDIR_OUT, iterations, th->batch);
+			if (ret) {
+				return ret;
+			}
+		}
+
+		ret = collect_wc_events(th->client_cq, wc, MAX_WR);
+		if (ret < 0) {
+			printf("Could not get WC Events \n");
+			return ret;
+		}
+		now = roce_get_time_ns();
+
+		for (i = 0; i < ret; i++) {
+			conn = &th->conns[wc[i].wr_id >> 32];
+			if (wc[i].opcode == IBV_WC_RECV_RDMA_WITH_IMM) {
+				in_end = now;
+				done++;
+				if (roce_recv_ring_release(&conn->recv_ring, (uint32_t) wc[i].wr_id)) {
+					return -EIO;
+				}
+			} else {
+				conn->completed = (uint32_t) wc[i].wr_id + 1;
+				if (conn->completed == iterations) {
+					out_end = now;
+					done++;
+				}
+			}
+		}
+	}
+
+	th->results[OP_BIDIR_OUT].start_ns = start;
+	th->results[OP_BIDIR_OUT].end_ns = out_end;
+	th->results[OP_BIDIR_OUT].messages = (uint64_t) iterations * th->num_conns;
+	th->results[OP_BIDIR_IN].start_ns = start;
+	th->results[OP_BIDIR_IN].end_ns = in_end;
+	th->results[OP_BIDIR_IN].messages = (uint64_t) iterations * th->num_conns;
+
+	return 0;
+}
+
+//Measure WRITEs to the server alone, then while the server writes to the client at the same time
+static int perform_bidir_test(struct client_thread *th) {
+	int c, ret = 0;
+
+	//One direction alone is the baseline for the interference between both directions
+	if (client_sync(ret)) {
+		return -ECANCELED;
+	}
+	if (warmup) {
+		ret = run_bw_loop(th, OP_WRITE, msg_size, warmup, 0);
+	}
+	if (!ret) {
+		ret = run_bw_loop(th, OP_WRITE, msg_size, iterations, 1);
+	}
+	if (ret) {
+		printf("Could not perform %s bandwidth test \n", op_names[OP_WRITE]);
+	}
+
+	if (client_sync(ret)) {
+		return ret ? ret : -ECANCELED;
+	}
+	ret = run_bidir_loop(th);
+	if (ret) {
+		printf("Could not perform bidirectional test \n");
+	}
+
+	//Read back what the client wrote for the functional test, both streams are finished by now
+	for (c = 0; c < th->num_conns && !ret; c++) {
+		client_prepare_rdma_wr(&th->conns[c], OP_READ, msg_size);
+		ret = post_rdma_and_wait(th, &th->conns[c], OP_READ);
+	}
+
+	return ret;
+}
+
+//Destroy QP and CM ID of a connection and return its buffers, the connection may have failed part-way through its setup
+static void client_conn_clean(struct client_thread *th, struct client_conn *conn) {
+	int f, ret = -1;
+
+	if (conn->cm_client_id) {
+		//Destroy Queue Pair
+		if (conn->cm_client_id->qp) {
+			rdma_destroy_qp(conn->cm_client_id);
+		}
+
+		//Destroy Client CM ID
+		ret = rdma_destroy_id(conn->cm_client_id);
+		if (ret) {
+			printf("Could not destroy Client ID \n");
+		}
+		conn->cm_client_id = NULL;
+		conn->client_qp = NULL;
+	}
+
+	//Return buffers to the allocator of the thread
+	roce_recv_ring_destroy(&conn->recv_ring, &th->mem);
+	roce_mem_free(&th->mem, &conn->server_metadata);
+	roce_mem_free(&th->mem, &conn->client_metadata);
+	roce_mem_free(&th->mem, &conn->client_send_mem);
+	roce_mem_free(&th->mem, &conn->client_recv_mem);
+	roce_mem_free(&th->mem, &conn->checksum_mem);
+	for (f = 0; f < num_frags; f++) {
+		if (conn->frag_mr[f]) {
+			roce_free_buffer(conn->frag_mr[f]);
+			conn->frag_mr[f] = NULL;
+		}
+	}
+}
+
+//Disconnect from server and clean up resources of one connection
+static int client_disconnect_and_clean(struct client_thread *th, struct client_conn *conn) {
+	struct rdma_cm_event *cm_event = NULL;
+	int ret = -1;
+
+	//Client side actively disconnects from server
+	ret = rdma_disconnect(conn->cm_client_id);
+	if (ret) {
+		printf("Could not disconnect \n");
+	}
+
+	//Report Disconnect event to CM
+	ret = process_rdma_cm_event(th->cm_event_channel, RDMA_CM_EVENT_DISCONNECTED, &cm_event);
+	if (ret) {
+		printf("Could not receive valid CM event \n");
+	}
+
+	//Acknowledge Disconnect event
+	ret = rdma_ack_cm_event(cm_event);
+	if (ret) {
+		printf("Could not acknowledge CM Event \n");
+	}
+
+	client_conn_clean(th, conn);
+	return 0;
+}
+
+//Clean up resources shared by the connections of a thread, also after its setup failed part-way
+static void client_thread_clean(struct client_thread *th) {
+	int ret = -1;
+
+	//Destroy Completion Queue
+	if (th->client_cq) {
+		ret = ibv_destroy_cq(th->client_cq);
+		if (ret) {
+			printf("Could not destroy CQ \n");
+		}
+		th->client_cq = NULL;
+	}
+
+	//Destroy I/O Completion Channel
+	if (th->io_completion_channel) {
+		ret = ibv_destroy_comp_channel(th->io_completion_channel);
+		if (ret) {
+			printf("Could not destroy Comp Channel \n");
+		}
+		th->io_completion_channel = NULL;
+	}
+
+	if (th->pd) {
+		//Deregister all memory of the thread
+		roce_mem_pool_destroy(&th->mem);
+
+		//Destroy Protection Domain
+		ret = ibv_dealloc_pd(th->pd);
+		if (ret) {
+			printf("Could not destroy Client PD \n");
+		}
+		th->pd = NULL;
+	}
+
+	//Destroy and close Event Channel
+	if (th->cm_event_channel) {
+		rdma_destroy_event_channel(th->cm_event_channel);
+		th->cm_event_channel = NULL;
+	}
+}
+
+//Pin calling thread to its configured core
+static void client_pin_thread(struct client_thread *th) {
+	cpu_set_t cpuset;
+	int ret = -1;
+
+	CPU_ZERO(&cpuset);
+	CPU_SET(th->cpu, &cpuset);
+
+	ret = pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset);
+	if (ret) {
+		printf("Could not pin thread %d to core %d \n", th->id, th->cpu);
+	}
+}
+
+//Connect all connections of a thread and exchange metadata
+static int client_thread_connect(struct client_thread *th) {
+	struct client_conn *conn;
+	uint64_t start;
+	int c, ret = -1;
+
+	//Open event channel and report asynchronous event to CM
+	th->cm_event_channel = rdma_create_event_channel();
+	if (!th->cm_event_channel) {
+		printf("Could not create CM Event Channel \n");
+		return -errno;
+	}
+
+	for (c = 0; c < th->num_conns; c++) {
+		conn = &th->conns[c];
+
+		start = roce_get_time_ns();
+		ret = client_prepare_connection(th, conn, &server_sockaddr);
+		if (ret) {
+			printf("Could not start client connection \n");
+			return ret;
+		}
+		th->setup_ns[SETUP_RESOLVE] += roce_get_time_ns() - start;
+
+		//All connections of the thread reach the server through the same device
+		if (c == 0) {
+			ret = roce_query_transfer_limits(conn->cm_client_id, &th->max_msg_size, &th->max_mr_size);
+			if (ret) {
+				return ret;
+			}
+		}
+
+		start = roce_get_time_ns();
+		ret = client_alloc_buffers(th, conn);
+		if (ret) {
+			return ret;
+		}
+
+		ret = client_pre_post_recv_buffer(th, conn);
+		if (ret) {
+			printf("Could not set up client connection \n");
+			return ret;
+		}
+		th->setup_ns[SETUP_REGISTER] += roce_get_time_ns() - start;
+
+		start = roce_get_time_ns();
+		ret = client_connect_to_server(th, conn);
+		if (ret) {
+			printf("Could not connect to server \n");
+			return ret;
+		}
+		th->num_connected++;
+		th->setup_ns[SETUP_CONNECT] += roce_get_time_ns() - start;
+
+		start = roce_get_time_ns();
+		ret = exchange_metadata(th, conn);
+		th->setup_ns[SETUP_METADATA] += roce_get_time_ns() - start;
+		if (ret) {
+			printf("Failed to setup client connection , ret = %d \n", ret);
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+//Start setup of a connection in connection rate mode by resolving the server address
+static int client_conn_begin(struct client_thread *th, struct client_conn *conn) {
+	int ret = -1;
+
+	conn->client_qp = NULL;
+	conn->setup_start = roce_get_time_ns();
+	conn->phase_start = conn->setup_start;
+
+	//Events of the connection find it through the context of its CM ID
+	ret = rdma_create_id(th->cm_event_channel, &conn->cm_client_id, conn, RDMA_PS_TCP);
+	if (ret) {
+		printf("Could not create CM ID \n");
+		conn->cm_client_id = NULL;
+		return -errno;
+	}
+
+	ret = rdma_resolve_addr(conn->cm_client_id, NULL, (struct sockaddr*) &server_sockaddr, RESOLVE_TIMEOUT_MS);
+	if (ret) {
+		printf("Could not resolve address \n");
+		return -errno;
+	}
+
+	return 0;
+}
+
+//Destroy QP and CM ID of a connection in connection rate mode
+static int client_conn_release(struct client_conn *conn) {
+	int ret = -1;
+
+	if (conn->client_qp) {
+		rdma_destroy_qp(conn->cm_client_id);
+		conn->client_qp = NULL;
+	}
+
+	ret = rdma_destroy_id(conn->cm_client_id);
+	conn->cm_client_id = NULL;
+	if (ret) {
+		printf("Could not destroy Client ID \n");
+		return -errno;
+	}
+	return 0;
+}
+
+//Open and tear down iterations connections with up to num_conns of them in flight at a time,
+//each connection moves on when the CM event of its current phase arrives on the event channel of the thread
+static int perform_conn_test(struct client_thread *th) {
+	struct rdma_cm_event *cm_event = NULL;
+	enum rdma_cm_event_type event_type;
+	struct client_conn *conn;
+	uint64_t start, now;
+	int ret = -1, started = 0, finished = 0, status, c, phase;
+
+	for (phase = 0; phase < CONN_PHASES; phase++) {
+		roce_hist_init(&th->conn_results[phase].hist);
+	}
+
+	start = roce_get_time_ns();
+	now = start;
+	for (c = 0; c < th->num_conns && started < iterations; c++) {
+		ret = client_conn_begin(th, &th->conns[c]);
+		if (ret) {
+			return ret;
+		}
+		started++;
+	}
+
+	while (finished < started) {
+		ret = rdma_get_cm_event(th->cm_event_channel, &cm_event);
+		if (ret) {
+			printf("Could not get CM Event \n");
+			return -errno;
+		}
+		now = roce_get_time_ns();
+
+		//Event must be acknowledged before its CM ID can be destroyed
+		conn = cm_event->id->context;
+		event_type = cm_event->event;
+		status = cm_event->status;
+		ret = rdma_ack_cm_event(cm_event);
+		if (ret) {
+			printf("Could not acknowledge CM Event \n");
+			return -errno;
+		}
+		if (status) {
+			printf("CM Event %s with status %d \n", rdma_event_str(event_type), status);
+			return -ECONNABORTED;
+		}
+
+		switch (event_type) {
+			case RDMA_CM_EVENT_ADDR_RESOLVED:
+				roce_hist_record(&th->conn_results[CONN_ADDR].hist, now - conn->phase_start);
+				conn->phase_start = now;
+				ret = rdma_resolve_route(conn->cm_client_id, RESOLVE_TIMEOUT_MS);
+				if (ret) {
+					printf("Could not resolve route \n");
+					return -errno;
+				}
+				break;
+			case RDMA_CM_EVENT_ROUTE_RESOLVED:
+				roce_hist_record(&th->conn_results[CONN_ROUTE].hist, now - conn->phase_start);
+
+				//PD and CQ are created once for all connections of the thread, the connection creating them
+				//does not count their time in its total either
+				if (!th->pd) {
+					ret = client_setup_thread_resources(th, conn->cm_client_id->verbs);
+					if (ret) {
+						return ret;
+					}
+					conn->phase_start = roce_get_time_ns();
+					roce_hist_record(&th->conn_results[CONN_PD_CQ].hist, conn->phase_start - now);
+					conn->setup_start += conn->phase_start - now;
+					now = conn->phase_start;
+				}
+				ret = client_create_qp(th, conn);
+				if (ret) {
+					return ret;
+				}
+				conn->phase_start = roce_get_time_ns();
+				roce_hist_record(&th->conn_results[CONN_QP].hist, conn->phase_start - now);
+
+				ret = client_start_connect(conn);
+				if (ret) {
+					return ret;
+				}
+				break;
+			case RDMA_CM_EVENT_ESTABLISHED:
+				roce_hist_record(&th->conn_results[CONN_CONNECT].hist, now - conn->phase_start);
+				roce_hist_record(&th->conn_results[CONN_TOTAL].hist, now - conn->setup_start);
+
+				//Environment is recorded from the first connection of the run
+				if (th->id == 0 && !finished && output_format != OUTPUT_TEXT) {
+					client_collect_env(th, conn);
+				}
+
+				conn->phase_start = roce_get_time_ns();
+				ret = rdma_disconnect(conn->cm_client_id);
+				if (ret) {
+					printf("Could not disconnect \n");
+					return -errno;
+				}
+				break;
+			case RDMA_CM_EVENT_DISCONNECTED:
+				ret = client_conn_release(conn);
+				if (ret) {
+					return ret;
+				}
+				now = roce_get_time_ns();
+				roce_hist_record(&th->conn_results[CONN_TEARDOWN].hist, now - conn->phase_start);
+				finished++;
+
+				//Freed slot starts the next connection right away
+				if (started < iterations) {
+					ret = client_conn_begin(th, conn);
+					if (ret) {
+						return ret;
+					}
+					started++;
+				}
+				break;
+			default:
+				printf("Unexpected event received (%s) \n", rdma_event_str(event_type));
+				return -EPROTO;
+		}
+	}
+
+	//Connections per second are counted from the first request until the last connection was torn down
+	for (phase = 0; phase < CONN_PHASES; phase++) {
+		th->conn_results[phase].start_ns = start;
+		th->conn_results[phase].end_ns = now;
+		th->conn_results[phase].messages = finished;
+	}
+
+	return 0;
+}
+
+//Connection rate thread, it keeps no connection open after its run
+static void *client_conn_thread_main(struct client_thread *th) {
+	int c, ret = -1;
+
+	th->cm_event_channel = rdma_create_event_channel();
+	if (!th->cm_event_channel) {
+		printf("Could not create CM Event Channel \n");
+		ret = -errno;
+	} else {
+		ret = 0;
+	}
+
+	//All threads start connecting at the same time
+	if (!client_sync(ret)) {
+		roce_get_cpu_usage(&th->usage_start);
+		ret = perform_conn_test(th);
+		roce_get_cpu_usage(&th->usage_end);
+	}
+	th->ret = ret;
+
+	//Connections still in setup when the run failed
+	for (c = 0; c < th->num_conns; c++) {
+		if (th->conns[c].cm_client_id) {
+			client_conn_release(&th->conns[c]);
+		}
+	}
+
+	client_thread_clean(th);
+
+	return NULL;
+}
+
+//Benchmark thread
+static void *client_thread_main(void *arg) {
+	struct client_thread *th = arg;
+	int c, failed = 0, ret = -1;
+
+	client_pin_thread(th);
+
+	//Connection rate mode sets up and tears down connections instead of running a benchmark over them
+	if (bench_mode == MODE_CONN) {
+		return client_conn_thread_main(th);
+	}
+
+	ret = client_thread_connect(th);
+	if (!ret && th->id == 0 && output_format != OUTPUT_TEXT) {
+		client_collect_env(th, &th->conns[0]);
+	}
+	if (!client_sync(ret)) {
+		roce_get_cpu_usage(&th->usage_start);
+
+		switch (bench_mode) {
+			case MODE_LATENCY:
+				ret = perform_latency_test(th);
+				break;
+			case MODE_BANDWIDTH:
+				ret = perform_bw_test(th);
+				break;
+			case MODE_SWEEP:
+				ret = perform_size_sweep(th);
+				break;
+			case MODE_PINGPONG:
+				ret = perform_pingpong_test(th);
+				break;
+			case MODE_WRITE_POLL:
+			case MODE_WRITE_IMM:
+				ret = perform_write_pingpong_test(th);
+				break;
+			case MODE_SGE:
+				ret = perform_sge_test(th);
+				break;
+			case MODE_ATOMIC:
+				ret = perform_atomic_test(th);
+				break;
+			case MODE_BIDIR:
+				ret = perform_bidir_test(th);
+				break;
+			case MODE_BULK:
+				ret = perform_bulk_test(th);
+				break;
+			case MODE_BATCH:
+				ret = perform_batch_sweep(th);
+				break;
+			default:
+				for (c = 0; c < th->num_conns && !ret; c++) {
+					ret = perform_write_read(th, &th->conns[c]);
+				}
+				break;
+		}
+
+		roce_get_cpu_usage(&th->usage_end);
+
+		if (ret == -ECANCELED) {
+			printf("Benchmark was cancelled by another thread \n");
+		} else if (ret) {
+			printf("Could not perform WRITE/READ operations \n");
+		} else {
+			for (c = 0; c < th->num_conns; c++) {
+				if (verify_checksum) {
+					failed |= client_verify_checksum(th, &th->conns[c]);
+				} else {
+					failed |= (bench_mode == MODE_ATOMIC) ? check_atomic_counter(&th->conns[c]) : check_send_buf_recv_buf(&th->conns[c]);
+				}
+			}
+
+			if (failed) {
+				printf("Functional test failed \n");
+				ret = -EIO;
+			} else {
+				printf("Functional test was successful \n");
+			}
+		}
+	}
+
+	th->ret = ret;
+
+	for (c = 0; c < th->num_connected; c++) {
+		ret = client_disconnect_and_clean(th, &th->conns[c]);
+		if (ret) {
+			printf("Could not disconnect/clean up \n");
+		}
+	}
+
+	//Connection that failed part-way through its setup never got connected
+	if (th->num_connected < th->num_conns) {
+		client_conn_clean(th, &th->conns[th->num_connected]);
+	}
+	client_thread_clean(th);
+
+	return NULL;
+}
+
+//Print latency, bandwidth and CPU cost of gathering fragmented messages by memcpy and by the NIC
+static void client_print_sge_results() {
+	struct client_op_result total;
+	double elapsed_us;
+	int op, f;
+
+	printf("Scatter-gather in usec (%d iterations, %d warmup, %d threads x %d QPs), %d fragments: ", iterations, warmup, num_threads, qps_per_thread, num_frags);
+	for (f = 0; f < num_frags; f++) {
+		printf("%s%u", f ? "+" : "", frag_sizes[f]);
+	}
+	printf(" = %d bytes \n", msg_size);
+	printf("%-10s %10s %10s %10s %12s %12s %12s \n", "op", "SGEs", "p50", "p99", "MB/s", "Mmsg/s", "CPU ns/msg");
+
+	for (op = 0; op < OP_COUNT; op++) {
+		if (!client_op_active(op)) {
+			continue;
+		}
+
+		client_aggregate_results(op, &total);
+		elapsed_us = (total.end_ns - total.start_ns) / 1000.0;
+		printf("%-10s %10d %10.3f %10.3f %12.2f %12.3f %12.1f \n", op_names[op], op == OP_WRITE_SGE ? num_frags : 1,
+				roce_hist_percentile(&total.hist, 50.0) / 1000.0,
+				roce_hist_percentile(&total.hist, 99.0) / 1000.0,
+				((double) msg_size * total.messages) / elapsed_us,
+				total.messages / elapsed_us,
+				(double) total.cpu_ns / total.messages);
+		client_emit_record(op_names[op], msg_size, &total, 1, 1);
+	}
+}
+
+//Print latency and pipelined rate of atomics, and how many CMP-SWAPs found the value they expected
+static void client_print_atomic_results() {
+	struct client_op_result total;
+	uint64_t attempts = (uint64_t) iterations * num_threads * qps_per_thread;
+	double elapsed_us;
+	int op, t;
+
+	printf("Atomics in usec (%d iterations, %d warmup, queue depth %d, %d threads x %d QPs on %s) \n", iterations, warmup, queue_depth,
+			num_threads, qps_per_thread, atomic_contention ? "one shared slot" : "one slot per QP");
+	printf("%-10s %10s %10s %10s %10s %12s %12s \n", "op", "min", "p50", "p99", "max", "Mops/s", "swapped %");
+
+	for (op = 0; op < OP_COUNT; op++) {
+		if (!client_op_active(op)) {
+			continue;
+		}
+
+		client_aggregate_results(op, &total);
+		elapsed_us = (total.end_ns - total.start_ns) / 1000.0;
+		printf("%-10s %10.3f %10.3f %10.3f %10.3f %12.3f ", op_names[op],
+				total.hist.min / 1000.0,
+				roce_hist_percentile(&total.hist, 50.0) / 1000.0,
+				roce_hist_percentile(&total.hist, 99.0) / 1000.0,
+				total.hist.max / 1000.0,
+				total.messages / elapsed_us);
+		if (op == OP_CMP_SWAP) {
+			printf("%12.2f \n", 100.0 * total.succeeded / attempts);
+		} else {
+			printf("%12s \n", "-");
+		}
+		client_emit_record(op_names[op], sizeof(uint64_t), &total, 1, 1);
+	}
+
+	for (t = 0; t < num_threads; t++) {
+		printf("Thread %d (core %d): ", t, threads[t].cpu);
+		roce_print_cpu_usage(&threads[t].usage_start, &threads[t].usage_end);
+	}
+}
+
+//Print bandwidth of each direction alone and at the same time, and of both directions combined
+static void client_print_bidir_results() {
+	struct client_op_result alone, out, in, combined;
+	int t;
+
+	printf("Bidirectional WRITE bandwidth (%d messages per QP and direction, %d bytes, queue depth %d client / %d server, %d threads x %d QPs) \n",
+			iterations, msg_size, queue_depth, reverse_depth, num_threads, qps_per_thread);
+	printf("%-10s %12s %12s \n", "op", "MB/s", "Mmsg/s");
+
+	client_aggregate_results(OP_WRITE, &alone);
+	client_aggregate_results(OP_BIDIR_OUT, &out);
+	client_aggregate_results(OP_BIDIR_IN, &in);
+
+	//Both directions start together, the combined run lasts until the later one finished
+	combined = out;
+	combined.messages += in.messages;
+	if (in.end_ns > combined.end_ns) {
+		combined.end_ns = in.end_ns;
+	}
+
+	print_bw_report(op_names[OP_WRITE], msg_size, &alone);
+	print_bw_report(op_names[OP_BIDIR_OUT], msg_size, &out);
+	print_bw_report(op_names[OP_BIDIR_IN], msg_size, &in);
+	print_bw_report("BIDIR-SUM", msg_size, &combined);
+
+	client_emit_record(op_names[OP_WRITE], msg_size, &alone, 0, 1);
+	client_emit_record(op_names[OP_BIDIR_OUT], msg_size, &out, 0, 1);
+	client_emit_record(op_names[OP_BIDIR_IN], msg_size, &in, 0, 1);
+	client_emit_record("BIDIR-SUM", msg_size, &combined, 0, 1);
+
+	for (t = 0; t < num_threads; t++) {
+		printf("Thread %d (core %d): ", t, threads[t].cpu);
+		roce_print_cpu_usage(&threads[t].usage_start, &threads[t].usage_end);
+	}
+}
+
+//Print duration and throughput of the bulk WRITE and READ over all connections
+static void client_print_bulk_results() {
+	struct client_op_result total;
+	double elapsed_us;
+	int op, t;
+
+	printf("Bulk transfer (%lu bytes per QP in segments of %lu bytes, device limit %lu, queue depth %d, signal every %d, %d threads x %d QPs) \n",
+			transfer_size, threads[0].segment_size, threads[0].max_msg_size, queue_depth, signal_interval, num_threads, qps_per_thread);
+	printf("%-10s %12s %12s %12s \n", "op", "seconds", "MB/s", "GiB/s");
+
+	for (op = 0; op < OP_COUNT; op++) {
+		if (!client_op_active(op)) {
+			continue;
+		}
+
+		client_aggregate_results(op, &total);
+		elapsed_us = (total.end_ns - total.start_ns) / 1000.0;
+		printf("%-10s %12.3f %12.2f %12.3f \n", op_names[op], elapsed_us / 1e6,
+				((double) transfer_size * total.messages) / elapsed_us,
+				((double) transfer_size * total.messages) / (1024.0 * 1024.0 * 1024.0) / (elapsed_us / 1e6));
+		client_emit_record(op_names[op], transfer_size, &total, 0, 1);
+	}
+
+	for (t = 0; t < num_threads; t++) {
+		printf("Thread %d (core %d): ", t, threads[t].cpu);
+		roce_print_cpu_usage(&threads[t].usage_start, &threads[t].usage_end);
+	}
+}
+
+//Print latency distribution of every connection phase and the sustained connection rate
+static void client_print_conn_results() {
+	struct client_op_result total;
+	char label[32];
+	int t, phase;
+
+	printf("Connection setup and teardown in usec (%d connections per thread, %d in flight per thread, %d threads) \n", iterations, qps_per_thread, num_threads);
+	printf("%-10s %10s %10s %10s %10s %10s %10s %10s \n", "phase", "min", "mean", "p50", "p99", "p99.9", "p99.99", "max");
+
+	for (phase = 0; phase < CONN_PHASES; phase++) {
+		//Per-thread rows are only printed when there is more than one thread
+		for (t = 0; t < num_threads && num_threads > 1; t++) {
+			snprintf(label, sizeof(label), "T%d %s", t, conn_phase_names[phase]);
+			print_latency_report(label, &threads[t].conn_results[phase].hist);
+		}
+
+		client_init_total(&total);
+		for (t = 0; t < num_threads; t++) {
+			client_merge_result(&total, &threads[t].conn_results[phase]);
+		}
+		print_latency_report(conn_phase_names[phase], &total.hist);
+
+		//Rate is recorded with the total only, the phases share its time span
+		client_emit_record(conn_phase_names[phase], 0, &total, 1, phase == CONN_TOTAL);
+	}
+
+	printf("Connections per second: %.1f \n", total.messages * 1e9 / (total.end_ns - total.start_ns));
+
+	for (t = 0; t < num_threads; t++) {
+		printf("Thread %d (core %d): ", t, threads[t].cpu);
+		roce_print_cpu_usage(&threads[t].usage_start, &threads[t].usage_end);
+	}
+}
+
+//Print per-thread and aggregate results of latency and bandwidth mode
+static void client_print_results() {
+	struct client_op_result total;
+	char label[32];
+	int t, op, latency;
+
+	if (bench_mode == MODE_SGE) {
+		client_print_sge_results();
+		return;
+	} else if (bench_mode == MODE_ATOMIC) {
+		client_print_atomic_results();
+		return;
+	} else if (bench_mode == MODE_BIDIR) {
+		client_print_bidir_results();
+		return;
+	} else if (bench_mode == MODE_BULK) {
+		client_print_bulk_results();
+		return;
+	} else if (bench_mode == MODE_CONN) {
+		client_print_conn_results();
+		return;
+	}
+
+	latency = (bench_mode == MODE_LATENCY || bench_mode == MODE_WRITE_POLL || bench_mode == MODE_WRITE_IMM);
+	if (latency) {
+		printf("%s in usec (%d iterations, %d warmup, %d bytes, %d threads x %d QPs, inline up to %u bytes) \n",
+				bench_mode == MODE_LATENCY ? "Latency" : "Round trip latency", iterations, warmup, msg_size, num_threads, qps_per_thread, threads[0].max_inline);
+		if (cq_timestamps) {
+			printf("NIC: post until %s completion timestamp, host: completion timestamp until the completion was processed \n",
+					threads[0].hw_timestamps ? "device" : "software");
+		}
+		printf("%-10s %10s %10s %10s %10s %10s %10s %10s \n", "op", "min", "mean", "p50", "p99", "p99.9", "p99.99", "max");
+	} else if (bench_mode == MODE_BANDWIDTH) {
+		printf("Bandwidth (%d messages per QP, %d bytes, queue depth %d, signal every %d, %d WRs per post, %s API, %d threads x %d QPs) \n", iterations, msg_size, queue_depth,
+				signal_interval, post_batch, roce_post_api_str(roce_get_post_api()), num_threads, qps_per_thread);
+		printf("%-10s %12s %12s \n", "op", "MB/s", "Mmsg/s");
+	} else {
+		return;
+	}
+
+	for (op = 0; op < OP_COUNT; op++) {
+		if (!client_op_active(op)) {
+			continue;
+		}
+
+		//Per-thread rows are only printed when there is more than one thread
+		for (t = 0; t < num_threads && num_threads > 1; t++) {
+			snprintf(label, sizeof(label), "T%d %s", t, op_names[op]);
+			if (latency) {
+				print_latency_report(label, &threads[t].results[op].hist);
+			} else {
+				print_bw_report(label, msg_size, &threads[t].results[op]);
+			}
+		}
+
+		client_aggregate_results(op, &total);
+		if (latency) {
+			print_latency_report(op_names[op], &total.hist);
+
+			//Operations timed with completion timestamps are split into NIC and host time
+			if (total.nic_hist.count) {
+				print_latency_report("  NIC", &total.nic_hist);
+				print_latency_report("  host", &total.host_hist);
+			}
+		} else {
+			print_bw_report(op_names[op], msg_size, &total);
+		}
+		client_emit_record(op_names[op], msg_size, &total, latency, !latency);
+	}
+
+	for (t = 0; t < num_threads; t++) {
+		printf("Thread %d (core %d): ", t, threads[t].cpu);
+		roce_print_cpu_usage(&threads[t].usage_start, &threads[t].usage_end);
+	}
+}
+
+//Print mean time of every connection setup phase, which is not part of any measurement
+static void client_print_setup() {
+	uint64_t total;
+	int t, phase;
+
+	printf("Connection setup in usec (mean of %d connections): ", num_threads * qps_per_thread);
+	for (phase = 0; phase < SETUP_PHASES; phase++) {
+		total = 0;
+		for (t = 0; t < num_threads; t++) {
+			total += threads[t].setup_ns[phase];
+		}
+		printf("%s%s %.1f", phase ? ", " : "", setup_phase_names[phase], total / 1000.0 / (num_threads * qps_per_thread));
+	}
+	printf(" \n");
+}
+
+//Total size of the given fragments, the default header if none are given
+static uint32_t client_frag_total() {
+	uint32_t total = 0;
+	int f;
+
+	if (!num_frags) {
+		return DEFAULT_SGE_HEADER;
+	}
+	for (f = 0; f < num_frags; f++) {
+		total += frag_sizes[f];
+	}
+	return total;
+}
+
+//Split message into the given fragments and one more holding the rest of it
+static void client_split_message() {
+	uint32_t total = client_frag_total();
+
+	if (!num_frags) {
+		frag_sizes[num_frags++] = DEFAULT_SGE_HEADER;
+	}
+	frag_sizes[num_frags++] = msg_size - total;
+}
+
+//Check that the configured benchmark can run, the configuration is left unchanged
+static int client_check_config() {
+	//Atomics return the previous value into the receive buffer
+	if (bench_mode == MODE_ATOMIC && msg_size < (int) sizeof(uint64_t)) {
+		printf("Atomic mode needs a message size of at least %zu bytes \n", sizeof(uint64_t));
+		return -EINVAL;
+	}
+
+	//Last fragment holds the rest of the message and must not be empty
+	if (bench_mode == MODE_SGE && client_frag_total() >= (uint32_t) msg_size) {
+		printf("Fragments must be smaller than the message \n");
+		return -EINVAL;
+	}
+
+	//Only a server that holds the buffer without taking part in the traffic can checksum it
+	if (verify_checksum && (bench_mode == MODE_PINGPONG || bench_mode == MODE_WRITE_POLL || bench_mode == MODE_WRITE_IMM ||
+			bench_mode == MODE_ATOMIC || bench_mode == MODE_BIDIR)) {
+		printf("Checksum verification is not supported in this mode \n");
+		return -EINVAL;
+	}
+
+	//Bulk transfers are segmented by -s, their size is given separately
+	if (bench_mode == MODE_BULK && !transfer_size) {
+		printf("Bulk mode needs a transfer size \n");
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+//Run the configured benchmark once with fresh threads and connections
+static int client_run() {
+	int ret, t;
+	long num_cpus;
+
+	bench_failed = 0;
+
+	//Invalid cases fail on their own instead of ending the process of the harness
+	ret = client_check_config();
+	if (ret) {
+		return ret;
+	}
+	if (bench_mode != MODE_ATOMIC) {
+		atomic_contention = 0;
+	}
+
+	//Messages are only fragmented in scatter-gather mode
+	if (bench_mode != MODE_SGE) {
+		num_frags = 0;
+	} else {
+		client_split_message();
+	}
+
+	//Server writes back as deep as the client unless told otherwise,
+	//the SEND starting its stream takes one more slot of the send queue
+	if (!reverse_depth) {
+		reverse_depth = queue_depth;
+	}
+	if (bench_mode == MODE_BIDIR && queue_depth == MAX_WR) {
+		queue_depth = MAX_WR - 1;
+	}
+
+	//A full send queue must always contain a signaled WR
+	if (signal_interval > queue_depth) {
+		signal_interval = queue_depth;
+	}
+
+	//WRs are posted one by one unless batching is asked for, a chain never exceeds the queue depth
+	if (!post_batch) {
+		post_batch = (bench_mode == MODE_BATCH) ? DEFAULT_BATCH : 1;
+	}
+	if (post_batch > queue_depth) {
+		post_batch = queue_depth;
+	}
+
+	//Set up benchmark threads, by default thread i runs on core i
+	threads = calloc(num_threads, sizeof(*threads));
+	if (!threads) {
+		printf("Could not allocate memory \n");
+		return -ENOMEM;
+	}
+
+	num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	for (t = 0; t < num_threads; t++) {
+		threads[t].id = t;
+		threads[t].cpu = num_thread_cpus ? thread_cpus[t % num_thread_cpus] : (int) (t % num_cpus);
+		threads[t].num_conns = qps_per_thread;
+		threads[t].batch = post_batch;
+		threads[t].conns = calloc(qps_per_thread, sizeof(struct client_conn));
+		if (!threads[t].conns) {
+			printf("Could not allocate memory \n");
+			return -ENOMEM;
+		}
+	}
+
+	pthread_barrier_init(&client_barrier, NULL, num_threads);
+
+	//Call all client-side functions in every thread
+	for (t = 0; t < num_threads; t++) {
+		ret = pthread_create(&threads[t].thread, NULL, client_thread_main, &threads[t]);
+		if (ret) {
+			printf("Could not create thread \n");
+			return -ret;
+		}
+	}
+
+	ret = 0;
+	for (t = 0; t < num_threads; t++) {
+		pthread_join(threads[t].thread, NULL);
+		//Report the error of the failing thread rather than of the threads it cancelled
+		if (threads[t].ret && (!ret || ret == -ECANCELED)) {
+			ret = threads[t].ret;
+		}
+	}
+
+	if (!ret) {
+		client_print_results();
+		if (bench_mode != MODE_CONN) {
+			client_print_setup();
+		}
+
+		//Record memory placement used by every thread
+		for (t = 0; t < num_threads; t++) {
+			printf("Thread %d: ", t);
+			roce_print_mem_placement(&threads[t].mem);
+		}
+	}
+
+	pthread_barrier_destroy(&client_barrier);
+	for (t = 0; t < num_threads; t++) {
+		free(threads[t].conns);
+	}
+	free(threads);
+
+	return ret;
+}
+
+//roce_harness.c runs the client in its own process
+#ifndef ROCE_HARNESS
+
+//Print usage of roce_client.c
+void show_usage() {
+	printf("How to use: \n");
+	printf("roce_client: -a <server_ip> (required) [-p <server_port> (optional)] -s <message size> (required)\n");
+	printf("             [-m <single|lat|bw|sweep|pp|wpp|wimm|sge|atomic|bidir|bulk|batch|conn> (benchmark mode, default single)] \n");
+	printf("             [-n <iterations> (default 1000)] [-w <warmup iterations> (default 100)] \n");
+	printf("             [-c <event|poll|adaptive> (completion mode, default event)] [-y <adaptive spin time in usec> (default %d)] \n", DEFAULT_CQ_SPIN_US);
+	printf("             [-d <queue depth> (bw mode, default 128, max %d)] [-k <signal every k-th WR> (bw mode, default 16)] \n", MAX_WR);
+	printf("             [-r <queue depth of the server> (bidir mode, default same as -d)] \n");
+	printf("             [-b <WRs per ibv_post_send> (bw mode default 1, batch mode sweeps up to it, default %d, max %d)] \n", DEFAULT_BATCH, MAX_BATCH);
+	printf("             [-A <post|wr> (post WRs with ibv_post_send or the ibv_wr_* API on an extended QP and CQ, default post)] \n");
+	printf("             [-L <transfer size, e.g. 8g> (bulk mode, required, sent in segments of -s bytes up to the device limit)] \n");
+	printf("             [conn mode: -n connections opened and torn down per thread, -q of them in flight per thread, -s not needed, server needs -D, \n");
+	printf("              PD/CQ creation is timed once per thread and not part of the total] \n");
+	printf("             [-P <seed> (payload pattern, default 1)] [-V (single, lat, bw, sweep, sge and bulk mode, verify the CRC32C the server computes over its buffer)] \n");
+	printf("             [-t <threads> (default 1, max %d)] [-q <QPs per thread> (default 1, max %d)] [-C <core list, e.g. 0,2,4> (default 0,1,2,...)] \n", MAX_THREADS, MAX_QPS_PER_THREAD);
+	printf("             [-H <4k|2m|1g> (pages backing buffers, default 4k)] [-N (bind buffers to NUMA node of the device)] \n");
+	printf("             [-I <bytes|max> (post WRITEs and SENDs up to this size inline, default 0)] [-R <receive ring slots> (pp mode, default %d, max %d)] \n", ROCE_RECV_RING_SLOTS, MAX_WR - 1);
+	printf("             [-F <fragment sizes, e.g. 64,1024> (sge mode, the rest of the message is the last fragment, default %d)] \n", DEFAULT_SGE_HEADER);
+	printf("             [-X (atomic mode, all QPs contend for one slot on the server)] [-T <raw|tsc> (clock for timestamps, default raw)] \n");
+	printf("             [-E (lat and pp mode, split latency at completion timestamps of the device, software timestamps if unsupported)] \n");
+	printf("             [-o <text|json|csv> (measurement records with run metadata, default text)] [-O <file> (append records to file, default stdout)] \n");
 	exit(1);
 }
 
+//Parse comma separated list of cores for benchmark threads
+static int parse_cpu_list(char *list) {
+	char *token, *saveptr = NULL;
+
+	num_thread_cpus = 0;
+	for (token = strtok_r(list, ",", &saveptr); token; token = strtok_r(NULL, ",", &saveptr)) {
+		if (num_thread_cpus == MAX_THREADS) {
+			return -EINVAL;
+		}
+		thread_cpus[num_thread_cpus++] = atoi(token);
+	}
+
+	return num_thread_cpus ? 0 : -EINVAL;
+}
+
+//Parse comma separated list of fragment sizes for scatter-gather mode
+static int parse_fragment_list(char *list) {
+	char *token, *saveptr = NULL;
+
+	num_frags = 0;
+	for (token = strtok_r(list, ",", &saveptr); token; token = strtok_r(NULL, ",", &saveptr)) {
+		//Last SGE is left for the rest of the message
+		if (num_frags == MAX_SGE - 1 || atoi(token) <= 0) {
+			return -EINVAL;
+		}
+		frag_sizes[num_frags++] = atoi(token);
+	}
+
+	return num_frags ? 0 : -EINVAL;
+}
+
 //Main function
 int main(int argc, char **argv) {
-	struct sockaddr_in server_sockaddr;
-	int ret, option, msg_size;
+	enum roce_cq_mode cq_mode = ROCE_CQ_EVENT;
+	enum roce_post_api post_api = ROCE_POST_LEGACY;
+	enum roce_page_size pages = ROCE_PAGES_4K;
+	int ret, option, cq_spin_us = DEFAULT_CQ_SPIN_US, bind_numa = 0;
 	bzero(&server_sockaddr, sizeof server_sockaddr);
 	server_sockaddr.sin_family = AF_INET;
 	server_sockaddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
 
-	//Set buffers to NULL
-	send_buf = recv_buf = NULL; 
-
 	//Parse command line arguments
-	while ((option = getopt(argc, argv, "s:a:p:")) != -1) {
+	while ((option = getopt(argc, argv, "s:a:p:m:n:w:d:k:c:y:t:q:C:H:NI:R:F:XT:Eo:O:r:L:P:Vb:A:")) != -1) {
 		switch (option) {
 			case 's':
-				//Parse message size from command line and initialise buffers accordingly
+				//Parse message size from command line, buffers are allocated per connection
 				msg_size = atoi(optarg);
 				printf("Payload size: %d bytes \n", msg_size);
-				send_buf = calloc(msg_size, sizeof(char));
-
-				if (!send_buf) {
-					printf("Could not allocate memory \n");
-					return -ENOMEM;
-				}
-
-				for (int i = 0; i < msg_size; i++) {
-					send_buf[i] = 'A';
-				}
-
-				recv_buf = calloc(msg_size, sizeof(char));
-				if (!recv_buf) {
-					printf("Could not allocate memory \n");
-					free(send_buf);
-					return -ENOMEM;
-				}
-
 				break;
 			case 'a':
 				//Set destination IP address
@@ -486,7 +3305,193 @@ int main(int argc, char **argv) {
 				break;
 			case 'p':
 				//Override default port
-				server_sockaddr.sin_port = htons(strtol(optarg, NULL, 0)); 
+				server_sockaddr.sin_port = htons(strtol(optarg, NULL, 0));
+				break;
+			case 'm':
+				//Select benchmark mode
+				if (!strcmp(optarg, "single")) {
+					bench_mode = MODE_SINGLE;
+				} else if (!strcmp(optarg, "lat")) {
+					bench_mode = MODE_LATENCY;
+				} else if (!strcmp(optarg, "bw")) {
+					bench_mode = MODE_BANDWIDTH;
+				} else if (!strcmp(optarg, "sweep")) {
+					bench_mode = MODE_SWEEP;
+				} else if (!strcmp(optarg, "pp")) {
+					bench_mode = MODE_PINGPONG;
+				} else if (!strcmp(optarg, "wpp")) {
+					bench_mode = MODE_WRITE_POLL;
+				} else if (!strcmp(optarg, "wimm")) {
+					bench_mode = MODE_WRITE_IMM;
+				} else if (!strcmp(optarg, "sge")) {
+					bench_mode = MODE_SGE;
+				} else if (!strcmp(optarg, "atomic")) {
+					bench_mode = MODE_ATOMIC;
+				} else if (!strcmp(optarg, "bidir")) {
+					bench_mode = MODE_BIDIR;
+				} else if (!strcmp(optarg, "bulk")) {
+					bench_mode = MODE_BULK;
+				} else if (!strcmp(optarg, "batch")) {
+					bench_mode = MODE_BATCH;
+				} else if (!strcmp(optarg, "conn")) {
+					bench_mode = MODE_CONN;
+				} else {
+					show_usage();
+				}
+				break;
+			case 'n':
+				//Number of measured iterations
+				iterations = atoi(optarg);
+				if (iterations < 1) {
+					show_usage();
+				}
+				break;
+			case 'w':
+				//Number of warmup iterations
+				warmup = atoi(optarg);
+				if (warmup < 0) {
+					show_usage();
+				}
+				break;
+			case 'd':
+				//Number of outstanding WRs in bandwidth mode
+				queue_depth = atoi(optarg);
+				if (queue_depth < 1 || queue_depth > MAX_WR) {
+					show_usage();
+				}
+				break;
+			case 'P':
+				//Seed of the payload pattern
+				pattern_seed = strtoull(optarg, NULL, 0);
+				break;
+			case 'V':
+				//Verify with the checksum of the server instead of comparing read back data
+				verify_checksum = 1;
+				break;
+			case 'L':
+				//Size of the transfer in bulk mode, may exceed 4 GiB
+				if (roce_parse_size(optarg, &transfer_size)) {
+					show_usage();
+				}
+				break;
+			case 'b':
+				//Number of WRs chained into one ibv_post_send
+				post_batch = atoi(optarg);
+				if (post_batch < 1 || post_batch > MAX_BATCH) {
+					show_usage();
+				}
+				break;
+			case 'A':
+				//Select API for posting WRs and polling completions
+				if (roce_parse_post_api(optarg, &post_api)) {
+					show_usage();
+				}
+				break;
+			case 'r':
+				//Number of outstanding WRITEs of the server in bidirectional mode
+				reverse_depth = atoi(optarg);
+				if (reverse_depth < 1 || reverse_depth > MAX_WR) {
+					show_usage();
+				}
+				break;
+			case 'k':
+				//Signal interval in bandwidth mode
+				signal_interval = atoi(optarg);
+				if (signal_interval < 1) {
+					show_usage();
+				}
+				break;
+			case 'c':
+				//Select completion mode
+				if (roce_parse_cq_mode(optarg, &cq_mode)) {
+					show_usage();
+				}
+				break;
+			case 'y':
+				//Spin time before blocking in adaptive completion mode
+				cq_spin_us = atoi(optarg);
+				if (cq_spin_us < 0) {
+					show_usage();
+				}
+				break;
+			case 't':
+				//Number of benchmark threads
+				num_threads = atoi(optarg);
+				if (num_threads < 1 || num_threads > MAX_THREADS) {
+					show_usage();
+				}
+				break;
+			case 'q':
+				//Number of QPs per benchmark thread
+				qps_per_thread = atoi(optarg);
+				if (qps_per_thread < 1 || qps_per_thread > MAX_QPS_PER_THREAD) {
+					show_usage();
+				}
+				break;
+			case 'C':
+				//Cores to pin benchmark threads to
+				if (parse_cpu_list(optarg)) {
+					show_usage();
+				}
+				break;
+			case 'H':
+				//Pages backing registered buffers
+				if (roce_parse_page_size(optarg, &pages)) {
+					show_usage();
+				}
+				break;
+			case 'N':
+				//Place buffers on the NUMA node of the device
+				bind_numa = 1;
+				break;
+			case 'I':
+				//Requested inline size
+				if (roce_parse_inline_size(optarg, &inline_size)) {
+					show_usage();
+				}
+				break;
+			case 'R':
+				//Receive buffers pre-posted on both sides in ping-pong mode
+				ring_slots = atoi(optarg);
+				if (ring_slots < 1 || ring_slots > MAX_WR - 1) {
+					show_usage();
+				}
+				break;
+			case 'F':
+				//Fragment sizes in scatter-gather mode
+				if (parse_fragment_list(optarg)) {
+					show_usage();
+				}
+				break;
+			case 'X':
+				//Let all QPs contend for one atomic slot
+				atomic_contention = 1;
+				break;
+			case 'E':
+				//Timestamp completions on the device
+				cq_timestamps = 1;
+				break;
+			case 'o':
+				//Format of measurement records
+				if (!strcmp(optarg, "text")) {
+					output_format = OUTPUT_TEXT;
+				} else if (!strcmp(optarg, "json")) {
+					output_format = OUTPUT_JSON;
+				} else if (!strcmp(optarg, "csv")) {
+					output_format = OUTPUT_CSV;
+				} else {
+					show_usage();
+				}
+				break;
+			case 'O':
+				//File the measurement records are appended to
+				output_path = optarg;
+				break;
+			case 'T':
+				//Clock for timestamps
+				if (roce_parse_clock(optarg, &timestamp_clock)) {
+					show_usage();
+				}
 				break;
 			default:
 				show_usage();
@@ -499,55 +3504,42 @@ int main(int argc, char **argv) {
 	  server_sockaddr.sin_port = htons(DEFAULT_RDMA_PORT);
 	}
 
-	//Check if message size is specified
-	if (send_buf == NULL) {
+	//Check if message size is specified, connection rate mode transfers no data
+	if (msg_size <= 0 && bench_mode != MODE_CONN) {
 		printf("Please provide a message");
 		show_usage();
     }
-
-	//Call all client-side functions 
-	ret = client_prepare_connection(&server_sockaddr);
-	if (ret) { 
-		printf("Could not start client connection \n");
-		return ret;
-	}
-
-	ret = client_pre_post_recv_buffer(); 
-	if (ret) { 
-		printf("Could not set up client connection \n");
-		return ret;
-	}
-
-	ret = client_connect_to_server();
-	if (ret) { 
-		printf("Could not connect to server \n");
-		return ret;
+	if (client_check_config()) {
+		show_usage();
 	}
 
-	ret = exchange_metadata();
-	if (ret) {
-		printf("Failed to setup client connection , ret = %d \n", ret);
-		return ret;
+	roce_set_cq_mode(cq_mode, cq_spin_us);
+	roce_set_post_api(post_api);
+	roce_set_mem_placement(pages, bind_numa);
+
+	//Records are appended so that several runs can be collected in one file
+	output_file = stdout;
+	if (output_format != OUTPUT_TEXT && output_path) {
+		output_file = fopen(output_path, "a");
+		if (!output_file) {
+			printf("Could not open output file %s \n", output_path);
+			return -errno;
+		}
 	}
 
-	ret = perform_write_read();
-	if (ret) {
-		printf("Could not perform WRITE/READ operations \n");
-		return ret;
-	}
+	//TSC is calibrated before any thread takes a timestamp
+	roce_set_clock(timestamp_clock);
+	roce_print_clock();
 
-	if (check_send_buf_recv_buf()) {
-		printf("Functional test failed \n");
-	} else {
-		printf("Functional test was successful \n");
-	}
+	ret = client_run();
 
-	ret = client_disconnect_and_clean();
-	if (ret) {
-		printf("Could not disconnect/clean up \n");
+	if (output_file != stdout) {
+		fclose(output_file);
 	}
 
 	printf("--------------------\n");
 
 	return ret;
 }
+
+#endif
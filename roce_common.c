@@ -1,10 +1,14 @@
 // Code acknowledgement: Based on works by Animesh Trivedi (https://github.com/animeshtrivedi/rdma-example)
 // Code extended and adapted for the use with RoCE
 
+//Included by both roles of roce_harness.c
+#ifndef ROCE_COMMON_C
+#define ROCE_COMMON_C
+
 #include "roce_common.h"
 
 //Allocate buffer of given size
-struct ibv_mr* roce_alloc_buffer(struct ibv_pd *pd, uint32_t size, enum ibv_access_flags permission) {
+struct ibv_mr* roce_alloc_buffer(struct ibv_pd *pd, uint64_t size, enum ibv_access_flags permission) {
 	struct ibv_mr *mr = NULL;
 	if (!pd) {
 		printf("Protection domain NULL \n");
@@ -26,7 +30,7 @@ struct ibv_mr* roce_alloc_buffer(struct ibv_pd *pd, uint32_t size, enum ibv_acce
 }
 
 //Register allocated memory
-struct ibv_mr *roce_register_buffer(struct ibv_pd *pd, void *addr, uint32_t length, enum ibv_access_flags permission) {
+struct ibv_mr *roce_register_buffer(struct ibv_pd *pd, void *addr, uint64_t length, enum ibv_access_flags permission) {
 	struct ibv_mr *mr = NULL;
 	if (!pd) {
 		printf("Protection domain NULL \n");
@@ -63,6 +67,751 @@ void roce_deregister_buffer(struct ibv_mr *mr) {
 	ibv_dereg_mr(mr);
 }
 
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT (26)
+#endif
+
+#ifndef MPOL_BIND
+#define MPOL_BIND (2)
+#endif
+
+//Posting API shared by all QPs and CQs the process creates after selecting it
+static enum roce_post_api roce_post_api = ROCE_POST_LEGACY;
+
+//Select API used by roce_create_qp, roce_create_cq and roce_post_send
+void roce_set_post_api(enum roce_post_api api) {
+	roce_post_api = api;
+}
+
+//Get selected posting API
+enum roce_post_api roce_get_post_api() {
+	return roce_post_api;
+}
+
+//Parse posting API name
+int roce_parse_post_api(const char *name, enum roce_post_api *api) {
+	if (!strcmp(name, "post")) {
+		*api = ROCE_POST_LEGACY;
+	} else if (!strcmp(name, "wr")) {
+		*api = ROCE_POST_WR;
+	} else {
+		return -EINVAL;
+	}
+	return 0;
+}
+
+//Get name of posting API
+const char *roce_post_api_str(enum roce_post_api api) {
+	return api == ROCE_POST_WR ? "wr" : "post";
+}
+
+//Create extended QP that accepts the ibv_wr_* calls of every opcode the benchmarks post
+static int roce_create_qp_ex(struct rdma_cm_id *id, struct ibv_pd *pd, struct ibv_qp_init_attr *attr) {
+	struct ibv_qp_init_attr_ex attr_ex;
+	struct ibv_device_attr dev_attr;
+	int ret = -1;
+
+	bzero(&attr_ex, sizeof(attr_ex));
+	attr_ex.qp_context = attr->qp_context;
+	attr_ex.send_cq = attr->send_cq;
+	attr_ex.recv_cq = attr->recv_cq;
+	attr_ex.srq = attr->srq;
+	attr_ex.cap = attr->cap;
+	attr_ex.qp_type = attr->qp_type;
+	attr_ex.sq_sig_all = attr->sq_sig_all;
+	attr_ex.comp_mask = IBV_QP_INIT_ATTR_PD | IBV_QP_INIT_ATTR_SEND_OPS_FLAGS;
+	attr_ex.pd = pd;
+	attr_ex.send_ops_flags = IBV_QP_EX_WITH_RDMA_WRITE | IBV_QP_EX_WITH_RDMA_WRITE_WITH_IMM | IBV_QP_EX_WITH_RDMA_READ | IBV_QP_EX_WITH_SEND;
+
+	//Providers refuse send ops the device cannot execute, so atomics are only requested where supported
+	if (!ibv_query_device(id->verbs, &dev_attr) && dev_attr.atomic_cap != IBV_ATOMIC_NONE) {
+		attr_ex.send_ops_flags |= IBV_QP_EX_WITH_ATOMIC_CMP_AND_SWP | IBV_QP_EX_WITH_ATOMIC_FETCH_AND_ADD;
+	}
+
+	ret = rdma_create_qp_ex(id, &attr_ex);
+	if (!ret) {
+		attr->cap = attr_ex.cap;
+	}
+	return ret;
+}
+
+//Create QP with the largest inline size up to max_inline the device accepts, the size obtained is returned in attr
+int roce_create_qp(struct rdma_cm_id *id, struct ibv_pd *pd, struct ibv_qp_init_attr *attr, uint32_t max_inline) {
+	int ret = -1;
+
+	//Devices reject inline sizes they cannot provide, so halve the request until the QP can be created
+	for (;;) {
+		attr->cap.max_inline_data = max_inline;
+		if (roce_post_api == ROCE_POST_WR) {
+			ret = roce_create_qp_ex(id, pd, attr);
+		} else {
+			ret = rdma_create_qp(id, pd, attr);
+		}
+		if (!ret || !max_inline) {
+			break;
+		}
+		max_inline /= 2;
+	}
+
+	return ret ? -errno : 0;
+}
+
+//Post WR list through the ibv_wr_* API, all WRs are written as one batch and rung with one doorbell
+static int roce_post_send_ex(struct ibv_qp *qp, struct ibv_send_wr *wr, struct ibv_send_wr **bad_wr) {
+	struct ibv_qp_ex *qpx = ibv_qp_to_qp_ex(qp);
+	struct ibv_data_buf inline_bufs[MAX_SGE];
+	struct ibv_send_wr *first = wr;
+	int ret = -1, i;
+
+	ibv_wr_start(qpx);
+	for (; wr; wr = wr->next) {
+		qpx->wr_id = wr->wr_id;
+		qpx->wr_flags = wr->send_flags;
+
+		switch (wr->opcode) {
+			case IBV_WR_RDMA_WRITE:
+				ibv_wr_rdma_write(qpx, wr->wr.rdma.rkey, wr->wr.rdma.remote_addr);
+				break;
+			case IBV_WR_RDMA_WRITE_WITH_IMM:
+				ibv_wr_rdma_write_imm(qpx, wr->wr.rdma.rkey, wr->wr.rdma.remote_addr, wr->imm_data);
+				break;
+			case IBV_WR_RDMA_READ:
+				ibv_wr_rdma_read(qpx, wr->wr.rdma.rkey, wr->wr.rdma.remote_addr);
+				break;
+			case IBV_WR_SEND:
+				ibv_wr_send(qpx);
+				break;
+			case IBV_WR_ATOMIC_FETCH_AND_ADD:
+				ibv_wr_atomic_fetch_add(qpx, wr->wr.atomic.rkey, wr->wr.atomic.remote_addr, wr->wr.atomic.compare_add);
+				break;
+			case IBV_WR_ATOMIC_CMP_AND_SWP:
+				ibv_wr_atomic_cmp_swp(qpx, wr->wr.atomic.rkey, wr->wr.atomic.remote_addr, wr->wr.atomic.compare_add, wr->wr.atomic.swap);
+				break;
+			default:
+				printf("Opcode %d not supported by the ibv_wr_* API \n", wr->opcode);
+				ibv_wr_abort(qpx);
+				*bad_wr = wr;
+				return EINVAL;
+		}
+
+		//Inline payload is copied into the WQE now, otherwise the NIC gathers it from the SGEs
+		if ((wr->send_flags & IBV_SEND_INLINE) && wr->num_sge <= MAX_SGE) {
+			for (i = 0; i < wr->num_sge; i++) {
+				inline_bufs[i].addr = (void *) (uintptr_t) wr->sg_list[i].addr;
+				inline_bufs[i].length = wr->sg_list[i].length;
+			}
+			ibv_wr_set_inline_data_list(qpx, wr->num_sge, inline_bufs);
+		} else if (wr->num_sge == 1) {
+			ibv_wr_set_sge(qpx, wr->sg_list[0].lkey, wr->sg_list[0].addr, wr->sg_list[0].length);
+		} else {
+			ibv_wr_set_sge_list(qpx, wr->num_sge, wr->sg_list);
+		}
+	}
+
+	ret = ibv_wr_complete(qpx);
+	if (ret) {
+		*bad_wr = first;
+	}
+	return ret;
+}
+
+//Post WR list with the selected API
+int roce_post_send(struct ibv_qp *qp, struct ibv_send_wr *wr, struct ibv_send_wr **bad_wr) {
+	if (roce_post_api == ROCE_POST_WR) {
+		return roce_post_send_ex(qp, wr, bad_wr);
+	}
+	return ibv_post_send(qp, wr, bad_wr);
+}
+
+//Parse inline size, "max" probes for the largest size supported
+int roce_parse_inline_size(const char *arg, uint32_t *max_inline) {
+	int size;
+
+	if (!strcmp(arg, "max")) {
+		*max_inline = ROCE_MAX_INLINE_PROBE;
+		return 0;
+	}
+
+	size = atoi(arg);
+	if (size < 0) {
+		return -EINVAL;
+	}
+	*max_inline = size;
+	return 0;
+}
+
+//Parse size in bytes with optional k, m or g suffix (powers of 1024)
+int roce_parse_size(const char *arg, uint64_t *size) {
+	unsigned long long value;
+	char *end = NULL;
+
+	errno = 0;
+	value = strtoull(arg, &end, 10);
+	if (errno || end == arg || arg[0] == '-') {
+		return -EINVAL;
+	}
+
+	switch (*end) {
+		case 'g':
+		case 'G':
+			value <<= 10;
+			//fall through
+		case 'm':
+		case 'M':
+			value <<= 10;
+			//fall through
+		case 'k':
+		case 'K':
+			value <<= 10;
+			end++;
+			break;
+		default:
+			break;
+	}
+	if (*end || !value) {
+		return -EINVAL;
+	}
+
+	*size = value;
+	return 0;
+}
+
+//Get largest message and largest memory region the device of a connected CM ID supports
+int roce_query_transfer_limits(struct rdma_cm_id *id, uint64_t *max_msg_size, uint64_t *max_mr_size) {
+	struct ibv_port_attr port_attr;
+	struct ibv_device_attr device_attr;
+
+	if (ibv_query_port(id->verbs, id->port_num, &port_attr)) {
+		printf("Could not query port \n");
+		return -errno;
+	}
+	if (ibv_query_device(id->verbs, &device_attr)) {
+		printf("Could not query device \n");
+		return -errno;
+	}
+
+	*max_msg_size = port_attr.max_msg_sz;
+	*max_mr_size = device_attr.max_mr_size;
+	return 0;
+}
+
+//Placement used by new allocators
+static enum roce_page_size roce_mem_pages = ROCE_PAGES_4K;
+static int roce_mem_bind_numa = 0;
+
+//Select pages and NUMA binding of memory registered by allocators set up afterwards
+void roce_set_mem_placement(enum roce_page_size pages, int bind_numa) {
+	roce_mem_pages = pages;
+	roce_mem_bind_numa = bind_numa;
+}
+
+//Parse page size name (4k, 2m or 1g)
+int roce_parse_page_size(const char *name, enum roce_page_size *pages) {
+	if (!strcasecmp(name, "4k")) {
+		*pages = ROCE_PAGES_4K;
+	} else if (!strcasecmp(name, "2m")) {
+		*pages = ROCE_PAGES_2M;
+	} else if (!strcasecmp(name, "1g")) {
+		*pages = ROCE_PAGES_1G;
+	} else {
+		return -EINVAL;
+	}
+	return 0;
+}
+
+//Get name of page size
+const char *roce_page_size_str(enum roce_page_size pages) {
+	switch (pages) {
+		case ROCE_PAGES_2M:
+			return "2 MiB";
+		case ROCE_PAGES_1G:
+			return "1 GiB";
+		default:
+			return "4 KiB";
+	}
+}
+
+//Size of a page in bytes
+static uint64_t roce_page_bytes(enum roce_page_size pages) {
+	switch (pages) {
+		case ROCE_PAGES_2M:
+			return 1ULL << 21;
+		case ROCE_PAGES_1G:
+			return 1ULL << 30;
+		default:
+			return 1ULL << 12;
+	}
+}
+
+//Get NUMA node of RDMA device from sysfs, -1 if unknown
+int roce_get_device_numa_node(struct ibv_context *verbs) {
+	char path[256];
+	FILE *file;
+	int node = -1;
+
+	snprintf(path, sizeof(path), "/sys/class/infiniband/%s/device/numa_node", ibv_get_device_name(verbs->device));
+	file = fopen(path, "r");
+	if (!file) {
+		return -1;
+	}
+	if (fscanf(file, "%d", &node) != 1) {
+		node = -1;
+	}
+	fclose(file);
+
+	return node;
+}
+
+//Report placement and amount of memory registered by an allocator
+void roce_print_mem_placement(const struct roce_mem_pool *pool) {
+	char node[32] = "any NUMA node";
+
+	if (pool->numa_node >= 0) {
+		snprintf(node, sizeof(node), "NUMA node %d", pool->numa_node);
+	}
+
+	printf("Memory placement: %s pages on %s, %lu KiB registered in %lu regions", roce_page_size_str(pool->pages),
+			node, pool->registered_bytes / 1024, pool->registrations);
+	if (pool->page_fallbacks) {
+		printf(" (%lu regions fell back to 4 KiB pages)", pool->page_fallbacks);
+	}
+	printf(" \n");
+}
+
+//Set up allocator for registered memory of a PD
+void roce_mem_pool_init(struct roce_mem_pool *pool, struct ibv_pd *pd, int access) {
+	bzero(pool, sizeof(*pool));
+	pool->pd = pd;
+	pool->access = access;
+	pool->pages = roce_mem_pages;
+	pool->numa_node = -1;
+
+	//Buffers are placed on the node the device is attached to
+	if (roce_mem_bind_numa && pd) {
+		pool->numa_node = roce_get_device_numa_node(pd->context);
+		if (pool->numa_node < 0 || pool->numa_node >= 64) {
+			printf("NUMA node of device unknown, memory is not bound \n");
+			pool->numa_node = -1;
+		}
+	}
+}
+
+//Deregister and unmap all regions of the allocator, statistics are kept
+void roce_mem_pool_destroy(struct roce_mem_pool *pool) {
+	struct roce_mem_region *region;
+	struct roce_mem_chunk *chunk;
+	void *addr;
+	size_t length;
+	uint32_t i;
+
+	//MRs of exposed buffers go before the regions they lie in
+	while ((chunk = pool->chunks)) {
+		pool->chunks = chunk->next;
+		if (chunk->mr) {
+			roce_deregister_buffer(chunk->mr);
+		}
+		if (chunk->obj_mrs) {
+			for (i = 0; i < (ROCE_MEM_CHUNK_SIZE >> (chunk->size_class + ROCE_MEM_MIN_SHIFT)); i++) {
+				if (chunk->obj_mrs[i]) {
+					roce_deregister_buffer(chunk->obj_mrs[i]);
+				}
+			}
+			free(chunk->obj_mrs);
+		}
+		free(chunk->free_objs);
+		free(chunk);
+	}
+
+	while ((region = pool->regions)) {
+		pool->regions = region->next;
+		addr = region->mr->addr;
+		length = region->mr->length;
+		roce_deregister_buffer(region->mr);
+		munmap(addr, length);
+		free(region);
+	}
+
+	bzero(pool->free_chunks, sizeof(pool->free_chunks));
+}
+
+//Map and register a new region of at least length bytes
+static struct roce_mem_region *roce_mem_add_region(struct roce_mem_pool *pool, uint64_t length) {
+	struct roce_mem_region *region;
+	uint64_t page = roce_page_bytes(pool->pages);
+	unsigned long nodemask;
+	int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+	void *buf = MAP_FAILED;
+
+	region = calloc(1, sizeof(*region));
+	if (!region) {
+		printf("Could not allocate memory \n");
+		return NULL;
+	}
+
+	if (length < ROCE_MEM_CHUNK_SIZE) {
+		length = ROCE_MEM_CHUNK_SIZE;
+	}
+
+	//Hugepages need a reserved pool, fall back to normal pages if it is exhausted
+	if (pool->pages != ROCE_PAGES_4K) {
+		length = (length + page - 1) & ~(page - 1);
+		buf = mmap(NULL, length, PROT_READ | PROT_WRITE, flags | MAP_HUGETLB | ((pool->pages == ROCE_PAGES_1G ? 30 : 21) << MAP_HUGE_SHIFT), -1, 0);
+		if (buf == MAP_FAILED) {
+			if (!pool->page_fallbacks) {
+				printf("Could not map %s pages, using 4 KiB pages \n", roce_page_size_str(pool->pages));
+			}
+			pool->page_fallbacks++;
+		}
+	}
+	if (buf == MAP_FAILED) {
+		buf = mmap(NULL, length, PROT_READ | PROT_WRITE, flags, -1, 0);
+		if (buf == MAP_FAILED) {
+			printf("Could not allocate buffer \n");
+			free(region);
+			return NULL;
+		}
+	}
+
+	//Bind pages before registration faults them in
+	if (pool->numa_node >= 0) {
+		nodemask = 1UL << pool->numa_node;
+		if (syscall(SYS_mbind, buf, length, MPOL_BIND, &nodemask, sizeof(nodemask) * 8, 0)) {
+			printf("Could not bind memory to NUMA node %d \n", pool->numa_node);
+		}
+	}
+
+	region->mr = roce_register_buffer(pool->pd, buf, length, pool->access);
+	if (!region->mr) {
+		munmap(buf, length);
+		free(region);
+		return NULL;
+	}
+
+	region->next = pool->regions;
+	pool->regions = region;
+	pool->registered_bytes += length;
+	pool->registrations++;
+
+	return region;
+}
+
+//Cut a chunk of given length from a region, new regions are only registered if no region has room left
+static struct roce_mem_chunk *roce_mem_add_chunk(struct roce_mem_pool *pool, uint64_t length, int size_class) {
+	struct roce_mem_region *region;
+	struct roce_mem_chunk *chunk;
+
+	chunk = calloc(1, sizeof(*chunk));
+	if (!chunk) {
+		printf("Could not allocate memory \n");
+		return NULL;
+	}
+
+	//Chunks stay page aligned so that they never share pages with each other
+	length = (length + 4095) & ~4095ULL;
+
+	for (region = pool->regions; region; region = region->next) {
+		if (region->mr->length - region->used >= length) {
+			break;
+		}
+	}
+	if (!region) {
+		region = roce_mem_add_region(pool, length);
+		if (!region) {
+			free(chunk);
+			return NULL;
+		}
+	}
+
+	chunk->region = region;
+	chunk->addr = (char *) region->mr->addr + region->used;
+	chunk->length = length;
+	chunk->size_class = size_class;
+	region->used += length;
+
+	chunk->next = pool->chunks;
+	pool->chunks = chunk;
+
+	return chunk;
+}
+
+//Carve a new chunk into objects of a size class
+static int roce_mem_grow(struct roce_mem_pool *pool, int size_class) {
+	uint32_t num_objs = ROCE_MEM_CHUNK_SIZE >> (size_class + ROCE_MEM_MIN_SHIFT);
+	struct roce_mem_chunk *chunk;
+	uint32_t i;
+
+	chunk = roce_mem_add_chunk(pool, ROCE_MEM_CHUNK_SIZE, size_class);
+	if (!chunk) {
+		return -ENOMEM;
+	}
+
+	//Index stack lives in ordinary memory, objects are handed out from the start of the chunk
+	chunk->free_objs = malloc(num_objs * sizeof(*chunk->free_objs));
+	if (!chunk->free_objs) {
+		printf("Could not allocate memory \n");
+		return -ENOMEM;
+	}
+	for (i = 0; i < num_objs; i++) {
+		chunk->free_objs[i] = num_objs - 1 - i;
+	}
+	chunk->num_free = num_objs;
+
+	chunk->next_free = pool->free_chunks[size_class];
+	pool->free_chunks[size_class] = chunk;
+
+	return 0;
+}
+
+//Hand out registered buffer of at least length bytes, contents are undefined
+int roce_mem_alloc(struct roce_mem_pool *pool, uint64_t length, struct roce_mem *mem) {
+	struct roce_mem_chunk *chunk, *best = NULL;
+	int size_class = 0, ret = -1;
+	uint32_t obj;
+
+	if (!pool->pd) {
+		printf("Protection domain NULL \n");
+		return -EINVAL;
+	}
+
+	bzero(mem, sizeof(*mem));
+
+	//Large buffers reuse the smallest idle large chunk that fits
+	if (length > (1U << ROCE_MEM_MAX_SHIFT)) {
+		for (chunk = pool->chunks; chunk; chunk = chunk->next) {
+			if (chunk->size_class < 0 && !chunk->in_use && chunk->length >= length &&
+					(!best || chunk->length < best->length)) {
+				best = chunk;
+			}
+		}
+		if (!best) {
+			best = roce_mem_add_chunk(pool, length, -1);
+			if (!best) {
+				return -ENOMEM;
+			}
+		}
+
+		best->in_use = 1;
+		mem->addr = best->addr;
+		mem->chunk = best;
+	} else {
+		while ((1U << (size_class + ROCE_MEM_MIN_SHIFT)) < length) {
+			size_class++;
+		}
+
+		if (!pool->free_chunks[size_class]) {
+			ret = roce_mem_grow(pool, size_class);
+			if (ret) {
+				return ret;
+			}
+		}
+
+		chunk = pool->free_chunks[size_class];
+		obj = chunk->free_objs[--chunk->num_free];
+		if (!chunk->num_free) {
+			pool->free_chunks[size_class] = chunk->next_free;
+		}
+		chunk->in_use++;
+		mem->addr = chunk->addr + ((uint64_t) obj << (size_class + ROCE_MEM_MIN_SHIFT));
+		mem->chunk = chunk;
+	}
+
+	pool->allocated_bytes += (mem->chunk->size_class < 0) ? mem->chunk->length : 1U << (mem->chunk->size_class + ROCE_MEM_MIN_SHIFT);
+	mem->length = length;
+	mem->lkey = mem->chunk->region->mr->lkey;
+	mem->rkey = mem->chunk->region->mr->rkey;
+
+	return 0;
+}
+
+//Return buffer to the allocator, its memory stays registered
+void roce_mem_free(struct roce_mem_pool *pool, struct roce_mem *mem) {
+	struct roce_mem_chunk *chunk = mem->chunk;
+
+	if (!chunk) {
+		return;
+	}
+
+	pool->allocated_bytes -= (chunk->size_class < 0) ? chunk->length : 1U << (chunk->size_class + ROCE_MEM_MIN_SHIFT);
+	if (chunk->size_class < 0) {
+		chunk->in_use = 0;
+	} else {
+		if (!chunk->num_free) {
+			chunk->next_free = pool->free_chunks[chunk->size_class];
+			pool->free_chunks[chunk->size_class] = chunk;
+		}
+		chunk->free_objs[chunk->num_free++] = ((char *) mem->addr - chunk->addr) >> (chunk->size_class + ROCE_MEM_MIN_SHIFT);
+		chunk->in_use--;
+	}
+
+	bzero(mem, sizeof(*mem));
+}
+
+//Give buffer an MR of its own for remote access, so its rkey reaches no other buffer of the allocator
+int roce_mem_expose(struct roce_mem_pool *pool, struct roce_mem *mem, int access) {
+	struct roce_mem_chunk *chunk = mem->chunk;
+	struct ibv_mr **mr;
+	uint64_t obj_size;
+	uint32_t obj;
+
+	//Empty buffers are never accessed remotely
+	if (!mem->length) {
+		return 0;
+	}
+
+	//Large chunks hold one buffer, slab objects get an MR over their whole slot
+	if (chunk->size_class < 0) {
+		mr = &chunk->mr;
+		obj_size = chunk->length;
+	} else {
+		obj_size = 1ULL << (chunk->size_class + ROCE_MEM_MIN_SHIFT);
+		if (!chunk->obj_mrs) {
+			chunk->obj_mrs = calloc(ROCE_MEM_CHUNK_SIZE / obj_size, sizeof(*chunk->obj_mrs));
+			if (!chunk->obj_mrs) {
+				printf("Could not allocate memory \n");
+				return -ENOMEM;
+			}
+		}
+		obj = ((char *) mem->addr - chunk->addr) / obj_size;
+		mr = &chunk->obj_mrs[obj];
+	}
+
+	//Registration is only paid the first time a slot is exposed, the MR lives as long as the allocator
+	if (!*mr) {
+		*mr = roce_register_buffer(pool->pd, mem->addr, obj_size, access);
+		if (!*mr) {
+			return -errno;
+		}
+		pool->registrations++;
+	}
+	mem->lkey = (*mr)->lkey;
+	mem->rkey = (*mr)->rkey;
+
+	return 0;
+}
+
+//Batch size of a ring with given slots
+static uint32_t roce_recv_ring_batch(uint32_t slots) {
+	return slots < ROCE_RECV_BATCH ? slots : ROCE_RECV_BATCH;
+}
+
+//Number of receives a ring with given slots always has posted
+uint32_t roce_recv_ring_capacity(uint32_t slots) {
+	return slots - roce_recv_ring_batch(slots) + 1;
+}
+
+//Post given slots as one chained list
+static int roce_recv_ring_post(struct roce_recv_ring *ring, uint32_t *slots, uint32_t count) {
+	struct ibv_recv_wr *bad_wr = NULL;
+	uint32_t i;
+	int ret = -1;
+
+	if (!count) {
+		return 0;
+	}
+
+	for (i = 0; i < count; i++) {
+		ring->wrs[slots[i]].next = (i + 1 < count) ? &ring->wrs[slots[i + 1]] : NULL;
+	}
+
+	if (ring->srq) {
+		ret = ibv_post_srq_recv(ring->srq, &ring->wrs[slots[0]], &bad_wr);
+	} else {
+		ret = ibv_post_recv(ring->qp, &ring->wrs[slots[0]], &bad_wr);
+	}
+	if (ret) {
+		printf("Could not post receive buffers \n");
+		return -ret;
+	}
+
+	return 0;
+}
+
+//Allocate ring buffers and post all of them to the QP or, if given, the SRQ
+int roce_recv_ring_init(struct roce_recv_ring *ring, struct roce_mem_pool *pool, struct ibv_qp *qp, struct ibv_srq *srq,
+		uint32_t slots, uint32_t slot_size, uint64_t wr_id_base) {
+	uint32_t slot;
+	int ret = -1;
+
+	bzero(ring, sizeof(*ring));
+
+	//Slots are cache line aligned
+	slot_size = (slot_size + 63) & ~63U;
+	if (!slots || (uint64_t) slots * slot_size > UINT32_MAX) {
+		printf("Receive ring too large \n");
+		return -EINVAL;
+	}
+
+	ring->qp = qp;
+	ring->srq = srq;
+	ring->slots = slots;
+	ring->slot_size = slot_size;
+	ring->batch = roce_recv_ring_batch(slots);
+	ring->wr_id_base = wr_id_base;
+
+	ring->wrs = calloc(slots, sizeof(*ring->wrs));
+	ring->sges = calloc(slots, sizeof(*ring->sges));
+	ring->released = calloc(slots, sizeof(*ring->released));
+	if (!ring->wrs || !ring->sges || !ring->released) {
+		printf("Could not allocate memory \n");
+		return -ENOMEM;
+	}
+
+	ret = roce_mem_alloc(pool, slots * slot_size, &ring->mem);
+	if (ret) {
+		printf("Could not allocate receive ring \n");
+		return ret;
+	}
+
+	for (slot = 0; slot < slots; slot++) {
+		ring->sges[slot].addr = (uint64_t) roce_recv_ring_slot(ring, slot);
+		ring->sges[slot].length = slot_size;
+		ring->sges[slot].lkey = ring->mem.lkey;
+
+		ring->wrs[slot].wr_id = wr_id_base + slot;
+		ring->wrs[slot].sg_list = &ring->sges[slot];
+		ring->wrs[slot].num_sge = 1;
+
+		ring->released[slot] = slot;
+	}
+
+	ring->num_released = slots;
+	return roce_recv_ring_flush(ring);
+}
+
+//Get buffer of a ring slot
+void *roce_recv_ring_slot(struct roce_recv_ring *ring, uint32_t slot) {
+	return (char *) ring->mem.addr + (uint64_t) slot * ring->slot_size;
+}
+
+//Release a consumed slot, released slots are reposted once a batch is complete
+int roce_recv_ring_release(struct roce_recv_ring *ring, uint32_t slot) {
+	ring->released[ring->num_released++] = slot;
+	if (ring->num_released >= ring->batch) {
+		return roce_recv_ring_flush(ring);
+	}
+
+	return 0;
+}
+
+//Repost all released slots right away
+int roce_recv_ring_flush(struct roce_recv_ring *ring) {
+	int ret = -1;
+
+	ret = roce_recv_ring_post(ring, ring->released, ring->num_released);
+	ring->num_released = 0;
+
+	return ret;
+}
+
+//Free ring buffers, the QP must be destroyed already
+void roce_recv_ring_destroy(struct roce_recv_ring *ring, struct roce_mem_pool *pool) {
+	roce_mem_free(pool, &ring->mem);
+	free(ring->wrs);
+	free(ring->sges);
+	free(ring->released);
+	bzero(ring, sizeof(*ring));
+}
+
 //Process RDMA CM Eveent
 int process_rdma_cm_event(struct rdma_event_channel *echannel, enum rdma_cm_event_type expected_event, struct rdma_cm_event **cm_event) {
 	int ret = 1;
@@ -90,43 +839,332 @@ int process_rdma_cm_event(struct rdma_event_channel *echannel, enum rdma_cm_even
 	return ret;
 }
 
-//Process WC Events
-int process_wc_events (struct ibv_comp_channel *comp_channel, struct ibv_wc *wc, int max_wc) {
+//Completion strategy shared by all CQs of the process
+static enum roce_cq_mode roce_cq_mode = ROCE_CQ_EVENT;
+static uint64_t roce_cq_spin_ns = DEFAULT_CQ_SPIN_US * 1000ULL;
+
+//Completion statistics of the calling thread
+static __thread struct roce_cq_stats roce_cq_stats;
+
+//Select completion strategy
+void roce_set_cq_mode(enum roce_cq_mode mode, uint64_t spin_us) {
+	roce_cq_mode = mode;
+	roce_cq_spin_ns = spin_us * 1000ULL;
+}
+
+//Get selected completion strategy and adaptive spin time
+enum roce_cq_mode roce_get_cq_mode(uint64_t *spin_ns) {
+	if (spin_ns) {
+		*spin_ns = roce_cq_spin_ns;
+	}
+	return roce_cq_mode;
+}
+
+//Parse completion strategy name
+int roce_parse_cq_mode(const char *name, enum roce_cq_mode *mode) {
+	if (!strcmp(name, "event")) {
+		*mode = ROCE_CQ_EVENT;
+	} else if (!strcmp(name, "poll")) {
+		*mode = ROCE_CQ_POLL;
+	} else if (!strcmp(name, "adaptive")) {
+		*mode = ROCE_CQ_ADAPTIVE;
+	} else {
+		return -EINVAL;
+	}
+	return 0;
+}
+
+//Get name of completion strategy
+const char *roce_cq_mode_str(enum roce_cq_mode mode) {
+	switch (mode) {
+		case ROCE_CQ_POLL:
+			return "poll";
+		case ROCE_CQ_ADAPTIVE:
+			return "adaptive";
+		default:
+			return "event";
+	}
+}
+
+//Completion timestamps of the calling thread, device ticks are converted with the core clock of the device
+static __thread int roce_ts_enabled = 0;
+static __thread struct ibv_cq_ex *roce_ts_cq = NULL;
+//Extended CQ of the calling thread, polled with ibv_start_poll/ibv_next_poll
+static __thread struct ibv_cq_ex *roce_ex_cq = NULL;
+static __thread struct ibv_context *roce_ts_verbs = NULL;
+static __thread double roce_ts_ns_per_tick = 1.0;
+static __thread uint64_t roce_ts_last = 0;
+
+//Create CQ, with timestamps requested its completions are timestamped by the device if it supports it and in software otherwise
+struct ibv_cq *roce_create_cq(struct ibv_context *verbs, int cqe, void *context, struct ibv_comp_channel *channel, int timestamps) {
+	struct ibv_cq_init_attr_ex cq_attr;
+	struct ibv_device_attr_ex dev_attr;
+	struct ibv_values_ex values;
+	struct ibv_cq_ex *cq_ex;
+
+	if (!timestamps && roce_post_api != ROCE_POST_WR) {
+		return ibv_create_cq(verbs, cqe, context, channel, 0);
+	}
+
+	bzero(&cq_attr, sizeof(cq_attr));
+	cq_attr.cqe = cqe;
+	cq_attr.cq_context = context;
+	cq_attr.channel = channel;
+	cq_attr.wc_flags = IBV_WC_STANDARD_FLAGS;
+
+	if (!timestamps) {
+		cq_ex = ibv_create_cq_ex(verbs, &cq_attr);
+		if (!cq_ex) {
+			printf("Could not create extended CQ \n");
+			return NULL;
+		}
+		roce_ex_cq = cq_ex;
+		return ibv_cq_ex_to_cq(cq_ex);
+	}
+	roce_ts_enabled = 1;
+
+	//Device must report its clock rate and current clock to relate completion timestamps to posting
+	bzero(&dev_attr, sizeof(dev_attr));
+	bzero(&values, sizeof(values));
+	values.comp_mask = IBV_VALUES_MASK_RAW_CLOCK;
+	if (!ibv_query_device_ex(verbs, NULL, &dev_attr) && dev_attr.hca_core_clock && !ibv_query_rt_values_ex(verbs, &values)) {
+		cq_attr.wc_flags |= IBV_WC_EX_WITH_COMPLETION_TIMESTAMP;
+
+		cq_ex = ibv_create_cq_ex(verbs, &cq_attr);
+		if (cq_ex) {
+			roce_ts_cq = cq_ex;
+			roce_ex_cq = cq_ex;
+			roce_ts_verbs = verbs;
+			roce_ts_ns_per_tick = 1e6 / dev_attr.hca_core_clock;
+			return ibv_cq_ex_to_cq(cq_ex);
+		}
+	}
+
+	printf("Device does not timestamp completions, using software timestamps instead \n");
+	if (roce_post_api == ROCE_POST_WR) {
+		cq_attr.wc_flags = IBV_WC_STANDARD_FLAGS;
+		cq_ex = ibv_create_cq_ex(verbs, &cq_attr);
+		if (!cq_ex) {
+			printf("Could not create extended CQ \n");
+			return NULL;
+		}
+		roce_ex_cq = cq_ex;
+		return ibv_cq_ex_to_cq(cq_ex);
+	}
+	return ibv_create_cq(verbs, cqe, context, channel, 0);
+}
+
+//Check whether completions of the calling thread are timestamped by the device
+int roce_cq_hw_timestamps() {
+	return roce_ts_cq != NULL;
+}
+
+//Get current time of the completion clock of the calling thread
+int roce_cq_clock_now(uint64_t *now) {
+	struct ibv_values_ex values;
+	int ret = -1;
+
+	if (!roce_ts_cq) {
+		*now = roce_timestamp();
+		return 0;
+	}
+
+	values.comp_mask = IBV_VALUES_MASK_RAW_CLOCK;
+	ret = ibv_query_rt_values_ex(roce_ts_verbs, &values);
+	if (ret) {
+		return -ret;
+	}
+	*now = (uint64_t) values.raw_clock.tv_sec * 1000000000ULL + values.raw_clock.tv_nsec;
+	return 0;
+}
+
+//Get completion clock timestamp of the most recent WC polled by the calling thread
+uint64_t roce_cq_last_timestamp() {
+	return roce_ts_last;
+}
+
+//Convert difference of completion clock timestamps to nanoseconds
+uint64_t roce_cq_ticks_to_ns(uint64_t ticks) {
+	if (!roce_ts_cq) {
+		return roce_ticks_to_ns(ticks);
+	}
+	return (uint64_t) (ticks * roce_ts_ns_per_tick + 0.5);
+}
+
+//Poll extended CQ and keep the device timestamp of the last completion if it has one
+static int roce_poll_cq_ex(struct ibv_cq_ex *cq, struct ibv_wc *wc, int max_wc) {
+	struct ibv_poll_cq_attr poll_attr;
+	int ret = -1, n = 0;
+
+	if (max_wc <= 0) {
+		return 0;
+	}
+
+	bzero(&poll_attr, sizeof(poll_attr));
+	ret = ibv_start_poll(cq, &poll_attr);
+	if (ret == ENOENT) {
+		return 0;
+	} else if (ret) {
+		return -ret;
+	}
+
+	do {
+		bzero(&wc[n], sizeof(wc[n]));
+		wc[n].wr_id = cq->wr_id;
+		wc[n].status = cq->status;
+		//Other fields are only valid for successful completions
+		if (cq->status == IBV_WC_SUCCESS) {
+			wc[n].opcode = ibv_wc_read_opcode(cq);
+			wc[n].byte_len = ibv_wc_read_byte_len(cq);
+			wc[n].wc_flags = ibv_wc_read_wc_flags(cq);
+			wc[n].imm_data = ibv_wc_read_imm_data(cq);
+			wc[n].qp_num = ibv_wc_read_qp_num(cq);
+			if (cq == roce_ts_cq) {
+				roce_ts_last = ibv_wc_read_completion_ts(cq);
+			}
+		} else {
+			wc[n].vendor_err = ibv_wc_read_vendor_err(cq);
+		}
+		n++;
+	} while (n < max_wc && !ibv_next_poll(cq));
+
+	ibv_end_poll(cq);
+	return n;
+}
+
+//Poll CQ once without waiting
+int roce_poll_cq(struct ibv_cq *cq, struct ibv_wc *wc, int max_wc) {
+	int ret = -1;
+
+	if (roce_ex_cq && cq == ibv_cq_ex_to_cq(roce_ex_cq)) {
+		ret = roce_poll_cq_ex(roce_ex_cq, wc, max_wc);
+	} else {
+		ret = ibv_poll_cq(cq, max_wc, wc);
+	}
+
+	//Without device timestamps a completion is timestamped when it is polled
+	if (ret > 0 && roce_ts_enabled && !roce_ts_cq) {
+		roce_ts_last = roce_timestamp();
+	}
+
+	roce_cq_stats.polls++;
+	if (ret == 0) {
+		roce_cq_stats.empty_polls++;
+	}
+	return ret;
+}
+
+//Arm CQ notification and block on its Completion Channel
+static int roce_wait_cq_event(struct ibv_cq *cq, struct ibv_wc *wc, int max_wc) {
 	struct ibv_cq *cq_ptr = NULL;
 	void *context = NULL;
+	int ret = -1;
+
+	ret = ibv_req_notify_cq(cq, 0);
+	if (ret) {
+		printf("Could not request more notifications \n");
+		return -errno;
+	}
+
+	//Completions that arrived before arming do not generate an event
+	ret = roce_poll_cq(cq, wc, max_wc);
+	if (ret) {
+		return ret;
+	}
+
+	ret = ibv_get_cq_event(cq->channel, &cq_ptr, &context);
+	if (ret) {
+		printf("Could not get next CQ event \n");
+		return -errno;
+	}
+	ibv_ack_cq_events(cq_ptr, 1);
+	roce_cq_stats.events++;
+
+	return 0;
+}
+
+//Collect between min_wc and max_wc WC Events with the selected completion strategy
+static int roce_collect_wc(struct ibv_cq *cq, struct ibv_wc *wc, int min_wc, int max_wc) {
+	uint64_t spin_end = 0;
 	int ret = -1, i, total_wc = 0;
 
-	ret = ibv_get_cq_event(comp_channel, &cq_ptr, &context);
-    if (ret) {
-	    printf("Could not get next CQ event \n");
-	    return -errno;
-    }
-
-    ret = ibv_req_notify_cq(cq_ptr, 0);
-    if (ret){
-	    printf("Could not request more notifications \n");
-	    return -errno;
-    }
-
-    total_wc = 0;
-    do {
-	    ret = ibv_poll_cq(cq_ptr, max_wc - total_wc, wc + total_wc);
-	    if (ret < 0) {
-		    printf("Could not poll CQ for WC \n");
-		    return ret;
-	    }
-	    total_wc += ret;
-    } while (total_wc < max_wc); 
-
-	for( i = 0 ; i < total_wc ; i++) {
-	    if (wc[i].status != IBV_WC_SUCCESS) {
-		    printf("WC returned error \n");
-		    return -(wc[i].status);
-	    }
-    }
-
-    ibv_ack_cq_events(cq_ptr, 1);
-    return total_wc; 
+	while (total_wc < min_wc) {
+		ret = roce_poll_cq(cq, wc + total_wc, max_wc - total_wc);
+		if (ret < 0) {
+			printf("Could not poll CQ for WC \n");
+			return ret;
+		}
+		total_wc += ret;
+		if (ret > 0 || roce_cq_mode == ROCE_CQ_POLL) {
+			continue;
+		}
+
+		//Adaptive mode spins for a bounded time before falling back to events
+		if (roce_cq_mode == ROCE_CQ_ADAPTIVE) {
+			if (!spin_end) {
+				spin_end = roce_get_time_ns() + roce_cq_spin_ns;
+				continue;
+			}
+			if (roce_get_time_ns() < spin_end) {
+				continue;
+			}
+			spin_end = 0;
+		}
+
+		ret = roce_wait_cq_event(cq, wc + total_wc, max_wc - total_wc);
+		if (ret < 0) {
+			return ret;
+		}
+		total_wc += ret;
+	}
+
+	for (i = 0; i < total_wc; i++) {
+		if (wc[i].status != IBV_WC_SUCCESS) {
+			printf("WC returned error: %s \n", ibv_wc_status_str(wc[i].status));
+			return -(wc[i].status);
+		}
+	}
+
+	return total_wc;
+}
+
+//Process WC Events
+int process_wc_events(struct ibv_cq *cq, struct ibv_wc *wc, int max_wc) {
+	return roce_collect_wc(cq, wc, max_wc, max_wc);
+}
+
+//Collect at least one and at most max_wc WC Events from CQ
+int collect_wc_events(struct ibv_cq *cq, struct ibv_wc *wc, int max_wc) {
+	return roce_collect_wc(cq, wc, 1, max_wc);
+}
+
+//Take snapshot of wall time, CPU time and completion statistics of the calling thread
+void roce_get_cpu_usage(struct roce_cpu_usage *usage) {
+	struct rusage ru;
+
+	getrusage(RUSAGE_THREAD, &ru);
+	usage->wall_ns = roce_get_time_ns();
+	usage->user_ns = ru.ru_utime.tv_sec * 1000000000ULL + ru.ru_utime.tv_usec * 1000ULL;
+	usage->sys_ns = ru.ru_stime.tv_sec * 1000000000ULL + ru.ru_stime.tv_usec * 1000ULL;
+	usage->cq = roce_cq_stats;
+}
+
+//Print CPU cost between two snapshots
+void roce_print_cpu_usage(const struct roce_cpu_usage *start, const struct roce_cpu_usage *end) {
+	double wall = end->wall_ns - start->wall_ns;
+	double user = end->user_ns - start->user_ns;
+	double sys = end->sys_ns - start->sys_ns;
+
+	if (wall <= 0) {
+		wall = 1;
+	}
+
+	printf("CPU (%s completions): %.1f%% of %.3f ms (user %.1f%%, sys %.1f%%), %llu CQ events, %llu polls (%llu empty) \n",
+			roce_cq_mode_str(roce_cq_mode),
+			100.0 * (user + sys) / wall, wall / 1e6, 100.0 * user / wall, 100.0 * sys / wall,
+			(unsigned long long) (end->cq.events - start->cq.events),
+			(unsigned long long) (end->cq.polls - start->cq.polls),
+			(unsigned long long) (end->cq.empty_polls - start->cq.empty_polls));
 }
 
 //Get address information (based on rping.c from librdmacm)
@@ -144,3 +1182,390 @@ int get_addr(char *dst, struct sockaddr *addr) {
 	freeaddrinfo(res);
 	return ret;
 }
+
+
+//Get current time of CLOCK_MONOTONIC_RAW in nanoseconds, it is not slewed by NTP
+uint64_t roce_get_time_ns() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+//Clock used for timestamps and nanoseconds per tick
+static enum roce_clock roce_clock = ROCE_CLOCK_RAW;
+static double roce_ns_per_tick = 1.0;
+
+//Read TSC once all previous instructions have executed
+static inline uint64_t roce_rdtsc() {
+#if defined(__x86_64__) || defined(__i386__)
+	uint32_t lo, hi;
+
+	__asm__ __volatile__ ("rdtscp" : "=a" (lo), "=d" (hi) : : "ecx");
+	return ((uint64_t) hi << 32) | lo;
+#else
+	return 0;
+#endif
+}
+
+//TSC can only be converted to time if it ticks at a constant rate, also in deep C-states
+static int roce_tsc_invariant() {
+#if defined(__x86_64__) || defined(__i386__)
+	char line[4096];
+	FILE *cpuinfo;
+	int constant = 0, nonstop = 0;
+
+	cpuinfo = fopen("/proc/cpuinfo", "r");
+	if (!cpuinfo) {
+		return 0;
+	}
+	while (fgets(line, sizeof(line), cpuinfo)) {
+		if (!strncmp(line, "flags", 5)) {
+			constant = strstr(line, " constant_tsc") != NULL;
+			nonstop = strstr(line, " nonstop_tsc") != NULL;
+			break;
+		}
+	}
+	fclose(cpuinfo);
+
+	return constant && nonstop;
+#else
+	return 0;
+#endif
+}
+
+//Select clock for timestamps
+int roce_set_clock(enum roce_clock clock) {
+	uint64_t start_ns, start_tsc, end_ns, end_tsc;
+
+	roce_clock = ROCE_CLOCK_RAW;
+	roce_ns_per_tick = 1.0;
+	if (clock == ROCE_CLOCK_RAW) {
+		return 0;
+	}
+
+	if (!roce_tsc_invariant()) {
+		printf("TSC is not invariant, timing with CLOCK_MONOTONIC_RAW instead \n");
+		return -ENOTSUP;
+	}
+
+	//Count ticks while CLOCK_MONOTONIC_RAW advances by the calibration time
+	start_ns = roce_get_time_ns();
+	start_tsc = roce_rdtsc();
+	do {
+		end_ns = roce_get_time_ns();
+		end_tsc = roce_rdtsc();
+	} while (end_ns - start_ns < ROCE_TSC_CALIBRATION_NS);
+
+	if (end_tsc <= start_tsc) {
+		printf("TSC did not advance, timing with CLOCK_MONOTONIC_RAW instead \n");
+		return -ENOTSUP;
+	}
+
+	roce_clock = ROCE_CLOCK_TSC;
+	roce_ns_per_tick = (double) (end_ns - start_ns) / (end_tsc - start_tsc);
+	return 0;
+}
+
+//Parse clock name
+int roce_parse_clock(const char *name, enum roce_clock *clock) {
+	if (!strcmp(name, "raw")) {
+		*clock = ROCE_CLOCK_RAW;
+	} else if (!strcmp(name, "tsc")) {
+		*clock = ROCE_CLOCK_TSC;
+	} else {
+		return -EINVAL;
+	}
+	return 0;
+}
+
+//Print selected clock and its tick rate
+void roce_print_clock() {
+	if (roce_clock == ROCE_CLOCK_TSC) {
+		printf("Timestamps: TSC at %.3f MHz (calibrated against CLOCK_MONOTONIC_RAW) \n", 1e3 / roce_ns_per_tick);
+	} else {
+		printf("Timestamps: CLOCK_MONOTONIC_RAW \n");
+	}
+}
+
+//Get name of selected clock
+const char *roce_clock_str() {
+	return roce_clock == ROCE_CLOCK_TSC ? "tsc" : "raw";
+}
+
+//Take timestamp in ticks of the selected clock
+uint64_t roce_timestamp() {
+	if (roce_clock == ROCE_CLOCK_TSC) {
+		return roce_rdtsc();
+	}
+	return roce_get_time_ns();
+}
+
+//Convert difference of two timestamps to nanoseconds
+uint64_t roce_ticks_to_ns(uint64_t ticks) {
+	if (roce_clock == ROCE_CLOCK_TSC) {
+		return (uint64_t) (ticks * roce_ns_per_tick + 0.5);
+	}
+	return ticks;
+}
+
+//Map value to histogram bucket
+static int roce_hist_index(uint64_t value) {
+	int exponent;
+
+	//Small values are stored exactly
+	if (value < ROCE_HIST_SUB_COUNT) {
+		return (int) value;
+	}
+
+	exponent = 63 - __builtin_clzll(value);
+	return ((exponent - ROCE_HIST_SUB_BITS + 1) << ROCE_HIST_SUB_BITS) +
+		(int) ((value >> (exponent - ROCE_HIST_SUB_BITS)) & (ROCE_HIST_SUB_COUNT - 1));
+}
+
+//Map histogram bucket to the middle of the value range it covers
+static uint64_t roce_hist_value(int index) {
+	int block = index >> ROCE_HIST_SUB_BITS;
+	int sub = index & (ROCE_HIST_SUB_COUNT - 1);
+
+	if (block == 0) {
+		return sub;
+	}
+
+	return (((uint64_t) (ROCE_HIST_SUB_COUNT + sub)) << (block - 1)) + ((1ULL << (block - 1)) >> 1);
+}
+
+//Reset histogram
+void roce_hist_init(struct roce_histogram *hist) {
+	memset(hist, 0, sizeof(*hist));
+	hist->min = UINT64_MAX;
+}
+
+//Record value in histogram
+void roce_hist_record(struct roce_histogram *hist, uint64_t value) {
+	hist->buckets[roce_hist_index(value)]++;
+	hist->count++;
+	hist->sum += value;
+	if (value < hist->min) {
+		hist->min = value;
+	}
+	if (value > hist->max) {
+		hist->max = value;
+	}
+}
+
+//Add all values recorded in src to dst
+void roce_hist_merge(struct roce_histogram *dst, const struct roce_histogram *src) {
+	int i;
+
+	for (i = 0; i < ROCE_HIST_BUCKETS; i++) {
+		dst->buckets[i] += src->buckets[i];
+	}
+	dst->count += src->count;
+	dst->sum += src->sum;
+	if (src->min < dst->min) {
+		dst->min = src->min;
+	}
+	if (src->max > dst->max) {
+		dst->max = src->max;
+	}
+}
+
+//Get value at given percentile (0-100) from histogram
+uint64_t roce_hist_percentile(const struct roce_histogram *hist, double percentile) {
+	uint64_t target, seen = 0, value;
+	int i;
+
+	if (!hist->count) {
+		return 0;
+	}
+
+	//Rank of the value at the given percentile (rounded up)
+	target = (uint64_t) (percentile / 100.0 * hist->count);
+	if (target < percentile / 100.0 * hist->count) {
+		target++;
+	}
+	if (target < 1) {
+		target = 1;
+	}
+	if (target > hist->count) {
+		target = hist->count;
+	}
+
+	for (i = 0; i < ROCE_HIST_BUCKETS; i++) {
+		seen += hist->buckets[i];
+		if (seen >= target) {
+			break;
+		}
+	}
+
+	//Bucket midpoints can lie outside of the observed range
+	value = roce_hist_value(i);
+	if (value < hist->min) {
+		value = hist->min;
+	}
+	if (value > hist->max) {
+		value = hist->max;
+	}
+	return value;
+}
+
+//Get mean of recorded values
+double roce_hist_mean(const struct roce_histogram *hist) {
+	if (!hist->count) {
+		return 0.0;
+	}
+	return hist->sum / hist->count;
+}
+
+//Vector of eight 32-bit words, compiled to SSE2/AVX2 or NEON by the compiler
+typedef uint32_t roce_u32x8 __attribute__((vector_size(32)));
+
+//Hash of seed and position of a 32-bit word
+static inline uint32_t roce_pattern_word(uint32_t seed_lo, uint32_t seed_hi, uint64_t index) {
+	uint32_t v = ((uint32_t) index ^ seed_lo) * 0x9E3779B1u + ((uint32_t) (index >> 32) ^ seed_hi);
+
+	v ^= v >> 15;
+	v *= 0x85EBCA77u;
+	v ^= v >> 13;
+	return v;
+}
+
+//Fill buffer with the pattern of a transfer starting offset bytes into it, every 32-bit word
+//of the transfer is a hash of the seed and its position
+#if defined(__x86_64__)
+__attribute__((target_clones("avx2", "default")))
+#endif
+void roce_fill_pattern(void *buf, uint64_t length, uint64_t seed, uint64_t offset) {
+	const roce_u32x8 lanes = { 0, 1, 2, 3, 4, 5, 6, 7 };
+	uint32_t seed_lo = (uint32_t) seed, seed_hi = (uint32_t) (seed >> 32), word;
+	uint64_t index = offset / 4;
+	uint8_t *dst = buf;
+	roce_u32x8 v;
+
+	//Bytes up to the next word boundary of the transfer
+	while (length && (offset % 4)) {
+		word = roce_pattern_word(seed_lo, seed_hi, index);
+		*dst++ = (uint8_t) (word >> (8 * (offset % 4)));
+		offset++;
+		length--;
+		if (!(offset % 4)) {
+			index++;
+		}
+	}
+
+	//Eight words at a time as long as the upper half of the index stays the same
+	while (length >= sizeof(v)) {
+		if ((uint32_t) index > UINT32_MAX - 7) {
+			word = roce_pattern_word(seed_lo, seed_hi, index);
+			memcpy(dst, &word, sizeof(word));
+			dst += sizeof(word);
+			length -= sizeof(word);
+			index++;
+			continue;
+		}
+
+		v = (((uint32_t) index + lanes) ^ seed_lo) * 0x9E3779B1u + ((uint32_t) (index >> 32) ^ seed_hi);
+		v ^= v >> 15;
+		v *= 0x85EBCA77u;
+		v ^= v >> 13;
+
+		memcpy(dst, &v, sizeof(v));
+		dst += sizeof(v);
+		length -= sizeof(v);
+		index += 8;
+	}
+
+	//Remaining words and bytes
+	while (length) {
+		word = roce_pattern_word(seed_lo, seed_hi, index++);
+		memcpy(dst, &word, length < sizeof(word) ? length : sizeof(word));
+		dst += length < sizeof(word) ? length : sizeof(word);
+		length -= length < sizeof(word) ? length : sizeof(word);
+	}
+}
+
+//Table for CRC32C without the SSE4.2 instruction, reflected polynomial 0x82F63B78
+static uint32_t roce_crc32c_table[256];
+static pthread_once_t roce_crc32c_once = PTHREAD_ONCE_INIT;
+
+static void roce_crc32c_init_table() {
+	uint32_t crc;
+	int i, bit;
+
+	for (i = 0; i < 256; i++) {
+		crc = i;
+		for (bit = 0; bit < 8; bit++) {
+			crc = (crc >> 1) ^ ((crc & 1) ? 0x82F63B78u : 0);
+		}
+		roce_crc32c_table[i] = crc;
+	}
+}
+
+static uint32_t roce_crc32c_sw(uint32_t crc, const uint8_t *buf, uint64_t length) {
+	pthread_once(&roce_crc32c_once, roce_crc32c_init_table);
+
+	while (length--) {
+		crc = roce_crc32c_table[(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+	}
+	return crc;
+}
+
+#if defined(__x86_64__)
+//CRC32 instruction of SSE4.2 processes 8 bytes at a time
+__attribute__((target("sse4.2")))
+static uint32_t roce_crc32c_hw(uint32_t crc, const uint8_t *buf, uint64_t length) {
+	uint64_t value, crc64 = crc;
+
+	while (length >= sizeof(value)) {
+		memcpy(&value, buf, sizeof(value));
+		crc64 = __builtin_ia32_crc32di(crc64, value);
+		buf += sizeof(value);
+		length -= sizeof(value);
+	}
+	crc = (uint32_t) crc64;
+	while (length--) {
+		crc = __builtin_ia32_crc32qi(crc, *buf++);
+	}
+	return crc;
+}
+#endif
+
+//Continue CRC32C (Castagnoli) of previous data with crc, 0 starts a new checksum
+uint32_t roce_crc32c(uint32_t crc, const void *buf, uint64_t length) {
+	crc = ~crc;
+#if defined(__x86_64__)
+	if (__builtin_cpu_supports("sse4.2")) {
+		return ~roce_crc32c_hw(crc, buf, length);
+	}
+#endif
+	return ~roce_crc32c_sw(crc, buf, length);
+}
+
+//Add CRC32C of the next segment to a digest
+uint32_t roce_digest_add(uint32_t digest, uint32_t segment_crc) {
+	uint8_t bytes[4] = { segment_crc & 0xff, (segment_crc >> 8) & 0xff, (segment_crc >> 16) & 0xff, segment_crc >> 24 };
+
+	return roce_crc32c(digest, bytes, sizeof(bytes));
+}
+
+//Digest of a buffer split into segments of segment_size bytes, the last one may be shorter
+uint32_t roce_checksum_digest(const void *buf, uint64_t length, uint64_t segment_size) {
+	const uint8_t *segment = buf;
+	uint64_t size;
+	uint32_t digest = 0;
+
+	if (!segment_size) {
+		segment_size = length;
+	}
+
+	while (length) {
+		size = length < segment_size ? length : segment_size;
+		digest = roce_digest_add(digest, roce_crc32c(0, segment, size));
+		segment += size;
+		length -= size;
+	}
+	return digest;
+}
+
+#endif
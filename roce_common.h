@@ -4,14 +4,28 @@
 #ifndef ROCE_COMMON_H
 #define ROCE_COMMON_H
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
+#include <limits.h>
 #include <sys/time.h>
+#include <sys/resource.h>
+#include <time.h>
 #include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/utsname.h>
 
 #include <netdb.h>
 #include <netinet/in.h>	
@@ -26,15 +40,185 @@
 #define MAX_SGE (32)
 #define MAX_WR (512)
 #define DEFAULT_RDMA_PORT (4791)
+#define DEFAULT_CQ_SPIN_US (50)
+
+//Inline size probed when the maximum is requested
+#define ROCE_MAX_INLINE_PROBE (1024)
+
+//Receive ring defaults, consumed buffers are reposted ROCE_RECV_BATCH at a time
+#define ROCE_RECV_RING_SLOTS (128)
+#define ROCE_RECV_BATCH (16)
+
+//Traffic the server takes part in after the metadata exchange
+enum roce_session_mode {
+	ROCE_SESSION_PASSIVE,
+	ROCE_SESSION_ECHO,
+	ROCE_SESSION_WRITE_POLL,
+	ROCE_SESSION_WRITE_IMM,
+	ROCE_SESSION_ATOMIC,
+	ROCE_SESSION_ATOMIC_SHARED,
+	ROCE_SESSION_BIDIR,
+};
+
+//Private data of a connect request, clients of a contended atomic slot ask for the shared PD of the server
+#define ROCE_CONNECT_SHARED_PD (1 << 0)
+
+struct __attribute((packed)) roce_connect_data {
+  uint32_t flags;
+};
+
+//Checksum request of the client and reply of the server over the first length bytes of the server buffer,
+//the digest is the CRC32C over the little-endian CRC32C of every segment
+struct __attribute((packed)) roce_checksum_msg {
+  uint64_t length;
+  uint64_t segment_size;
+  uint32_t digest;
+};
 
 //Structure to exchange buffer information between client and server
 struct __attribute((packed)) roce_buffer_attr {
   uint64_t address;
-  uint32_t length;
+  uint64_t length;
   union stag {
 	  uint32_t local_stag;
 	  uint32_t remote_stag;
   } stag;
+  //Session mode and receive ring slots of the sender
+  uint32_t mode;
+  uint32_t depth;
+  //Messages and queue depth of the stream the server writes back in bidirectional sessions
+  uint32_t count;
+  uint32_t queue_depth;
+};
+
+//Registered-memory allocator: memory is mapped and registered in regions of at least
+//ROCE_MEM_CHUNK_SIZE bytes (or one hugepage), which are split into chunks of power-of-two
+//slabs from 64 B to 1 MiB, larger buffers get a chunk of their own
+//Free slab objects are tracked outside of registered memory, so peers cannot corrupt the allocator
+#define ROCE_MEM_CHUNK_SIZE (2 * 1024 * 1024)
+#define ROCE_MEM_MIN_SHIFT (6)
+#define ROCE_MEM_MAX_SHIFT (20)
+#define ROCE_MEM_CLASSES (ROCE_MEM_MAX_SHIFT - ROCE_MEM_MIN_SHIFT + 1)
+
+//Pages backing registered memory
+enum roce_page_size {
+	ROCE_PAGES_4K,
+	ROCE_PAGES_2M,
+	ROCE_PAGES_1G,
+};
+
+//Mapped and registered memory region
+struct roce_mem_region {
+	struct ibv_mr *mr;
+	uint64_t used;
+	struct roce_mem_region *next;
+};
+
+//Chunk of a region, size_class is -1 for chunks holding a single large buffer
+//Slab chunks keep the indices of their free objects in free_objs and are on the free list of their class while any are left
+//MRs of exposed buffers are kept with the chunk (mr) or per object (obj_mrs) and reused by later allocations
+struct roce_mem_chunk {
+	struct roce_mem_region *region;
+	char *addr;
+	uint64_t length;
+	int size_class;
+	int in_use;
+	uint32_t *free_objs;
+	uint32_t num_free;
+	struct ibv_mr *mr;
+	struct ibv_mr **obj_mrs;
+	struct roce_mem_chunk *next_free;
+	struct roce_mem_chunk *next;
+};
+
+//Handle of a buffer handed out by the allocator
+struct roce_mem {
+	void *addr;
+	uint64_t length;
+	uint32_t lkey;
+	uint32_t rkey;
+	struct roce_mem_chunk *chunk;
+};
+
+//Allocator bound to one PD, all regions share the same access flags and placement
+struct roce_mem_pool {
+	struct ibv_pd *pd;
+	int access;
+	enum roce_page_size pages;
+	int numa_node;
+	struct roce_mem_region *regions;
+	struct roce_mem_chunk *chunks;
+	struct roce_mem_chunk *free_chunks[ROCE_MEM_CLASSES];
+	uint64_t registered_bytes;
+	uint64_t allocated_bytes;
+	uint64_t registrations;
+	uint64_t page_fallbacks;
+};
+
+//Receive buffers pre-posted on a QP or SRQ, slot i completes with wr_id wr_id_base + i
+struct roce_recv_ring {
+	struct ibv_qp *qp;
+	struct ibv_srq *srq;
+	struct roce_mem mem;
+	uint32_t slots;
+	uint32_t slot_size;
+	uint32_t batch;
+	uint64_t wr_id_base;
+	uint32_t *released;
+	uint32_t num_released;
+	struct ibv_recv_wr *wrs;
+	struct ibv_sge *sges;
+};
+
+//Histogram with HDR-style logarithmic buckets: every power of two is split
+//into ROCE_HIST_SUB_COUNT linear sub-buckets (~3% relative precision)
+#define ROCE_HIST_SUB_BITS (5)
+#define ROCE_HIST_SUB_COUNT (1 << ROCE_HIST_SUB_BITS)
+#define ROCE_HIST_BUCKETS ((64 - ROCE_HIST_SUB_BITS + 1) * ROCE_HIST_SUB_COUNT)
+
+struct roce_histogram {
+  uint64_t count;
+  uint64_t min;
+  uint64_t max;
+  double sum;
+  uint64_t buckets[ROCE_HIST_BUCKETS];
+};
+
+//Completion strategies for waiting on a CQ
+enum roce_cq_mode {
+  ROCE_CQ_EVENT,		//Block on the Completion Channel
+  ROCE_CQ_POLL,		//Busy-poll the CQ
+  ROCE_CQ_ADAPTIVE,	//Busy-poll for a bounded time, then block on the Completion Channel
+};
+
+//APIs for posting Work Requests and polling their completions
+enum roce_post_api {
+  ROCE_POST_LEGACY,	//ibv_post_send with ibv_send_wr lists, ibv_poll_cq
+  ROCE_POST_WR,		//ibv_wr_* on a QP from ibv_create_qp_ex, ibv_start_poll/ibv_next_poll on an extended CQ
+};
+
+//Completion statistics of a thread
+struct roce_cq_stats {
+  uint64_t polls;
+  uint64_t empty_polls;
+  uint64_t events;
+};
+
+//Clocks for timing Work Requests, TSC ticks are converted to nanoseconds with the rate calibrated at startup
+enum roce_clock {
+  ROCE_CLOCK_RAW,		//CLOCK_MONOTONIC_RAW
+  ROCE_CLOCK_TSC,		//Invariant Time Stamp Counter
+};
+
+//Time the TSC is calibrated against CLOCK_MONOTONIC_RAW
+#define ROCE_TSC_CALIBRATION_NS (50 * 1000000ULL)
+
+//Wall time, CPU time and completion statistics of a thread at one point in time
+struct roce_cpu_usage {
+  uint64_t wall_ns;
+  uint64_t user_ns;
+  uint64_t sys_ns;
+  struct roce_cq_stats cq;
 };
 
 //Resolve given address
@@ -46,18 +230,184 @@ int process_rdma_cm_event(struct rdma_event_channel *echannel,
 						  struct rdma_cm_event **cm_event);
 
 //Allocate buffer of given size
-struct ibv_mr* roce_alloc_buffer(struct ibv_pd *pd, uint32_t length, enum ibv_access_flags permission);
+struct ibv_mr* roce_alloc_buffer(struct ibv_pd *pd, uint64_t length, enum ibv_access_flags permission);
 
 //Free allocated buffers
 void roce_free_buffer(struct ibv_mr *mr);
 
 //Register allocated memory
-struct ibv_mr *roce_register_buffer(struct ibv_pd *pd, void *addr, uint32_t length, enum ibv_access_flags permission);
+struct ibv_mr *roce_register_buffer(struct ibv_pd *pd, void *addr, uint64_t length, enum ibv_access_flags permission);
 
 //Deregister registered memory
 void roce_deregister_buffer(struct ibv_mr *mr);
 
+//Select pages and NUMA binding of memory registered by allocators set up afterwards
+void roce_set_mem_placement(enum roce_page_size pages, int bind_numa);
+
+//Parse page size name (4k, 2m or 1g)
+int roce_parse_page_size(const char *name, enum roce_page_size *pages);
+
+//Get name of page size
+const char *roce_page_size_str(enum roce_page_size pages);
+
+//Get NUMA node of RDMA device from sysfs, -1 if unknown
+int roce_get_device_numa_node(struct ibv_context *verbs);
+
+//Report placement and amount of memory registered by an allocator
+void roce_print_mem_placement(const struct roce_mem_pool *pool);
+
+//Create QP with the largest inline size up to max_inline the device accepts, the size obtained is returned in attr
+int roce_create_qp(struct rdma_cm_id *id, struct ibv_pd *pd, struct ibv_qp_init_attr *attr, uint32_t max_inline);
+
+//Select API used by roce_create_qp, roce_create_cq and roce_post_send
+void roce_set_post_api(enum roce_post_api api);
+
+//Get selected posting API
+enum roce_post_api roce_get_post_api();
+
+//Parse posting API name (post or wr)
+int roce_parse_post_api(const char *name, enum roce_post_api *api);
+
+//Get name of posting API
+const char *roce_post_api_str(enum roce_post_api api);
+
+//Post WR list with the selected API
+int roce_post_send(struct ibv_qp *qp, struct ibv_send_wr *wr, struct ibv_send_wr **bad_wr);
+
+//Parse inline size, "max" probes for the largest size supported
+int roce_parse_inline_size(const char *arg, uint32_t *max_inline);
+
+//Parse size in bytes with optional k, m or g suffix (powers of 1024)
+int roce_parse_size(const char *arg, uint64_t *size);
+
+//Get largest message and largest memory region the device of a connected CM ID supports
+int roce_query_transfer_limits(struct rdma_cm_id *id, uint64_t *max_msg_size, uint64_t *max_mr_size);
+
+//Number of receives a ring with given slots always has posted
+uint32_t roce_recv_ring_capacity(uint32_t slots);
+
+//Allocate ring buffers and post all of them to the QP or, if given, the SRQ
+int roce_recv_ring_init(struct roce_recv_ring *ring, struct roce_mem_pool *pool, struct ibv_qp *qp, struct ibv_srq *srq,
+		uint32_t slots, uint32_t slot_size, uint64_t wr_id_base);
+
+//Get buffer of a ring slot
+void *roce_recv_ring_slot(struct roce_recv_ring *ring, uint32_t slot);
+
+//Release a consumed slot, released slots are reposted once a batch is complete
+int roce_recv_ring_release(struct roce_recv_ring *ring, uint32_t slot);
+
+//Repost all released slots right away
+int roce_recv_ring_flush(struct roce_recv_ring *ring);
+
+//Free ring buffers, the QP must be destroyed already
+void roce_recv_ring_destroy(struct roce_recv_ring *ring, struct roce_mem_pool *pool);
+
+//Set up allocator for registered memory of a PD
+void roce_mem_pool_init(struct roce_mem_pool *pool, struct ibv_pd *pd, int access);
+
+//Deregister and unmap all regions of the allocator, statistics are kept
+void roce_mem_pool_destroy(struct roce_mem_pool *pool);
+
+//Hand out registered buffer of at least length bytes, contents are undefined
+int roce_mem_alloc(struct roce_mem_pool *pool, uint64_t length, struct roce_mem *mem);
+
+//Return buffer to the allocator, its memory stays registered
+void roce_mem_free(struct roce_mem_pool *pool, struct roce_mem *mem);
+
+//Give buffer an MR of its own for remote access, so its rkey reaches no other buffer of the allocator.
+//The MR is registered on first use and kept for the slot of the buffer, an allocator always exposes with the same access
+int roce_mem_expose(struct roce_mem_pool *pool, struct roce_mem *mem, int access);
+
+//Select completion strategy (spin time only used in adaptive mode)
+void roce_set_cq_mode(enum roce_cq_mode mode, uint64_t spin_us);
+
+//Parse completion strategy name (event, poll or adaptive)
+int roce_parse_cq_mode(const char *name, enum roce_cq_mode *mode);
+
+//Get name of completion strategy
+const char *roce_cq_mode_str(enum roce_cq_mode mode);
+
+//Get selected completion strategy and adaptive spin time
+enum roce_cq_mode roce_get_cq_mode(uint64_t *spin_ns);
+
+//Create CQ, with timestamps requested its completions are timestamped by the device if it supports it and in software otherwise
+//With the ibv_wr_* posting API the CQ is always an extended CQ
+struct ibv_cq *roce_create_cq(struct ibv_context *verbs, int cqe, void *context, struct ibv_comp_channel *channel, int timestamps);
+
+//Check whether completions of the calling thread are timestamped by the device
+int roce_cq_hw_timestamps();
+
+//Get current time of the completion clock of the calling thread, fails if the device clock cannot be read
+int roce_cq_clock_now(uint64_t *now);
+
+//Get completion clock timestamp of the most recent WC polled by the calling thread
+uint64_t roce_cq_last_timestamp();
+
+//Convert difference of completion clock timestamps to nanoseconds
+uint64_t roce_cq_ticks_to_ns(uint64_t ticks);
+
+//Poll CQ once without waiting
+int roce_poll_cq(struct ibv_cq *cq, struct ibv_wc *wc, int max_wc);
+
 //Process WC Events
-int process_wc_events(struct ibv_comp_channel *comp_channel, struct ibv_wc *wc,	int max_wc);
+int process_wc_events(struct ibv_cq *cq, struct ibv_wc *wc, int max_wc);
+
+//Collect at least one and at most max_wc WC Events from CQ
+int collect_wc_events(struct ibv_cq *cq, struct ibv_wc *wc, int max_wc);
+
+//Take snapshot of CPU usage of the calling thread
+void roce_get_cpu_usage(struct roce_cpu_usage *usage);
+
+//Print CPU cost between two snapshots
+void roce_print_cpu_usage(const struct roce_cpu_usage *start, const struct roce_cpu_usage *end);
+
+//Get current time of CLOCK_MONOTONIC_RAW in nanoseconds
+uint64_t roce_get_time_ns();
+
+//Select clock for timestamps, the TSC is calibrated first and CLOCK_MONOTONIC_RAW is kept if it is not usable
+int roce_set_clock(enum roce_clock clock);
+
+//Parse clock name (raw or tsc)
+int roce_parse_clock(const char *name, enum roce_clock *clock);
+
+//Print name of selected clock and its tick rate
+void roce_print_clock();
+
+//Get name of selected clock
+const char *roce_clock_str();
+
+//Take timestamp in ticks of the selected clock
+uint64_t roce_timestamp();
+
+//Convert difference of two timestamps to nanoseconds
+uint64_t roce_ticks_to_ns(uint64_t ticks);
+
+//Reset histogram
+void roce_hist_init(struct roce_histogram *hist);
+
+//Record value in histogram
+void roce_hist_record(struct roce_histogram *hist, uint64_t value);
+
+//Get value at given percentile (0-100) from histogram
+uint64_t roce_hist_percentile(const struct roce_histogram *hist, double percentile);
+
+//Add all values recorded in src to dst
+void roce_hist_merge(struct roce_histogram *dst, const struct roce_histogram *src);
+
+//Get mean of recorded values
+double roce_hist_mean(const struct roce_histogram *hist);
+
+//Fill buffer with the pattern of a transfer starting offset bytes into it, every 32-bit word
+//of the transfer is a hash of the seed and its position
+void roce_fill_pattern(void *buf, uint64_t length, uint64_t seed, uint64_t offset);
+
+//Continue CRC32C (Castagnoli) of previous data with crc, 0 starts a new checksum
+uint32_t roce_crc32c(uint32_t crc, const void *buf, uint64_t length);
+
+//Add CRC32C of the next segment to a digest
+uint32_t roce_digest_add(uint32_t digest, uint32_t segment_crc);
+
+//Digest of a buffer split into segments of segment_size bytes, the last one may be shorter
+uint32_t roce_checksum_digest(const void *buf, uint64_t length, uint64_t segment_size);
 
 #endif /* ROCE_COMMON_H */
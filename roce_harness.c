@@ -0,0 +1,382 @@
+// Loopback benchmark harness: runs roce_server and roce_client as threads of one process
+// against a Soft-RoCE device on 127.0.0.1 and compares the results with a stored baseline
+
+#define ROCE_HARNESS
+#include "roce_server.c"
+#include "roce_client.c"
+
+//Iterations of every case unless -n is given
+#define HARNESS_ITERATIONS (10000)
+#define HARNESS_WARMUP (1000)
+
+//Allowed deviation from the baseline in percent
+#define DEFAULT_THRESHOLD (10.0)
+
+#define MAX_HARNESS_RESULTS (256)
+
+//Interval in which the server thread is signaled until it left its event loop
+#define HARNESS_STOP_INTERVAL_NS (100 * 1000000L)
+
+//Case of the benchmark matrix
+struct harness_case {
+	enum client_bench_mode mode;
+	int msg_size;
+	int queue_depth;
+};
+
+//Every opcode of lat, bw and atomic mode at small, page and large messages, bandwidth also at several queue depths
+static const struct harness_case harness_matrix[] = {
+	{ MODE_LATENCY, 64, 1 },
+	{ MODE_LATENCY, 4096, 1 },
+	{ MODE_LATENCY, 65536, 1 },
+	{ MODE_BANDWIDTH, 64, 1 },
+	{ MODE_BANDWIDTH, 64, 16 },
+	{ MODE_BANDWIDTH, 64, 128 },
+	{ MODE_BANDWIDTH, 4096, 1 },
+	{ MODE_BANDWIDTH, 4096, 16 },
+	{ MODE_BANDWIDTH, 4096, 128 },
+	{ MODE_BANDWIDTH, 65536, 1 },
+	{ MODE_BANDWIDTH, 65536, 16 },
+	{ MODE_BANDWIDTH, 65536, 128 },
+	{ MODE_ATOMIC, 8, 1 },
+};
+
+#define HARNESS_CASES ((int) (sizeof(harness_matrix) / sizeof(harness_matrix[0])))
+
+//Result of one operation in one case, identified by "mode op bytes queue_depth"
+//Latency is compared at p50 in usec and bandwidth in MB/s
+struct harness_result {
+	char key[96];
+	char metric[16];
+	double value;
+};
+
+static struct harness_result harness_results[MAX_HARNESS_RESULTS];
+static int num_harness_results = 0;
+static pthread_mutex_t harness_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//Keep the metric of a measurement record of the client, rates are preferred over latency
+static void harness_record(const struct client_record *record) {
+	const char *mode = NULL, *op = NULL;
+	double bytes = -1, depth = -1, p50 = -1, rate = -1;
+	struct harness_result *result;
+	int f;
+
+	for (f = 0; f < record->num_fields; f++) {
+		if (!strcmp(record->fields[f].key, "mode")) {
+			mode = record->fields[f].str;
+		} else if (!strcmp(record->fields[f].key, "op")) {
+			op = record->fields[f].str;
+		} else if (!strcmp(record->fields[f].key, "bytes")) {
+			bytes = record->fields[f].num;
+		} else if (!strcmp(record->fields[f].key, "queue_depth")) {
+			depth = record->fields[f].num;
+		} else if (!strcmp(record->fields[f].key, "p50_us")) {
+			p50 = record->fields[f].num;
+		} else if (!strcmp(record->fields[f].key, "mb_per_s")) {
+			rate = record->fields[f].num;
+		}
+	}
+	if (!mode || !op || (p50 < 0 && rate < 0)) {
+		return;
+	}
+
+	pthread_mutex_lock(&harness_lock);
+	if (num_harness_results < MAX_HARNESS_RESULTS) {
+		result = &harness_results[num_harness_results++];
+		snprintf(result->key, sizeof(result->key), "%s %s %.0f %.0f", mode, op, bytes, depth);
+		snprintf(result->metric, sizeof(result->metric), "%s", rate >= 0 ? "mb_per_s" : "p50_us");
+		result->value = rate >= 0 ? rate : p50;
+	}
+	pthread_mutex_unlock(&harness_lock);
+}
+
+//Run the event loop of the server until the harness stops it
+static void *harness_server_main(void *arg) {
+	(void) arg;
+	return (void *) (long) run_server_loop();
+}
+
+//Stop the server thread, signals are repeated in case one arrived before the loop blocked
+static int harness_stop_server(pthread_t server_thread) {
+	struct timespec deadline;
+	void *ret = NULL;
+
+	server_stop = 1;
+	for (;;) {
+		pthread_kill(server_thread, SIGUSR1);
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_nsec += HARNESS_STOP_INTERVAL_NS;
+		if (deadline.tv_nsec >= 1000000000L) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+		if (pthread_timedjoin_np(server_thread, &ret, &deadline) != ETIMEDOUT) {
+			break;
+		}
+	}
+	return (int) (long) ret;
+}
+
+//Run one case of the matrix with the client against the server thread
+static int harness_run_case(const struct harness_case *hc) {
+	bench_mode = hc->mode;
+	msg_size = hc->msg_size;
+	queue_depth = hc->queue_depth;
+	signal_interval = 16;
+	reverse_depth = 0;
+	post_batch = 0;
+
+	printf("==================== %s, %d bytes, queue depth %d \n", mode_names[hc->mode], hc->msg_size, hc->queue_depth);
+	return client_run();
+}
+
+//Write results as baseline, one "mode op bytes queue_depth metric value" line each
+static int harness_write_baseline(const char *path) {
+	FILE *file;
+	int r;
+
+	file = fopen(path, "w");
+	if (!file) {
+		printf("Could not open baseline %s \n", path);
+		return -errno;
+	}
+
+	fprintf(file, "# roce_harness baseline: mode op bytes queue_depth metric value \n");
+	fprintf(file, "# device %s, kernel %s, cpu %s \n", run_env.device, run_env.kernel, run_env.cpu);
+	for (r = 0; r < num_harness_results; r++) {
+		fprintf(file, "%s %s %.3f\n", harness_results[r].key, harness_results[r].metric, harness_results[r].value);
+	}
+
+	fclose(file);
+	printf("Baseline with %d results written to %s \n", num_harness_results, path);
+	return 0;
+}
+
+//Load baseline written by harness_write_baseline
+static int harness_read_baseline(const char *path, struct harness_result *baseline, int max_results) {
+	char line[256], mode[16], op[32], metric[16];
+	unsigned long bytes;
+	int depth, n = 0;
+	double value;
+	FILE *file;
+
+	file = fopen(path, "r");
+	if (!file) {
+		printf("Could not open baseline %s \n", path);
+		return -errno;
+	}
+
+	while (n < max_results && fgets(line, sizeof(line), file)) {
+		if (line[0] == '#' || sscanf(line, "%15s %31s %lu %d %15s %lf", mode, op, &bytes, &depth, metric, &value) != 6) {
+			continue;
+		}
+		snprintf(baseline[n].key, sizeof(baseline[n].key), "%s %s %lu %d", mode, op, bytes, depth);
+		snprintf(baseline[n].metric, sizeof(baseline[n].metric), "%s", metric);
+		baseline[n].value = value;
+		n++;
+	}
+
+	fclose(file);
+	return n;
+}
+
+//Compare results with the baseline, returns the number of regressions and missing results
+static int harness_compare(const char *path, double threshold) {
+	struct harness_result baseline[MAX_HARNESS_RESULTS];
+	const struct harness_result *base, *result;
+	int num_baseline, failures = 0, b, r;
+	double change;
+	const char *status;
+
+	num_baseline = harness_read_baseline(path, baseline, MAX_HARNESS_RESULTS);
+	if (num_baseline < 0) {
+		return 1;
+	}
+
+	printf("Comparison with %s (threshold %.1f%%) \n", path, threshold);
+	printf("%-32s %-9s %12s %12s %9s %s \n", "case", "metric", "baseline", "current", "change", "status");
+	for (r = 0; r < num_harness_results; r++) {
+		result = &harness_results[r];
+		base = NULL;
+		for (b = 0; b < num_baseline; b++) {
+			if (!strcmp(baseline[b].key, result->key) && !strcmp(baseline[b].metric, result->metric)) {
+				base = &baseline[b];
+				break;
+			}
+		}
+		if (!base || base->value <= 0) {
+			printf("%-32s %-9s %12s %12.3f %9s %s \n", result->key, result->metric, "-", result->value, "-", "new");
+			continue;
+		}
+
+		//Bandwidth regresses when it drops, latency when it grows
+		change = (result->value - base->value) / base->value * 100.0;
+		status = "ok";
+		if (!strcmp(result->metric, "mb_per_s") ? change < -threshold : change > threshold) {
+			status = "REGRESSION";
+			failures++;
+		}
+		printf("%-32s %-9s %12.3f %12.3f %+8.1f%% %s \n", result->key, result->metric, base->value, result->value, change, status);
+	}
+
+	//Baseline entries without result belong to cases that failed or operations that vanished
+	for (b = 0; b < num_baseline; b++) {
+		for (r = 0; r < num_harness_results; r++) {
+			if (!strcmp(baseline[b].key, harness_results[r].key) && !strcmp(baseline[b].metric, harness_results[r].metric)) {
+				break;
+			}
+		}
+		if (r == num_harness_results) {
+			printf("%-32s %-9s %12.3f %12s %9s %s \n", baseline[b].key, baseline[b].metric, baseline[b].value, "-", "-", "MISSING");
+			failures++;
+		}
+	}
+
+	return failures;
+}
+
+//Print usage of roce_harness.c
+static void harness_show_usage() {
+	printf("How to use: \n");
+	printf("roce_harness: [-p <port> (default %d)] [-n <iterations> (default %d)] [-w <warmup iterations> (default %d)] \n",
+			DEFAULT_RDMA_PORT, HARNESS_ITERATIONS, HARNESS_WARMUP);
+	printf("              [-B <baseline file> (fail on regressions against it)] [-W <baseline file> (write results as new baseline)] \n");
+	printf("              [-t <threshold in percent> (default %.0f)] [-c <event|poll|adaptive> (completion mode of both sides, default event)] \n", DEFAULT_THRESHOLD);
+	printf("              [-A <post|wr> (posting API of the client, default post)] [-O <file> (append JSON records to file)] \n");
+	exit(1);
+}
+
+//Main function
+int main(int argc, char **argv) {
+	enum roce_cq_mode cq_mode = ROCE_CQ_EVENT;
+	enum roce_post_api post_api = ROCE_POST_LEGACY;
+	const char *baseline_path = NULL, *write_path = NULL;
+	double threshold = DEFAULT_THRESHOLD;
+	struct sigaction stop_action;
+	pthread_t server_thread;
+	int ret, option, i, failed_cases = 0, regressions = 0;
+
+	bzero(&server_sockaddr, sizeof server_sockaddr);
+	server_sockaddr.sin_family = AF_INET;
+	server_sockaddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	server_sockaddr.sin_port = htons(DEFAULT_RDMA_PORT);
+	iterations = HARNESS_ITERATIONS;
+	warmup = HARNESS_WARMUP;
+
+	//Parse command line arguments
+	while ((option = getopt(argc, argv, "p:n:w:B:W:t:c:A:O:")) != -1) {
+		switch (option) {
+			case 'p':
+				server_sockaddr.sin_port = htons(strtol(optarg, NULL, 0));
+				break;
+			case 'n':
+				iterations = atoi(optarg);
+				if (iterations < 1) {
+					harness_show_usage();
+				}
+				break;
+			case 'w':
+				warmup = atoi(optarg);
+				if (warmup < 0) {
+					harness_show_usage();
+				}
+				break;
+			case 'B':
+				baseline_path = optarg;
+				break;
+			case 'W':
+				write_path = optarg;
+				break;
+			case 't':
+				threshold = atof(optarg);
+				if (threshold < 0) {
+					harness_show_usage();
+				}
+				break;
+			case 'c':
+				if (roce_parse_cq_mode(optarg, &cq_mode)) {
+					harness_show_usage();
+				}
+				break;
+			case 'A':
+				if (roce_parse_post_api(optarg, &post_api)) {
+					harness_show_usage();
+				}
+				break;
+			case 'O':
+				output_format = OUTPUT_JSON;
+				output_path = optarg;
+				break;
+			default:
+				harness_show_usage();
+				break;
+		}
+	}
+
+	roce_set_cq_mode(cq_mode, DEFAULT_CQ_SPIN_US);
+	roce_set_post_api(post_api);
+	roce_set_clock(timestamp_clock);
+	roce_print_clock();
+
+	//The client hands every measurement to the harness, JSON records are only written with -O
+	record_sink = harness_record;
+	output_file = stdout;
+	if (output_path) {
+		output_file = fopen(output_path, "a");
+		if (!output_file) {
+			printf("Could not open output file %s \n", output_path);
+			return 1;
+		}
+	}
+
+	//Server serves every case of the matrix, SIGUSR1 interrupts its event loop once all cases ran
+	daemon_mode = 1;
+	bzero(&stop_action, sizeof(stop_action));
+	stop_action.sa_handler = handle_stop_signal;
+	sigaction(SIGUSR1, &stop_action, NULL);
+
+	ret = start_roce_server(&server_sockaddr);
+	if (ret) {
+		printf("Could not start server, is a Soft-RoCE device bound to the loopback interface? (rdma link add rxe_lo type rxe netdev lo) \n");
+		return 1;
+	}
+
+	ret = pthread_create(&server_thread, NULL, harness_server_main, NULL);
+	if (ret) {
+		printf("Could not create server thread \n");
+		stop_roce_server();
+		return 1;
+	}
+
+	for (i = 0; i < HARNESS_CASES; i++) {
+		ret = harness_run_case(&harness_matrix[i]);
+		if (ret) {
+			printf("Case %s, %d bytes, queue depth %d failed: %d \n", mode_names[harness_matrix[i].mode], harness_matrix[i].msg_size, harness_matrix[i].queue_depth, ret);
+			failed_cases++;
+		}
+	}
+
+	ret = harness_stop_server(server_thread);
+	if (ret) {
+		printf("Server event loop failed \n");
+		failed_cases++;
+	}
+	stop_roce_server();
+
+	if (output_file != stdout) {
+		fclose(output_file);
+	}
+
+	printf("==================== %d of %d cases passed \n", HARNESS_CASES - failed_cases, HARNESS_CASES);
+
+	if (write_path && !failed_cases && harness_write_baseline(write_path)) {
+		failed_cases++;
+	}
+	if (baseline_path) {
+		regressions = harness_compare(baseline_path, threshold);
+		printf("%d regressions \n", regressions);
+	}
+
+	return (failed_cases || regressions) ? 1 : 0;
+}
@@ -4,58 +4,380 @@
 #include "roce_common.h"
 #include "roce_common.c"
 
-//Basic Resources for RDMA connection
+//Maximum number of events handled per event loop iteration
+#define MAX_EPOLL_EVENTS (64)
+
+//Every n-th WRITE back to the client is signaled to retire the send queue
+#define WRITE_SIGNAL_INTERVAL (64)
+
+//Buffer sizes registered up front in daemon mode
+#define POOL_SIZE_CLASSES (4)
+#define DEFAULT_POOL_BUFFERS (4)
+static const uint32_t pool_class_sizes[POOL_SIZE_CLASSES] = { 4096, 65536, 1048576, 16777216 };
+
+//Allocators register memory for local access only, buffers a client may access get an MR of their own with remote rights
+//that is kept with the buffer across sessions
+#define SERVER_MEM_ACCESS (IBV_ACCESS_LOCAL_WRITE)
+#define SERVER_REMOTE_ACCESS (IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_WRITE | IBV_ACCESS_REMOTE_ATOMIC)
+
+//Default size of SRQ receive buffers
+#define DEFAULT_SRQ_SLOT_SIZE (4096)
+
+//Device resources shared by client sessions in daemon and SRQ mode
+struct server_device {
+	struct ibv_context *verbs;
+	struct ibv_pd *pd;
+	struct roce_mem_pool mem;
+
+	//Shared Receive Queue, refilled when fewer than srq_limit receives are left
+	struct ibv_srq *srq;
+	struct roce_recv_ring srq_ring;
+	uint32_t srq_limit;
+	uint64_t srq_refills;
+
+	//8-byte slot all atomic sessions in contention mode operate on
+	struct roce_mem atomic_slot;
+};
+
+//Lifecycle of a client connection
+enum server_conn_state {
+	CONN_ACCEPTING,
+	CONN_ESTABLISHED,
+	CONN_READY,
+};
+
+//Resources of one client connection
+struct server_conn {
+	enum server_conn_state state;
+	struct rdma_cm_id *cm_client_id;
+	struct ibv_pd *pd;
+	struct ibv_comp_channel *io_completion_channel;
+	struct ibv_cq *cq;
+	struct ibv_qp *client_qp;
+
+	//Memory resources for RDMA connection, taken from the shared allocator of the device or an own one
+	struct roce_mem_pool *mem, own_mem;
+	struct roce_mem client_metadata, server_buffer, server_metadata;
+	struct roce_buffer_attr *client_metadata_attr, *server_metadata_attr;
+	uint64_t registrations;
+	uint32_t max_inline;
+	struct ibv_recv_wr client_recv_wr, *bad_client_recv_wr;
+	struct ibv_send_wr server_send_wr, *bad_server_send_wr;
+	struct ibv_sge client_recv_sge, server_send_sge;
+
+	//Receive ring of echo and WRITE_WITH_IMM sessions, its slots complete with wr_id 1 + slot
+	struct roce_recv_ring recv_ring;
+	uint64_t echoed;
+
+	//Client asked for the PD of the device in its connect request
+	int shared_pd;
+
+	//Receives come from the SRQ of the device, the first one carries the client metadata
+	int srq;
+	int metadata_received;
+	enum roce_session_mode mode;
+
+	//WRITE ping-pong sessions poll the last byte of the server buffer for the next sequence number
+	int polling;
+	uint8_t expected_seq;
+
+	//Passive sessions receive checksum requests in the first half and answer from the second half
+	struct roce_mem checksum_mem;
+
+	//Bidirectional sessions write stream_count messages back with up to stream_depth of them in flight
+	uint32_t stream_count, stream_depth, streamed, stream_completed;
+	uint64_t stream_start_ns;
+
+	//CPU usage at start of the client session and time spent setting it up
+	struct roce_cpu_usage session_usage_start;
+	uint64_t setup_ns;
+
+	struct server_conn *next;
+};
+
+//Basic Resources for RDMA server
 static struct rdma_event_channel *cm_event_channel = NULL;
-static struct rdma_cm_id *cm_server_id = NULL, *cm_client_id = NULL;
-static struct ibv_pd *pd = NULL;
-static struct ibv_comp_channel *io_completion_channel = NULL;
-static struct ibv_cq *cq = NULL;
-static struct ibv_qp_init_attr qp_init_attr;
-static struct ibv_qp *client_qp = NULL;
-
-//Memory resources for RDMA connection
-static struct ibv_mr *client_metadata_mr = NULL, *server_buffer_mr = NULL, *server_metadata_mr = NULL;
-static struct roce_buffer_attr client_metadata_attr, server_metadata_attr;
-static struct ibv_recv_wr client_recv_wr, *bad_client_recv_wr = NULL;
-static struct ibv_send_wr server_send_wr, *bad_server_send_wr = NULL;
-static struct ibv_sge client_recv_sge, server_send_sge;
+static struct rdma_cm_id *cm_server_id = NULL;
+static int epoll_fd = -1;
+
+//Connected clients
+static struct server_conn *server_conns = NULL;
+static int num_server_conns = 0, num_served_clients = 0, num_polling_conns = 0;
+
+//Daemon mode keeps PD and registered buffers across sessions until SIGINT/SIGTERM
+static int daemon_mode = 0, pool_buffers = DEFAULT_POOL_BUFFERS;
+static uint32_t server_inline_size = 0;
+static uint32_t srq_depth = 0, srq_slot_size = DEFAULT_SRQ_SLOT_SIZE;
+static struct server_device device;
+static volatile sig_atomic_t server_stop = 0;
+
+//Stop event loop on SIGINT/SIGTERM
+static void handle_stop_signal(int signum) {
+	(void) signum;
+	server_stop = 1;
+}
+
+//Add file descriptor to event loop in non-blocking mode
+static int server_watch_fd(int fd, void *ptr) {
+	struct epoll_event event;
+	int flags;
+
+	flags = fcntl(fd, F_GETFL);
+	if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+		printf("Could not set fd to non-blocking \n");
+		return -errno;
+	}
+
+	bzero(&event, sizeof(event));
+	event.events = EPOLLIN;
+	event.data.ptr = ptr;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event)) {
+		printf("Could not add fd to event loop \n");
+		return -errno;
+	}
+
+	return 0;
+}
+
+//Create SRQ with its receive buffers and arm its low watermark
+static int setup_srq() {
+	struct ibv_srq_init_attr srq_init_attr;
+	struct ibv_srq_attr srq_attr;
+	struct ibv_device_attr dev_attr;
+	int ret = -1;
+
+	ret = ibv_query_device(device.verbs, &dev_attr);
+	if (ret) {
+		printf("Could not query device \n");
+		return -ret;
+	}
+	if (srq_depth > (uint32_t) dev_attr.max_srq_wr) {
+		printf("SRQ depth exceeds device limit of %d \n", dev_attr.max_srq_wr);
+		return -EINVAL;
+	}
+
+	bzero(&srq_init_attr, sizeof(srq_init_attr));
+	srq_init_attr.attr.max_wr = srq_depth;
+	srq_init_attr.attr.max_sge = 1;
+
+	device.srq = ibv_create_srq(device.pd, &srq_init_attr);
+	if (!device.srq) {
+		printf("Could not create SRQ \n");
+		return -errno;
+	}
+
+	ret = roce_recv_ring_init(&device.srq_ring, &device.mem, NULL, device.srq, srq_depth, srq_slot_size, 1);
+	if (ret) {
+		printf("Could not post SRQ receive buffers \n");
+		return ret;
+	}
+
+	//Slots are not reposted in batches but all at once when the watermark is reached
+	device.srq_ring.batch = srq_depth;
+
+	device.srq_limit = srq_depth / 4 ? srq_depth / 4 : 1;
+	bzero(&srq_attr, sizeof(srq_attr));
+	srq_attr.srq_limit = device.srq_limit;
+	ret = ibv_modify_srq(device.srq, &srq_attr, IBV_SRQ_LIMIT);
+	if (ret) {
+		printf("Could not arm SRQ limit \n");
+		return -ret;
+	}
+	printf("SRQ ready: %u receives of %u bytes, refilled below %u \n", srq_depth, srq_slot_size, device.srq_limit);
+
+	//SRQ limit events arrive on the asynchronous event fd of the device
+	return server_watch_fd(device.verbs->async_fd, &device);
+}
+
+//Repost consumed SRQ receives and re-arm the low watermark
+static int refill_srq() {
+	struct ibv_srq_attr srq_attr;
+	int ret = -1;
+
+	ret = roce_recv_ring_flush(&device.srq_ring);
+	if (ret) {
+		return ret;
+	}
+	device.srq_refills++;
+
+	bzero(&srq_attr, sizeof(srq_attr));
+	srq_attr.srq_limit = device.srq_limit;
+	ret = ibv_modify_srq(device.srq, &srq_attr, IBV_SRQ_LIMIT);
+	if (ret) {
+		printf("Could not arm SRQ limit \n");
+		return -ret;
+	}
+
+	return 0;
+}
+
+//Handle asynchronous events of the device
+static int handle_async_events() {
+	struct ibv_async_event event;
+	int ret = 0;
+
+	while (!ibv_get_async_event(device.verbs, &event)) {
+		if (event.event_type == IBV_EVENT_SRQ_LIMIT_REACHED) {
+			ret = refill_srq();
+		}
+		ibv_ack_async_event(&event);
+		if (ret) {
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+//Set up shared PD, pre-registered buffer pool and SRQ for a device
+static int setup_device_resources(struct ibv_context *verbs) {
+	struct roce_mem *buffers;
+	uint64_t start = roce_get_time_ns();
+	int size_class, i, ret = -1;
+
+	device.verbs = verbs;
+
+	//Allocate Protection Domain shared by all sessions
+	device.pd = ibv_alloc_pd(verbs);
+	if (!device.pd) {
+		printf("Could not allocate PD \n");
+		return -errno;
+	}
+	roce_mem_pool_init(&device.mem, device.pd, SERVER_MEM_ACCESS);
+
+	if (srq_depth) {
+		ret = setup_srq();
+		if (ret) {
+			return ret;
+		}
+	}
+
+	//Buffers are only kept registered in daemon mode
+	if (!daemon_mode) {
+		return 0;
+	}
+
+	buffers = calloc(pool_buffers + 1, sizeof(*buffers));
+	if (!buffers) {
+		printf("Could not allocate memory \n");
+		return -ENOMEM;
+	}
+
+	//Allocating, exposing and releasing buffers leaves them and their remote MRs registered in the allocator
+	for (size_class = 0; size_class < POOL_SIZE_CLASSES; size_class++) {
+		for (i = 0; i < pool_buffers; i++) {
+			ret = roce_mem_alloc(&device.mem, pool_class_sizes[size_class], &buffers[i]);
+			if (!ret) {
+				ret = roce_mem_expose(&device.mem, &buffers[i], SERVER_REMOTE_ACCESS);
+			}
+			if (ret) {
+				printf("Could not pre-register buffer \n");
+				break;
+			}
+		}
+		for (i = 0; i < pool_buffers; i++) {
+			roce_mem_free(&device.mem, &buffers[i]);
+		}
+		if (ret) {
+			free(buffers);
+			return ret;
+		}
+	}
+	free(buffers);
+
+	printf("Device resources ready: shared PD, %d buffers of %d size classes registered in %.3f ms \n",
+			pool_buffers, POOL_SIZE_CLASSES, (roce_get_time_ns() - start) / 1e6);
+	roce_print_mem_placement(&device.mem);
+
+	return 0;
+}
+
+//Release shared PD and buffer pool
+static void cleanup_device_resources() {
+	int ret = -1;
+
+	if (!device.pd) {
+		return;
+	}
+
+	if (device.srq) {
+		printf("SRQ was refilled %lu times \n", device.srq_refills);
+		ret = ibv_destroy_srq(device.srq);
+		if (ret) {
+			printf("Could not destroy SRQ \n");
+		}
+		roce_recv_ring_destroy(&device.srq_ring, &device.mem);
+	}
+	roce_mem_free(&device.mem, &device.atomic_slot);
+
+	roce_mem_pool_destroy(&device.mem);
+
+	ret = ibv_dealloc_pd(device.pd);
+	if (ret) {
+		printf("Could not destroy PD \n");
+	}
+	device.pd = NULL;
+}
 
 //Prepare client connection before accepting it
-static int setup_client_resources() {
+static int setup_client_resources(struct server_conn *conn) {
+	struct ibv_qp_init_attr qp_init_attr;
 	int ret = -1;
-	if(!cm_client_id){
+	if(!conn->cm_client_id){
 		printf("Client id NULL \n");
 		return -EINVAL;
 	}
 
+	//Daemon and SRQ mode and contended atomics reuse the PD of the device, other devices get their own PD
+	if ((daemon_mode || srq_depth || conn->shared_pd) && !device.pd) {
+		ret = setup_device_resources(conn->cm_client_id->verbs);
+		if (ret) {
+			return ret;
+		}
+	}
+
 	//Allocate Protection Domain
-	pd = ibv_alloc_pd(cm_client_id->verbs);
-	if (!pd) {
-		printf("Could not allocate PD \n");
-		return -errno;
+	if (device.pd && device.verbs == conn->cm_client_id->verbs && (daemon_mode || srq_depth || conn->shared_pd)) {
+		conn->pd = device.pd;
+		conn->mem = &device.mem;
+	} else {
+		conn->pd = ibv_alloc_pd(conn->cm_client_id->verbs);
+		if (!conn->pd) {
+			printf("Could not allocate PD \n");
+			return -errno;
+		}
+		roce_mem_pool_init(&conn->own_mem, conn->pd, SERVER_MEM_ACCESS);
+		conn->mem = &conn->own_mem;
 	}
+	conn->registrations = conn->mem->registrations;
 
 	//Create Completion Channel
-	io_completion_channel = ibv_create_comp_channel(cm_client_id->verbs);
-	if (!io_completion_channel) {
+	conn->io_completion_channel = ibv_create_comp_channel(conn->cm_client_id->verbs);
+	if (!conn->io_completion_channel) {
 		printf("Could not create Comp Channel \n");
 		return -errno;
 	}
 
 	//Create Completion Queue
-	cq = ibv_create_cq(cm_client_id->verbs, CQ_CAPACITY, NULL, io_completion_channel, 0);
-	if (!cq) {
-		printf("CC \n");
+	conn->cq = ibv_create_cq(conn->cm_client_id->verbs, CQ_CAPACITY, conn, conn->io_completion_channel, 0);
+	if (!conn->cq) {
+		printf("Could not create CQ \n");
 		return -errno;
 	}
 
 	//Request for notification on CQ
-	ret = ibv_req_notify_cq(cq, 0);
+	ret = ibv_req_notify_cq(conn->cq, 0);
 	if (ret) {
 		printf("Activities on CQ could not be requested \n");
 		return -errno;
 	}
 
+	//Completion Channel is served by the event loop
+	ret = server_watch_fd(conn->io_completion_channel->fd, conn);
+	if (ret) {
+		return ret;
+	}
+
 	//Initialize Queue Pair Attributes
     bzero(&qp_init_attr, sizeof qp_init_attr);
 	qp_init_attr.cap.max_recv_sge = MAX_SGE;
@@ -63,23 +385,29 @@ static int setup_client_resources() {
     qp_init_attr.cap.max_send_sge = MAX_SGE;
     qp_init_attr.cap.max_send_wr = MAX_WR;
     qp_init_attr.qp_type = IBV_QPT_RC;
-    qp_init_attr.recv_cq = cq;
-    qp_init_attr.send_cq = cq;
+    qp_init_attr.recv_cq = conn->cq;
+    qp_init_attr.send_cq = conn->cq;
 
-	//Create Queue Pair
-    ret = rdma_create_qp(cm_client_id, pd, &qp_init_attr);
+	//QPs of the device share its SRQ instead of their own receive queue
+	if (conn->pd == device.pd && device.srq) {
+		qp_init_attr.srq = device.srq;
+		conn->srq = 1;
+	}
+
+	//Create Queue Pair with the largest inline size available up to the requested one
+    ret = roce_create_qp(conn->cm_client_id, conn->pd, &qp_init_attr, server_inline_size);
     if (ret) {
 	    printf("Could not create Queue Pair \n");
-	    return -errno;
+	    return ret;
     }
 
-    client_qp = cm_client_id->qp;
+    conn->client_qp = conn->cm_client_id->qp;
+    conn->max_inline = qp_init_attr.cap.max_inline_data;
     return ret;
 }
 
 //Start RDMA server
 static int start_roce_server(struct sockaddr_in *server_addr) {
-	struct rdma_cm_event *cm_event = NULL;
 	int ret = -1;
 
 	//Create CM Event Channel
@@ -113,205 +441,860 @@ static int start_roce_server(struct sockaddr_in *server_addr) {
 			inet_ntoa(server_addr->sin_addr),
 			ntohs(server_addr->sin_port));
 
-	//Process CM Event
-	ret = process_rdma_cm_event(cm_event_channel, RDMA_CM_EVENT_CONNECT_REQUEST, &cm_event);
-	if (ret) {
-		printf("Could not get CM Event \n");
-		return ret;
+	//Create event loop, CM events are identified by a NULL pointer
+	epoll_fd = epoll_create1(0);
+	if (epoll_fd < 0) {
+		printf("Could not create event loop \n");
+		return -errno;
 	}
 
-	//Acknowledge CM Event
-	cm_client_id = cm_event->id;
-	ret = rdma_ack_cm_event(cm_event);
-	if (ret) {
-		printf("Could not acknowledge CM Event \n");
-		return -errno;
+	//Daemon and SRQ mode set up the device right away if the address is bound to a device
+	if ((daemon_mode || srq_depth) && cm_server_id->verbs) {
+		ret = setup_device_resources(cm_server_id->verbs);
+		if (ret) {
+			return ret;
+		}
 	}
 
-	return ret;
+	return server_watch_fd(cm_event_channel->fd, NULL);
 }
 
 // Pre-post RB and accept client connection
-static int accept_client_connection() {
+static int accept_client_connection(struct server_conn *conn) {
 	struct rdma_conn_param conn_param;
-	struct rdma_cm_event *cm_event = NULL;
-	struct sockaddr_in remote_sockaddr; 
 	int ret = -1;
 
-	if (!cm_client_id || !client_qp) {
+	if (!conn->cm_client_id || !conn->client_qp) {
 		printf("Could not set up client resources \n");
 		return -EINVAL;
 	}
 
-	//Register metadata buffer
-    client_metadata_mr = roce_register_buffer(pd, &client_metadata_attr, sizeof(client_metadata_attr), (IBV_ACCESS_LOCAL_WRITE));
-	if (!client_metadata_mr){
+	//Allocate metadata buffer
+	ret = roce_mem_alloc(conn->mem, sizeof(*conn->client_metadata_attr), &conn->client_metadata);
+	if (ret) {
 		printf("Could not register client metadata \n");
-		return -ENOMEM;
-	}	
+		return ret;
+	}
+	conn->client_metadata_attr = conn->client_metadata.addr;
 
 	//Fill up SGE
-	client_recv_sge.addr = (uint64_t) client_metadata_mr->addr; 
-	client_recv_sge.length = client_metadata_mr->length;
-	client_recv_sge.lkey = client_metadata_mr->lkey;
+	conn->client_recv_sge.addr = (uint64_t) conn->client_metadata.addr;
+	conn->client_recv_sge.length = conn->client_metadata.length;
+	conn->client_recv_sge.lkey = conn->client_metadata.lkey;
 
 	//Link SGE to Receive Work Request
-	bzero(&client_recv_wr, sizeof(client_recv_wr));
-	client_recv_wr.sg_list = &client_recv_sge;
-	client_recv_wr.num_sge = 1;
-
-	//Pre-post buffer
-	ret = ibv_post_recv(client_qp, &client_recv_wr, &bad_client_recv_wr);
-	if (ret) {
-		printf("Could not pre-post RB \n");
-		return ret;
-	}	
+	bzero(&conn->client_recv_wr, sizeof(conn->client_recv_wr));
+	conn->client_recv_wr.sg_list = &conn->client_recv_sge;
+	conn->client_recv_wr.num_sge = 1;
+
+	//Pre-post buffer, with an SRQ the metadata arrives in one of its buffers
+	if (!conn->srq) {
+		ret = ibv_post_recv(conn->client_qp, &conn->client_recv_wr, &conn->bad_client_recv_wr);
+		if (ret) {
+			printf("Could not pre-post RB \n");
+			return ret;
+		}
+	}
 
 	//Set up connection parameters
 	memset(&conn_param, 0, sizeof(conn_param));
     conn_param.initiator_depth = 3;
     conn_param.responder_resources = 3;
+    conn_param.rnr_retry_count = 7;
 
-	//Accept client connection
-	ret = rdma_accept(cm_client_id, &conn_param);
+	//Accept client connection, establishment is reported by the event loop
+	ret = rdma_accept(conn->cm_client_id, &conn_param);
     if (ret) {
 	    printf("Could not accept connection \n");
 	    return -errno;
     }
 
-	//Process CM Event
-	ret = process_rdma_cm_event(cm_event_channel, RDMA_CM_EVENT_ESTABLISHED, &cm_event);
-    if (ret) {
-		printf("Could not get CM event \n");
-		return -errno;
-	}
+	return ret;
+}
 
-	//Acknowledge CM Event
-	ret = rdma_ack_cm_event(cm_event);
-	if (ret) {
-		printf("Could not acknowledge CM event \n");
-		return -errno;
+//Post receive for the next checksum request of a passive session, with an SRQ it arrives in a slot of the SRQ
+static int post_checksum_recv(struct server_conn *conn) {
+	struct ibv_recv_wr recv_wr, *bad_recv_wr = NULL;
+	struct ibv_sge recv_sge;
+	int ret = -1;
+
+	if (conn->srq) {
+		return 0;
 	}
 
-	//Extract connection information
-	memcpy(&remote_sockaddr, rdma_get_peer_addr(cm_client_id), sizeof(struct sockaddr_in));
+	recv_sge.addr = (uint64_t) conn->checksum_mem.addr;
+	recv_sge.length = sizeof(struct roce_checksum_msg);
+	recv_sge.lkey = conn->checksum_mem.lkey;
 
-	printf("A new connection was accepted from %s \n", inet_ntoa(remote_sockaddr.sin_addr));
+	bzero(&recv_wr, sizeof(recv_wr));
+	recv_wr.sg_list = &recv_sge;
+	recv_wr.num_sge = 1;
 
-	return ret;
+	ret = ibv_post_recv(conn->client_qp, &recv_wr, &bad_recv_wr);
+	if (ret) {
+		printf("Could not post receive for checksum requests \n");
+		return -ret;
+	}
+
+	return 0;
 }
 
-//Send server metadata to client
-static int send_server_metadata_to_client() {
-	struct ibv_wc wc;
+//Send server metadata to client once its metadata was received
+static int send_server_metadata_to_client(struct server_conn *conn) {
+	uint64_t start = roce_get_time_ns();
+	uint32_t depth;
 	int ret = -1;
 
-	//Process WC event
-	ret = process_wc_events(io_completion_channel, &wc, 1);
-	if (ret != 1) {
-		printf("Failed to receive , ret = %d \n", ret);
-		return ret;
+	//Echoed messages have to fit into the buffers of the SRQ
+	conn->mode = conn->client_metadata_attr->mode;
+	if (conn->srq && conn->mode == ROCE_SESSION_ECHO && conn->client_metadata_attr->length > device.srq_ring.slot_size) {
+		printf("Messages do not fit into SRQ buffers, session is not echoed \n");
+		conn->mode = ROCE_SESSION_PASSIVE;
 	}
 
-	//Allocate buffer
-    server_buffer_mr = roce_alloc_buffer(pd, client_metadata_attr.length, (IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_WRITE));
-    if(!server_buffer_mr){
+	//Contended slot only exists in the PD of the device
+	if (conn->mode == ROCE_SESSION_ATOMIC_SHARED && conn->pd != device.pd) {
+		printf("Client is not on the shared PD, atomics are not contended \n");
+		conn->mode = ROCE_SESSION_ATOMIC;
+	}
+	if (conn->mode == ROCE_SESSION_ATOMIC_SHARED && !device.atomic_slot.addr) {
+		ret = roce_mem_alloc(&device.mem, sizeof(uint64_t), &device.atomic_slot);
+		if (ret) {
+			printf("Could not allocate atomic slot \n");
+			return ret;
+		}
+		memset(device.atomic_slot.addr, 0, sizeof(uint64_t));
+		ret = roce_mem_expose(&device.mem, &device.atomic_slot, SERVER_REMOTE_ACCESS);
+		if (ret) {
+			printf("Could not register atomic slot \n");
+			return ret;
+		}
+	}
+
+	//Echo sessions need their receive ring posted before the client learns it may start,
+	//WRITE_WITH_IMM and the SEND starting a bidirectional stream only consume receives without data
+	if (!conn->srq && (conn->mode == ROCE_SESSION_ECHO || conn->mode == ROCE_SESSION_WRITE_IMM || conn->mode == ROCE_SESSION_BIDIR)) {
+		depth = conn->client_metadata_attr->depth;
+		if (depth < 1 || depth > MAX_WR - 1) {
+			depth = ROCE_RECV_RING_SLOTS;
+		}
+		ret = roce_recv_ring_init(&conn->recv_ring, conn->mem, conn->client_qp, NULL, depth,
+				conn->mode == ROCE_SESSION_ECHO ? conn->client_metadata_attr->length : 0, 1);
+		if (ret) {
+			printf("Could not set up receive ring \n");
+			return ret;
+		}
+	}
+
+	//Allocate buffer, the allocator reuses registered memory whenever possible
+    ret = roce_mem_alloc(conn->mem, conn->client_metadata_attr->length, &conn->server_buffer);
+    if (ret) {
 	    printf("Server failed to create a buffer \n");
-	    return -ENOMEM;
+	    return ret;
+    }
+
+	//Rkey of the client only reaches its own buffer, not those of other sessions or the allocator,
+	//buffers of the daemon pool were exposed up front and reuse their MR
+    ret = roce_mem_expose(conn->mem, &conn->server_buffer, SERVER_REMOTE_ACCESS);
+    if (ret) {
+	    printf("Server failed to register the buffer for remote access \n");
+	    return ret;
     }
 
-	//Add information to metadata buffer
-    server_metadata_attr.address = (uint64_t) server_buffer_mr->addr;
-    server_metadata_attr.length = (uint32_t) server_buffer_mr->length;
-    server_metadata_attr.stag.local_stag = (uint32_t) server_buffer_mr->lkey;
+	//Sequence byte starts out cleared and is polled from now on
+    if (conn->mode == ROCE_SESSION_WRITE_POLL && conn->server_buffer.length) {
+	    memset(conn->server_buffer.addr, 0, conn->server_buffer.length);
+	    conn->expected_seq = 1;
+	    conn->polling = 1;
+	    num_polling_conns++;
+    }
 
-	//Register metadata buffer
-    server_metadata_mr = roce_register_buffer(pd, &server_metadata_attr, sizeof(server_metadata_attr), IBV_ACCESS_LOCAL_WRITE);
-    if(!server_metadata_mr){
+	//Stream back as many messages as the client sends, the send queue bounds the depth
+    if (conn->mode == ROCE_SESSION_BIDIR) {
+	    conn->stream_count = conn->client_metadata_attr->count;
+	    conn->stream_depth = conn->client_metadata_attr->queue_depth;
+	    if (conn->stream_depth < 1 || conn->stream_depth > MAX_WR) {
+		    conn->stream_depth = MAX_WR;
+	    }
+	    conn->streamed = conn->stream_completed = 0;
+    }
+
+	//Client may ask for the checksum of the buffer once it has written it
+    if (conn->mode == ROCE_SESSION_PASSIVE) {
+	    ret = roce_mem_alloc(conn->mem, 2 * sizeof(struct roce_checksum_msg), &conn->checksum_mem);
+	    if (ret) {
+		    printf("Server failed to create a checksum buffer \n");
+		    return ret;
+	    }
+	    ret = post_checksum_recv(conn);
+	    if (ret) {
+		    return ret;
+	    }
+    }
+
+	//Atomics of the session start counting from zero, the allocator keeps buffers 64-byte aligned
+    if (conn->mode == ROCE_SESSION_ATOMIC && conn->server_buffer.length >= sizeof(uint64_t)) {
+	    memset(conn->server_buffer.addr, 0, sizeof(uint64_t));
+    }
+
+	//Allocate metadata buffer
+    ret = roce_mem_alloc(conn->mem, sizeof(*conn->server_metadata_attr), &conn->server_metadata);
+    if (ret) {
 	    printf("Server failed to create to hold server metadata \n");
-	    return -ENOMEM;
+	    return ret;
+    }
+    conn->server_metadata_attr = conn->server_metadata.addr;
+
+	//Add information to metadata buffer, the client accesses the buffer with its rkey
+    conn->server_metadata_attr->address = (uint64_t) conn->server_buffer.addr;
+    conn->server_metadata_attr->length = conn->server_buffer.length;
+    conn->server_metadata_attr->stag.remote_stag = conn->server_buffer.rkey;
+    conn->server_metadata_attr->mode = conn->mode;
+    conn->server_metadata_attr->depth = conn->srq ? device.srq_limit : conn->recv_ring.slots;
+
+	//Contending clients all get the slot of the device instead of their own buffer
+    if (conn->mode == ROCE_SESSION_ATOMIC_SHARED) {
+	    conn->server_metadata_attr->address = (uint64_t) device.atomic_slot.addr;
+	    conn->server_metadata_attr->length = sizeof(uint64_t);
+	    conn->server_metadata_attr->stag.remote_stag = device.atomic_slot.rkey;
     }
 
 	//Fill up SGE
-    server_send_sge.addr = (uint64_t) &server_metadata_attr;
-    server_send_sge.length = sizeof(server_metadata_attr);
-    server_send_sge.lkey = server_metadata_mr->lkey;
+    conn->server_send_sge.addr = (uint64_t) conn->server_metadata.addr;
+    conn->server_send_sge.length = conn->server_metadata.length;
+    conn->server_send_sge.lkey = conn->server_metadata.lkey;
 
 	//Link SGE to Send Work Request
-    bzero(&server_send_wr, sizeof(server_send_wr));
-    server_send_wr.sg_list = &server_send_sge;
-    server_send_wr.num_sge = 1;
-    server_send_wr.opcode = IBV_WR_SEND; 
-    server_send_wr.send_flags = IBV_SEND_SIGNALED;
-
-	//Post Send Work Request
-    ret = ibv_post_send(client_qp, &server_send_wr, &bad_server_send_wr);
+    bzero(&conn->server_send_wr, sizeof(conn->server_send_wr));
+    conn->server_send_wr.sg_list = &conn->server_send_sge;
+    conn->server_send_wr.num_sge = 1;
+    conn->server_send_wr.opcode = IBV_WR_SEND;
+    conn->server_send_wr.send_flags = IBV_SEND_SIGNALED;
+    if (conn->server_send_sge.length <= conn->max_inline) {
+	    conn->server_send_wr.send_flags |= IBV_SEND_INLINE;
+    }
+
+	//Post Send Work Request, its completion is handled by the event loop
+    ret = ibv_post_send(conn->client_qp, &conn->server_send_wr, &conn->bad_server_send_wr);
     if (ret) {
 	    printf("Could not post server metadata \n");
 	    return -errno;
     }
 
-	//Process WC event
-    ret = process_wc_events(io_completion_channel, &wc, 1);
-    if (ret != 1) {
-	    printf("Could not send server metadata \n");
-	    return ret;
-    }
-
+    conn->setup_ns += roce_get_time_ns() - start;
     return 0;
 }
 
-//Wait for client to disconnect and clean up resources
-static int disconnect_and_cleanup() {
-	struct rdma_cm_event *cm_event = NULL;
+//Report memory pinned by the device allocator and all connections with an own allocator
+static void report_pinned_memory() {
+	struct server_conn *conn;
+	uint64_t registered = device.mem.registered_bytes, allocated = device.mem.allocated_bytes;
+
+	for (conn = server_conns; conn; conn = conn->next) {
+		if (conn->mem == &conn->own_mem) {
+			registered += conn->own_mem.registered_bytes;
+			allocated += conn->own_mem.allocated_bytes;
+		}
+	}
+
+	printf("Pinned memory with %d clients (%s): %lu KiB registered, %lu KiB in use \n", num_server_conns,
+			device.srq ? "SRQ" : "per-QP receives", registered / 1024, allocated / 1024);
+}
+
+//Clean up resources of a client connection
+static int disconnect_and_cleanup(struct server_conn *conn) {
+	struct roce_cpu_usage session_usage_end;
+	struct server_conn **link;
 	int ret = -1;
 
-	//Process CM Event
-    ret = process_rdma_cm_event(cm_event_channel, RDMA_CM_EVENT_DISCONNECTED, &cm_event);
-    if (ret) {
-	    printf("Could not get disconnect Event \n");
-	    return ret;
-    }
+	//Remove connection from list of connected clients
+	for (link = &server_conns; *link; link = &(*link)->next) {
+		if (*link == conn) {
+			*link = conn->next;
+			num_server_conns--;
+			break;
+		}
+	}
 
-	//Acknowledge CM Event
-	ret = rdma_ack_cm_event(cm_event);
-	if (ret) {
-		printf("Could not acknowledge CM Event \n");
-		return -errno;
+	//Report setup time and CPU cost of the client session
+	if (conn->state != CONN_ACCEPTING) {
+		printf("Session setup: %.3f us (%s PD, %lu new memory registrations) \n", conn->setup_ns / 1000.0,
+				conn->pd == device.pd ? "shared" : "new", conn->mem->registrations - conn->registrations);
+		if (conn->echoed) {
+			printf("Echoed %lu messages \n", conn->echoed);
+		}
+		roce_get_cpu_usage(&session_usage_end);
+		roce_print_cpu_usage(&conn->session_usage_start, &session_usage_end);
+		roce_print_mem_placement(conn->mem);
 	}
 
 	//Destroy QP
-	rdma_destroy_qp(cm_client_id);
+	if (conn->client_qp) {
+		rdma_destroy_qp(conn->cm_client_id);
+	}
 
 	//Destroy CM ID
-	ret = rdma_destroy_id(cm_client_id);
+	ret = rdma_destroy_id(conn->cm_client_id);
 	if (ret) {
 		printf("Could not destroy Client CM ID \n");
 	}
 
 	//Destroy CQ
-	ret = ibv_destroy_cq(cq);
+	if (conn->cq) {
+		ret = ibv_destroy_cq(conn->cq);
+		if (ret) {
+			printf("Could not destroy CQ \n");
+		}
+	}
+
+	//Destroy Completion Channel, this also removes it from the event loop
+	if (conn->io_completion_channel) {
+		ret = ibv_destroy_comp_channel(conn->io_completion_channel);
+		if (ret) {
+			printf("Could not destr \n");
+		}
+	}
+
+	if (conn->polling) {
+		num_polling_conns--;
+	}
+
+	//Return buffers, only an own allocator is torn down with the connection
+	if (conn->mem) {
+		roce_recv_ring_destroy(&conn->recv_ring, conn->mem);
+		roce_mem_free(conn->mem, &conn->server_buffer);
+		roce_mem_free(conn->mem, &conn->server_metadata);
+		roce_mem_free(conn->mem, &conn->client_metadata);
+		roce_mem_free(conn->mem, &conn->checksum_mem);
+		if (conn->mem == &conn->own_mem) {
+			roce_mem_pool_destroy(&conn->own_mem);
+		}
+	}
+
+	//Destroy PD unless it is shared
+	if (conn->pd && conn->pd != device.pd) {
+		ret = ibv_dealloc_pd(conn->pd);
+		if (ret) {
+			printf("Could not destroy PD \n");
+		}
+	}
+
+	free(conn);
+	return 0;
+}
+
+//Handle new connection request from a client
+static int handle_connect_request(struct rdma_cm_id *cm_client_id, uint32_t connect_flags) {
+	struct server_conn *conn;
+	uint64_t start = roce_get_time_ns();
+	int ret = -1;
+
+	conn = calloc(1, sizeof(*conn));
+	if (!conn) {
+		printf("Could not allocate connection \n");
+		rdma_reject(cm_client_id, NULL, 0);
+		rdma_destroy_id(cm_client_id);
+		return -ENOMEM;
+	}
+
+	conn->state = CONN_ACCEPTING;
+	conn->cm_client_id = cm_client_id;
+	conn->shared_pd = !!(connect_flags & ROCE_CONNECT_SHARED_PD);
+	cm_client_id->context = conn;
+	conn->next = server_conns;
+	server_conns = conn;
+	num_server_conns++;
+
+	ret = setup_client_resources(conn);
 	if (ret) {
-		printf("Could not destroy CQ \n");
+		printf("Could not set up client resources \n");
+		rdma_reject(cm_client_id, NULL, 0);
+		disconnect_and_cleanup(conn);
+		return ret;
 	}
 
-	//Destroy Completion Channel
-	ret = ibv_destroy_comp_channel(io_completion_channel);
+	ret = accept_client_connection(conn);
 	if (ret) {
-		printf("Could not destr \n");
+		printf("Could not accept client connection \n");
+		disconnect_and_cleanup(conn);
+		return ret;
 	}
 
-	//Free and deregister buffers
-	roce_free_buffer(server_buffer_mr);
-	roce_deregister_buffer(server_metadata_mr);	
-	roce_deregister_buffer(client_metadata_mr);	
+	conn->setup_ns += roce_get_time_ns() - start;
+	return 0;
+}
+
+//Process all pending CM Events
+static int handle_cm_events() {
+	struct rdma_cm_event *cm_event = NULL;
+	struct rdma_cm_id *cm_id;
+	struct server_conn *conn;
+	struct sockaddr_in remote_sockaddr;
+	enum rdma_cm_event_type event_type;
+	struct roce_connect_data connect_data;
+	int ret = -1;
+
+	while (1) {
+		ret = rdma_get_cm_event(cm_event_channel, &cm_event);
+		if (ret) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				return 0;
+			}
+			printf("Could not get CM Event \n");
+			return -errno;
+		}
 
-	//Destroy PD
-	ret = ibv_dealloc_pd(pd);
+		//Event must be acknowledged before its CM ID can be destroyed
+		cm_id = cm_event->id;
+		event_type = cm_event->event;
+		conn = cm_id->context;
+
+		//Private data of a connect request is released together with the event
+		bzero(&connect_data, sizeof(connect_data));
+		if (event_type == RDMA_CM_EVENT_CONNECT_REQUEST && cm_event->param.conn.private_data &&
+				cm_event->param.conn.private_data_len >= sizeof(connect_data)) {
+			memcpy(&connect_data, cm_event->param.conn.private_data, sizeof(connect_data));
+		}
+
+		ret = rdma_ack_cm_event(cm_event);
+		if (ret) {
+			printf("Could not acknowledge CM Event \n");
+			return -errno;
+		}
+
+		switch (event_type) {
+			case RDMA_CM_EVENT_CONNECT_REQUEST:
+				handle_connect_request(cm_id, connect_data.flags);
+				break;
+			case RDMA_CM_EVENT_ESTABLISHED:
+				//Extract connection information
+				memcpy(&remote_sockaddr, rdma_get_peer_addr(cm_id), sizeof(struct sockaddr_in));
+				printf("A new connection was accepted from %s \n", inet_ntoa(remote_sockaddr.sin_addr));
+
+				//Metadata may already have been exchanged when this event is handled
+				if (conn->state == CONN_ACCEPTING) {
+					conn->state = CONN_ESTABLISHED;
+				}
+				num_served_clients++;
+				roce_get_cpu_usage(&conn->session_usage_start);
+				report_pinned_memory();
+				break;
+			case RDMA_CM_EVENT_DISCONNECTED:
+			case RDMA_CM_EVENT_CONNECT_ERROR:
+			case RDMA_CM_EVENT_UNREACHABLE:
+			case RDMA_CM_EVENT_REJECTED:
+				if (conn) {
+					printf("Client connection closed (%s) \n", rdma_event_str(event_type));
+					disconnect_and_cleanup(conn);
+				}
+				break;
+			default:
+				printf("Unexpected event received (%s) \n", rdma_event_str(event_type));
+				break;
+		}
+	}
+}
+
+//Get receive ring a connection consumes, the device SRQ is shared by all connections using it
+static struct roce_recv_ring *conn_recv_ring(struct server_conn *conn) {
+	return conn->srq ? &device.srq_ring : &conn->recv_ring;
+}
+
+//Send received message back to the client straight from its ring slot
+static int echo_message(struct server_conn *conn, uint32_t slot, uint32_t length) {
+	struct ibv_send_wr echo_wr, *bad_echo_wr = NULL;
+	struct ibv_sge echo_sge;
+	int ret = -1;
+
+	echo_sge.addr = (uint64_t) roce_recv_ring_slot(conn_recv_ring(conn), slot);
+	echo_sge.length = length;
+	echo_sge.lkey = conn_recv_ring(conn)->mem.lkey;
+
+	bzero(&echo_wr, sizeof(echo_wr));
+	echo_wr.wr_id = 1 + slot;
+	echo_wr.sg_list = &echo_sge;
+	echo_wr.num_sge = 1;
+	echo_wr.opcode = IBV_WR_SEND;
+	echo_wr.send_flags = IBV_SEND_SIGNALED;
+	if (length <= conn->max_inline) {
+		echo_wr.send_flags |= IBV_SEND_INLINE;
+	}
+
+	ret = ibv_post_send(conn->client_qp, &echo_wr, &bad_echo_wr);
 	if (ret) {
-		printf("Could not destroy PD \n");
+		printf("Could not echo message \n");
+		return -ret;
+	}
+
+	conn->echoed++;
+	return 0;
+}
+
+//Write the message in the server buffer back into the client buffer, optionally with immediate data
+static int write_back(struct server_conn *conn, uint32_t length, int with_imm, uint32_t imm_data) {
+	struct ibv_send_wr write_wr, *bad_write_wr = NULL;
+	struct ibv_sge write_sge;
+	int ret = -1;
+
+	write_sge.addr = (uint64_t) conn->server_buffer.addr;
+	write_sge.length = length;
+	write_sge.lkey = conn->server_buffer.lkey;
+
+	bzero(&write_wr, sizeof(write_wr));
+	write_wr.wr_id = 1;
+	write_wr.sg_list = &write_sge;
+	write_wr.num_sge = 1;
+	write_wr.opcode = with_imm ? IBV_WR_RDMA_WRITE_WITH_IMM : IBV_WR_RDMA_WRITE;
+	write_wr.imm_data = imm_data;
+	write_wr.wr.rdma.remote_addr = conn->client_metadata_attr->address;
+	write_wr.wr.rdma.rkey = conn->client_metadata_attr->stag.remote_stag;
+	if ((conn->echoed + 1) % WRITE_SIGNAL_INTERVAL == 0) {
+		write_wr.send_flags |= IBV_SEND_SIGNALED;
+	}
+	if (length <= conn->max_inline) {
+		write_wr.send_flags |= IBV_SEND_INLINE;
+	}
+
+	ret = ibv_post_send(conn->client_qp, &write_wr, &bad_write_wr);
+	if (ret) {
+		printf("Could not write message back \n");
+		return -ret;
+	}
+
+	conn->echoed++;
+	return 0;
+}
+
+//Answer checksum request of the client with the digest of the server buffer, so data is verified without reading it back
+static int answer_checksum(struct server_conn *conn) {
+	struct roce_checksum_msg *request = conn->checksum_mem.addr, *reply = request + 1;
+	struct ibv_send_wr reply_wr, *bad_reply_wr = NULL;
+	struct ibv_sge reply_sge;
+	uint64_t start;
+	double elapsed_us;
+	int ret = -1;
+
+	reply->length = request->length < conn->server_buffer.length ? request->length : conn->server_buffer.length;
+	reply->segment_size = request->segment_size;
+
+	start = roce_get_time_ns();
+	reply->digest = roce_checksum_digest(conn->server_buffer.addr, reply->length, reply->segment_size);
+	elapsed_us = (roce_get_time_ns() - start) / 1000.0;
+	printf("Checksum of %lu bytes in segments of %lu bytes: %08x (%.3f usec, %.2f MB/s) \n", reply->length, reply->segment_size,
+			reply->digest, elapsed_us, elapsed_us > 0 ? reply->length / elapsed_us : 0.0);
+
+	//Request was consumed, the receive is reposted before replying so the next request always finds one
+	ret = post_checksum_recv(conn);
+	if (ret) {
+		return ret;
+	}
+
+	reply_sge.addr = (uint64_t) reply;
+	reply_sge.length = sizeof(*reply);
+	reply_sge.lkey = conn->checksum_mem.lkey;
+
+	//Completes like the metadata with wr_id 0
+	bzero(&reply_wr, sizeof(reply_wr));
+	reply_wr.sg_list = &reply_sge;
+	reply_wr.num_sge = 1;
+	reply_wr.opcode = IBV_WR_SEND;
+	reply_wr.send_flags = IBV_SEND_SIGNALED;
+	if (reply_sge.length <= conn->max_inline) {
+		reply_wr.send_flags |= IBV_SEND_INLINE;
+	}
+
+	ret = ibv_post_send(conn->client_qp, &reply_wr, &bad_reply_wr);
+	if (ret) {
+		printf("Could not send checksum \n");
+		return -ret;
+	}
+
+	return 0;
+}
+
+//Keep up to stream_depth WRITEs of a bidirectional session in flight, the last one carries immediate data
+//so the client knows all WRITEs before it have arrived
+static int stream_writes(struct server_conn *conn) {
+	struct ibv_send_wr write_wr, *bad_write_wr = NULL;
+	struct ibv_sge write_sge;
+	uint32_t interval = conn->stream_depth < WRITE_SIGNAL_INTERVAL ? conn->stream_depth : WRITE_SIGNAL_INTERVAL;
+	int last, ret = -1;
+
+	write_sge.addr = (uint64_t) conn->server_buffer.addr;
+	write_sge.length = conn->server_buffer.length;
+	write_sge.lkey = conn->server_buffer.lkey;
+
+	bzero(&write_wr, sizeof(write_wr));
+	write_wr.sg_list = &write_sge;
+	write_wr.num_sge = 1;
+	write_wr.wr.rdma.remote_addr = conn->client_metadata_attr->address;
+	write_wr.wr.rdma.rkey = conn->client_metadata_attr->stag.remote_stag;
+
+	while (conn->streamed < conn->stream_count && conn->streamed - conn->stream_completed < conn->stream_depth) {
+		last = (conn->streamed + 1 == conn->stream_count);
+
+		//Completion of a signaled WRITE reports how many WRITEs are finished
+		write_wr.wr_id = conn->streamed + 1;
+		write_wr.opcode = last ? IBV_WR_RDMA_WRITE_WITH_IMM : IBV_WR_RDMA_WRITE;
+		write_wr.send_flags = 0;
+		if (last || (conn->streamed + 1) % interval == 0) {
+			write_wr.send_flags |= IBV_SEND_SIGNALED;
+		}
+		if (write_sge.length <= conn->max_inline) {
+			write_wr.send_flags |= IBV_SEND_INLINE;
+		}
+
+		ret = ibv_post_send(conn->client_qp, &write_wr, &bad_write_wr);
+		if (ret) {
+			printf("Could not write stream to client \n");
+			return -ret;
+		}
+		conn->streamed++;
+	}
+
+	return 0;
+}
+
+//Answer the client once the next sequence number arrived in the last byte of the server buffer
+static int poll_write_pingpong(struct server_conn *conn) {
+	volatile uint8_t *seq = (volatile uint8_t *) conn->server_buffer.addr + conn->server_buffer.length - 1;
+	int ret = -1;
+
+	if (*seq != conn->expected_seq) {
+		return 0;
+	}
+
+	ret = write_back(conn, conn->server_buffer.length, 0, 0);
+	if (ret) {
+		return ret;
 	}
 
+	//Sequence numbers run from 1 to 255, a cleared byte never matches
+	conn->expected_seq = conn->expected_seq % 255 + 1;
+	return 1;
+}
+
+//Process all completions of a client connection
+static int process_client_completions(struct server_conn *conn) {
+	struct ibv_wc wc[16];
+	double elapsed_us;
+	int ret = -1, i, total_wc = 0;
+
+	do {
+		ret = roce_poll_cq(conn->cq, wc, 16);
+		if (ret < 0) {
+			printf("Could not poll CQ for WC \n");
+			return ret;
+		}
+
+		for (i = 0; i < ret; i++) {
+			//Flushed WRs of a closing connection are expected
+			if (wc[i].status == IBV_WC_WR_FLUSH_ERR) {
+				continue;
+			}
+			if (wc[i].status != IBV_WC_SUCCESS) {
+				printf("WC returned error: %s \n", ibv_wc_status_str(wc[i].status));
+				return -(wc[i].status);
+			}
+
+			//Metadata WRs have wr_id 0, ring slots and their echoes 1 + slot,
+			//with an SRQ the metadata is the first message received in a slot
+			if (wc[i].opcode == IBV_WC_RECV && !conn->metadata_received) {
+				if (conn->srq) {
+					memcpy(conn->client_metadata_attr, roce_recv_ring_slot(&device.srq_ring, wc[i].wr_id - 1),
+							sizeof(struct roce_buffer_attr));
+					if (roce_recv_ring_release(&device.srq_ring, wc[i].wr_id - 1)) {
+						rdma_disconnect(conn->cm_client_id);
+						continue;
+					}
+				}
+				conn->metadata_received = 1;
+				if (send_server_metadata_to_client(conn)) {
+					printf("Could not send server metadata to client \n");
+					rdma_disconnect(conn->cm_client_id);
+				}
+			} else if (wc[i].opcode == IBV_WC_RECV && conn->mode == ROCE_SESSION_PASSIVE) {
+				if (conn->srq) {
+					memcpy(conn->checksum_mem.addr, roce_recv_ring_slot(&device.srq_ring, wc[i].wr_id - 1), sizeof(struct roce_checksum_msg));
+					if (roce_recv_ring_release(&device.srq_ring, wc[i].wr_id - 1)) {
+						rdma_disconnect(conn->cm_client_id);
+						continue;
+					}
+				}
+				if (answer_checksum(conn)) {
+					rdma_disconnect(conn->cm_client_id);
+				}
+			} else if (wc[i].opcode == IBV_WC_RECV && conn->mode == ROCE_SESSION_BIDIR) {
+				//Client starts writing as well, both directions run at the same time
+				conn->stream_start_ns = roce_get_time_ns();
+				if (roce_recv_ring_release(conn_recv_ring(conn), wc[i].wr_id - 1) || stream_writes(conn)) {
+					rdma_disconnect(conn->cm_client_id);
+				}
+			} else if (wc[i].opcode == IBV_WC_RDMA_WRITE && conn->mode == ROCE_SESSION_BIDIR) {
+				conn->stream_completed = wc[i].wr_id;
+				if (conn->stream_completed == conn->stream_count) {
+					elapsed_us = (roce_get_time_ns() - conn->stream_start_ns) / 1000.0;
+					printf("Wrote %u messages of %lu bytes to client in %.3f usec (%.2f MB/s) \n", conn->stream_count,
+							conn->server_buffer.length, elapsed_us, ((double) conn->server_buffer.length * conn->stream_count) / elapsed_us);
+				} else if (stream_writes(conn)) {
+					rdma_disconnect(conn->cm_client_id);
+				}
+			} else if (wc[i].opcode == IBV_WC_RECV) {
+				if (echo_message(conn, wc[i].wr_id - 1, wc[i].byte_len)) {
+					rdma_disconnect(conn->cm_client_id);
+				}
+			} else if (wc[i].opcode == IBV_WC_RECV_RDMA_WITH_IMM) {
+				//Receive carries no data, so its slot is free right away
+				if (write_back(conn, wc[i].byte_len, 1, wc[i].imm_data) || roce_recv_ring_release(conn_recv_ring(conn), wc[i].wr_id - 1)) {
+					rdma_disconnect(conn->cm_client_id);
+				}
+			} else if (wc[i].opcode == IBV_WC_SEND && !wc[i].wr_id) {
+				conn->state = CONN_READY;
+			} else if (wc[i].opcode == IBV_WC_SEND) {
+				//Slot may be reused once its echo has left
+				if (roce_recv_ring_release(conn_recv_ring(conn), wc[i].wr_id - 1)) {
+					rdma_disconnect(conn->cm_client_id);
+				}
+			}
+		}
+		total_wc += ret;
+	} while (ret > 0);
+
+	return total_wc;
+}
+
+//Acknowledge completion events of a client connection and re-arm its CQ
+static int handle_cq_events(struct server_conn *conn) {
+	struct ibv_cq *cq_ptr = NULL;
+	void *context = NULL;
+	int ret = -1;
+
+	while (!ibv_get_cq_event(conn->io_completion_channel, &cq_ptr, &context)) {
+		ibv_ack_cq_events(cq_ptr, 1);
+	}
+
+	//Busy-polling does not need further notifications
+	if (roce_get_cq_mode(NULL) != ROCE_CQ_POLL) {
+		ret = ibv_req_notify_cq(conn->cq, 0);
+		if (ret) {
+			printf("Could not request more notifications \n");
+			return -errno;
+		}
+	}
+
+	return process_client_completions(conn);
+}
+
+//Serve CM Events and completions of all clients until the last client disconnected (or until stopped in daemon mode)
+static int run_server_loop() {
+	struct epoll_event events[MAX_EPOLL_EVENTS];
+	struct server_conn *conn, *next;
+	enum roce_cq_mode cq_mode;
+	uint64_t spin_ns, idle_since = 0;
+	int ret = -1, i, n, timeout, work, cm_ready, async_ready;
+
+	cq_mode = roce_get_cq_mode(&spin_ns);
+
+	while (!server_stop && (daemon_mode || !num_served_clients || num_server_conns)) {
+		//Busy-polling modes only block once the spin time ran out without any work
+		//Sessions polling memory keep the loop spinning as well
+		timeout = -1;
+		if (num_polling_conns || cq_mode == ROCE_CQ_POLL || (cq_mode == ROCE_CQ_ADAPTIVE && (!idle_since || roce_get_time_ns() - idle_since < spin_ns))) {
+			timeout = 0;
+		}
+
+		n = epoll_wait(epoll_fd, events, MAX_EPOLL_EVENTS, timeout);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			printf("Could not wait for events \n");
+			return -errno;
+		}
+
+		work = n;
+		cm_ready = 0;
+		async_ready = 0;
+		for (i = 0; i < n; i++) {
+			if (!events[i].data.ptr) {
+				cm_ready = 1;
+				continue;
+			}
+			if (events[i].data.ptr == &device) {
+				async_ready = 1;
+				continue;
+			}
+
+			conn = events[i].data.ptr;
+			if (handle_cq_events(conn) < 0) {
+				rdma_disconnect(conn->cm_client_id);
+			}
+		}
+
+		if (async_ready) {
+			ret = handle_async_events();
+			if (ret) {
+				return ret;
+			}
+		}
+
+		//CM Events may destroy connections, so they are handled after all completions
+		if (cm_ready) {
+			ret = handle_cm_events();
+			if (ret) {
+				return ret;
+			}
+		}
+
+		if (cq_mode != ROCE_CQ_EVENT) {
+			for (conn = server_conns; conn; conn = next) {
+				next = conn->next;
+				ret = process_client_completions(conn);
+				if (ret < 0) {
+					rdma_disconnect(conn->cm_client_id);
+				} else {
+					work += ret;
+				}
+			}
+		}
+
+		for (conn = server_conns; conn && num_polling_conns; conn = conn->next) {
+			if (!conn->polling) {
+				continue;
+			}
+			ret = poll_write_pingpong(conn);
+			if (ret < 0) {
+				conn->polling = 0;
+				num_polling_conns--;
+				rdma_disconnect(conn->cm_client_id);
+			} else {
+				work += ret;
+			}
+		}
+
+		if (work) {
+			idle_since = 0;
+		} else if (!idle_since) {
+			idle_since = roce_get_time_ns();
+		}
+	}
+
+	return 0;
+}
+
+//Stop RDMA server and clean up remaining resources
+static int stop_roce_server() {
+	int ret = -1;
+
+	while (server_conns) {
+		disconnect_and_cleanup(server_conns);
+	}
+
+	report_pinned_memory();
+	cleanup_device_resources();
+
+	close(epoll_fd);
+
 	//Destroy CM ID
 	ret = rdma_destroy_id(cm_server_id);
 	if (ret) {
@@ -324,25 +1307,36 @@ static int disconnect_and_cleanup() {
 	return 0;
 }
 
+//roce_harness.c runs the server in a thread of its own process
+#ifndef ROCE_HARNESS
+
 //Print usage for to start roce_server
-void show_usage() 
+void show_usage()
 {
 	printf("How to use: \n");
 	printf("roce_server: [-a <server_ip>] [-p <server_port>] \n");
+	printf("             [-c <event|poll|adaptive> (completion mode, default event)] [-y <adaptive spin time in usec> (default %d)] \n", DEFAULT_CQ_SPIN_US);
+	printf("             [-D (daemon mode, serve sessions until SIGINT/SIGTERM)] [-B <pre-registered buffers per size class> (daemon mode, default %d)] \n", DEFAULT_POOL_BUFFERS);
+	printf("             [-H <4k|2m|1g> (pages backing buffers, default 4k)] [-N (bind buffers to NUMA node of the device)] \n");
+	printf("             [-I <bytes|max> (post SENDs up to this size inline, default 0)] \n");
+	printf("             [-S <SRQ depth> (share one receive queue among all clients)] [-z <SRQ buffer size> (default %d)] \n", DEFAULT_SRQ_SLOT_SIZE);
 	exit(1);
 }
 
 //Main function
-int main(int argc, char **argv) 
+int main(int argc, char **argv)
 {
-	int ret, option;
+	int ret, option, cq_spin_us = DEFAULT_CQ_SPIN_US, bind_numa = 0;
+	enum roce_cq_mode cq_mode = ROCE_CQ_EVENT;
+	enum roce_page_size pages = ROCE_PAGES_4K;
 	struct sockaddr_in server_sockaddr;
+	struct sigaction stop_action;
 	bzero(&server_sockaddr, sizeof server_sockaddr);
 	server_sockaddr.sin_family = AF_INET;
 	server_sockaddr.sin_addr.s_addr = htonl(INADDR_ANY);
 
 	//Parse command line arguments
-	while ((option = getopt(argc, argv, "a:p:")) != -1) {
+	while ((option = getopt(argc, argv, "a:p:c:y:DB:H:NI:S:z:")) != -1) {
 		switch (option) {
 			//Parse optional IP address
 			case 'a':
@@ -354,7 +1348,61 @@ int main(int argc, char **argv)
 				break;
 			//Parse optional port number
 			case 'p':
-				server_sockaddr.sin_port = htons(strtol(optarg, NULL, 0)); 
+				server_sockaddr.sin_port = htons(strtol(optarg, NULL, 0));
+				break;
+			//Parse optional completion mode
+			case 'c':
+				if (roce_parse_cq_mode(optarg, &cq_mode)) {
+					show_usage();
+				}
+				break;
+			//Parse optional spin time for adaptive completion mode
+			case 'y':
+				cq_spin_us = atoi(optarg);
+				if (cq_spin_us < 0) {
+					show_usage();
+				}
+				break;
+			//Keep serving sessions with persistent device resources
+			case 'D':
+				daemon_mode = 1;
+				break;
+			//Parse optional buffer pool size
+			case 'B':
+				pool_buffers = atoi(optarg);
+				if (pool_buffers < 0) {
+					show_usage();
+				}
+				break;
+			//Parse pages backing registered buffers
+			case 'H':
+				if (roce_parse_page_size(optarg, &pages)) {
+					show_usage();
+				}
+				break;
+			//Place buffers on the NUMA node of the device
+			case 'N':
+				bind_numa = 1;
+				break;
+			//Parse requested inline size
+			case 'I':
+				if (roce_parse_inline_size(optarg, &server_inline_size)) {
+					show_usage();
+				}
+				break;
+			//Parse optional SRQ depth
+			case 'S':
+				if (atoi(optarg) <= 0) {
+					show_usage();
+				}
+				srq_depth = atoi(optarg);
+				break;
+			//Parse optional size of SRQ buffers
+			case 'z':
+				if (atoi(optarg) <= 0) {
+					show_usage();
+				}
+				srq_slot_size = atoi(optarg);
 				break;
 			default:
 				show_usage();
@@ -366,6 +1414,15 @@ int main(int argc, char **argv)
 		server_sockaddr.sin_port = htons(DEFAULT_RDMA_PORT);
 	}
 
+	roce_set_cq_mode(cq_mode, cq_spin_us);
+	roce_set_mem_placement(pages, bind_numa);
+
+	//Interrupt event loop on SIGINT/SIGTERM
+	bzero(&stop_action, sizeof(stop_action));
+	stop_action.sa_handler = handle_stop_signal;
+	sigaction(SIGINT, &stop_action, NULL);
+	sigaction(SIGTERM, &stop_action, NULL);
+
 	//Call all server-side functions
 	ret = start_roce_server(&server_sockaddr);
 	if (ret) {
@@ -373,29 +1430,14 @@ int main(int argc, char **argv)
 		return ret;
 	}
 
-	ret = setup_client_resources();
-	if (ret) { 
-		printf("Could not set up client resources /n");
-		return ret;
-	}
-
-	ret = accept_client_connection();
+	ret = run_server_loop();
 	if (ret) {
-		printf("Could not accept client connection \n");
-		return ret;
+		printf("Server event loop failed \n");
 	}
 
-	ret = send_server_metadata_to_client();
-	if (ret) {
-		printf("Could not send server metadata to client \n");
-		return ret;
-	}
+	stop_roce_server();
 
-	ret = disconnect_and_cleanup();
-	if (ret) { 
-		printf("Could not disconnect/clean up \n");
-		return ret;
-	}
-
-	return 0;
+	return ret;
 }
+
+#endif